@@ -0,0 +1,320 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "accesslog.h"
+
+#include <sys/stat.h>
+#include <netinet/tcp.h>
+
+namespace Ext {
+	namespace Inet {
+
+static int64_t UnixTimeUs() {
+	return chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void AccessRecord::Begin() {
+	StartUs = UnixTimeUs();
+}
+
+void AccessRecord::End(uint64_t bytesUp, uint64_t bytesDown) {
+	DurationMs = uint32_t((UnixTimeUs() - StartUs) / 1000);
+	BytesUp = bytesUp;
+	BytesDown = bytesDown;
+}
+
+void GetTcpBytes(int fd, uint64_t& sent, uint64_t& received) {
+	sent = received = 0;
+#if defined(__linux__) && defined(TCP_INFO)
+	// glibc's tcp_info predates these fields, the offsets are fixed by the kernel ABI (Linux 4.2+)
+	const size_t OFFSET_BYTES_ACKED = 120, OFFSET_BYTES_RECEIVED = 128;
+	uint8_t ti[256];
+	socklen_t len = sizeof ti;
+	if (::getsockopt(fd, IPPROTO_TCP, TCP_INFO, ti, &len) == 0 && len >= OFFSET_BYTES_RECEIVED + 8) {
+		memcpy(&sent, ti + OFFSET_BYTES_ACKED, 8);
+		memcpy(&received, ti + OFFSET_BYTES_RECEIVED, 8);
+	}
+#endif
+}
+
+// Single producer (the leasing thread), single consumer (the writer)
+struct CAccessLog::AccessRing {
+	atomic<unsigned> Head, Tail;
+	alignas(AccessRecord) uint8_t Slots[RING_SIZE][sizeof(AccessRecord)];		// not constructed: untouched pages stay unmapped
+
+	AccessRing()
+		: Head(0)
+		, Tail(0)
+	{}
+
+	AccessRecord& operator[](unsigned i) { return *(AccessRecord*)Slots[i & (RING_SIZE - 1)]; }
+};
+
+namespace {
+
+struct RingLease {
+	CAccessLog *Log = nullptr;
+	CAccessLog::AccessRing *Ring = nullptr;
+
+	~RingLease() {
+		if (Ring)
+			Log->ReleaseRing(Ring);
+	}
+};
+
+thread_local RingLease t_lease;
+
+} // anonymous::
+
+CAccessLog::CAccessLog(thread_group *tg, RCString path, AccessLogFormat format, uint64_t maxSize, int keep)
+	: base(tg)
+	, m_path(path)
+	, m_format(format)
+	, m_maxSize(maxSize)
+	, m_keep(keep)
+	, m_fd(-1)
+	, m_size(0)
+	, m_dropped(0)
+	, m_droppedReported(0)
+{
+	Open();
+}
+
+CAccessLog::~CAccessLog() {
+	if (m_fd >= 0)
+		::close(m_fd);
+}
+
+void CAccessLog::Open() {
+	m_fd = CCheck(::open(m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644));
+	struct stat st;
+	m_size = ::fstat(m_fd, &st) == 0 ? st.st_size : 0;
+}
+
+void CAccessLog::Rotate() {
+	::close(exchange(m_fd, -1));
+	for (int i = m_keep - 1; i > 0; --i)
+		::rename((m_path + "." + Convert::ToString(i)).c_str(), (m_path + "." + Convert::ToString(i + 1)).c_str());
+	if (m_keep > 0)
+		::rename(m_path.c_str(), (m_path + ".1").c_str());
+	else
+		::unlink(m_path.c_str());
+	Open();
+}
+
+CAccessLog::AccessRing *CAccessLog::AcquireRing() {
+	lock_guard<mutex> lk(m_mtx);
+	if (!m_freeRings.empty()) {
+		AccessRing *r = m_freeRings.back();
+		m_freeRings.pop_back();
+		return r;
+	}
+	m_rings.push_back(make_unique<AccessRing>());
+	return m_rings.back().get();
+}
+
+void CAccessLog::ReleaseRing(AccessRing *ring) {
+	lock_guard<mutex> lk(m_mtx);				// hands the producer side over to the next thread, undrained records stay in the ring
+	m_freeRings.push_back(ring);
+}
+
+void CAccessLog::Push(const AccessRecord& rec) {
+	if (t_lease.Log != this) {
+		if (t_lease.Ring)
+			t_lease.Log->ReleaseRing(t_lease.Ring);
+		t_lease.Log = this;
+		t_lease.Ring = AcquireRing();
+	}
+	AccessRing& r = *t_lease.Ring;
+	unsigned tail = r.Tail.load(memory_order_relaxed), n = tail - r.Head.load(memory_order_acquire);
+	if (n == RING_SIZE) {
+		++m_dropped;
+		return;
+	}
+	new(&r[tail]) AccessRecord(rec);
+	r.Tail.store(tail + 1, memory_order_release);
+	if (n + 1 == RING_SIZE / 4)
+		m_ev.Set();								// wake the writer early instead of waiting for its timer
+}
+
+void CAccessLog::Stop() {
+	base::Stop();
+	m_ev.Set();
+}
+
+static void AppendJsonString(string& s, const char *p, size_t len) {
+	s += '"';
+	for (const char *e = p + len; p != e; ++p) {
+		char ch = *p;
+		if (ch == '"' || ch == '\\') {
+			s += '\\';
+			s += ch;
+		} else if ((uint8_t)ch < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof buf, "\\u%04x", (uint8_t)ch);
+			s += buf;
+		} else
+			s += ch;
+	}
+	s += '"';
+}
+
+void AppendJsonEndPoint(string& s, const ProxyEndPoint& ep) {
+	char buf[INET6_ADDRSTRLEN + 16];
+	switch (ep.Kind) {
+	case ProxyEndPoint::IPv4:
+		::inet_ntop(AF_INET, ep.Address, buf, sizeof buf);
+		snprintf(buf + strlen(buf), 8, ":%u", ep.Port);
+		break;
+	case ProxyEndPoint::IPv6:
+		buf[0] = '[';
+		::inet_ntop(AF_INET6, ep.Address, buf + 1, sizeof buf - 1);
+		snprintf(buf + strlen(buf), 9, "]:%u", ep.Port);
+		break;
+	case ProxyEndPoint::Host:
+		{
+			string h = string(ep.HostName, ep.HostLength) + ":" + to_string(ep.Port);
+			AppendJsonString(s, h.data(), h.size());
+		}
+		return;
+	default:
+		s += "null";
+		return;
+	}
+	AppendJsonString(s, buf, strlen(buf));
+}
+
+void CAccessLog::FormatJson(const AccessRecord& rec) {
+	static const char * const s_types[] = { "connect", "bind", "udp", "resolve", "resolve_ptr" };
+
+	time_t t = time_t(rec.StartUs / 1000000);
+	tm tmUtc;
+	::gmtime_r(&t, &tmUtc);
+	char buf[128];
+	size_t n = strftime(buf, sizeof buf, "{\"ts\":\"%Y-%m-%dT%H:%M:%S", &tmUtc);
+	snprintf(buf + n, sizeof buf - n, ".%03dZ\",\"ver\":%u,\"type\":\"%s\",\"client\":", int(rec.StartUs / 1000 % 1000), rec.Ver, s_types[(int)rec.Typ]);
+	m_buf += buf;
+	AppendJsonEndPoint(m_buf, rec.Client);
+	m_buf += ",\"target\":";
+	AppendJsonEndPoint(m_buf, rec.Target);
+	snprintf(buf, sizeof buf, ",\"error\":%d,\"up\":%llu,\"down\":%llu,\"ms\":%u%s%s}\n"
+		, rec.Error, (unsigned long long)rec.BytesUp, (unsigned long long)rec.BytesDown, rec.DurationMs
+		, rec.Offloaded ? ",\"offloaded\":true" : "", rec.CacheHit ? ",\"cache_hit\":true" : "");
+	m_buf += buf;
+}
+
+#define ACCESS_FIELD(dst, s, f) memcpy((dst) + offsetof(remove_reference_t<decltype(s)>, f), &(s).f, sizeof (s).f)
+
+static void CopyEndPoint(char *dst, const ProxyEndPoint& ep) {
+	ACCESS_FIELD(dst, ep, Kind);
+	ACCESS_FIELD(dst, ep, HostLength);
+	ACCESS_FIELD(dst, ep, Port);
+	switch (ep.Kind) {
+	case ProxyEndPoint::IPv4:
+		memcpy(dst + offsetof(ProxyEndPoint, Address), ep.Address, 4);
+		break;
+	case ProxyEndPoint::IPv6:
+		memcpy(dst + offsetof(ProxyEndPoint, Address), ep.Address, 16);
+		break;
+	case ProxyEndPoint::Host:
+		memcpy(dst + offsetof(ProxyEndPoint, HostName), ep.HostName, ep.HostLength);
+		break;
+	default:
+		break;
+	}
+}
+
+// The native layout field by field over zeros: struct padding and the unused tail of the address/host name union would
+// otherwise carry whatever memory the record was built in
+static void AppendBinary(string& s, const AccessRecord& rec) {
+	char raw[sizeof(AccessRecord)] = {};
+	ACCESS_FIELD(raw, rec, StartUs);
+	ACCESS_FIELD(raw, rec, DurationMs);
+	ACCESS_FIELD(raw, rec, Error);
+	ACCESS_FIELD(raw, rec, BytesUp);
+	ACCESS_FIELD(raw, rec, BytesDown);
+	ACCESS_FIELD(raw, rec, Typ);
+	ACCESS_FIELD(raw, rec, Ver);
+	ACCESS_FIELD(raw, rec, Offloaded);
+	ACCESS_FIELD(raw, rec, CacheHit);
+	CopyEndPoint(raw + offsetof(AccessRecord, Client), rec.Client);
+	CopyEndPoint(raw + offsetof(AccessRecord, Target), rec.Target);
+	s.append(raw, sizeof raw);
+}
+
+#undef ACCESS_FIELD
+
+void CAccessLog::Drain() {
+	vector<AccessRing*> rings;
+	{
+		lock_guard<mutex> lk(m_mtx);
+		for (auto& r : m_rings)
+			rings.push_back(r.get());
+	}
+	m_buf.clear();
+	for (AccessRing *r : rings) {
+		unsigned head = r->Head.load(memory_order_relaxed), tail = r->Tail.load(memory_order_acquire);
+		for (; head != tail; ++head) {
+			const AccessRecord& rec = (*r)[head];
+			if (m_format == AccessLogFormat::Binary)
+				AppendBinary(m_buf, rec);
+			else
+				FormatJson(rec);
+		}
+		r->Head.store(head, memory_order_release);
+	}
+	TrimFreeRings();
+	uint64_t dropped = m_dropped;
+	if (dropped != m_droppedReported && m_format == AccessLogFormat::JsonLines)
+		m_buf += "{\"dropped\":" + to_string(dropped - exchange(m_droppedReported, dropped)) + "}\n";
+	for (const char *p = m_buf.data(), *e = p + m_buf.size(); p != e;) {
+		ssize_t r = ::write(m_fd, p, e - p);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			break;									// disk full or similar, the batch is lost
+		}
+		p += r;
+		m_size += r;
+	}
+	if (m_maxSize && m_size >= m_maxSize)
+		Rotate();
+}
+
+// Writer thread only, after a drain: a free ring has no producer, and no other consumer. Drained ones restart from the
+// first slot, so that the next thread touches the same page; those past MAX_FREE_RINGS are freed
+void CAccessLog::TrimFreeRings() {
+	lock_guard<mutex> lk(m_mtx);
+	size_t kept = 0;
+	vector<AccessRing*> surplus;
+	m_freeRings.erase(remove_if(m_freeRings.begin(), m_freeRings.end(), [&](AccessRing *r) {
+		if (r->Head.load(memory_order_relaxed) != r->Tail.load(memory_order_relaxed))
+			return false;											// pushed before the release, after this drain's look
+		r->Head.store(0, memory_order_relaxed);
+		r->Tail.store(0, memory_order_relaxed);
+		if (++kept <= MAX_FREE_RINGS)
+			return false;
+		surplus.push_back(r);
+		return true;
+	}), m_freeRings.end());
+	if (surplus.empty())
+		return;
+	sort(surplus.begin(), surplus.end());
+	m_rings.erase(remove_if(m_rings.begin(), m_rings.end(), [&surplus](const unique_ptr<AccessRing>& r) {
+		return binary_search(surplus.begin(), surplus.end(), r.get());
+	}), m_rings.end());
+}
+
+void CAccessLog::Execute() {
+	while (!m_bStop) {
+		m_ev.lock(100);
+		Drain();
+	}
+	Drain();
+}
+
+}} // Ext::Inet::
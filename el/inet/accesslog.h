@@ -0,0 +1,96 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include "proxy.h"
+
+namespace Ext {
+	namespace Inet {
+
+// One per tunnel, fixed size. The binary log format is the native layout of this struct, padding and unused host name bytes zeroed
+struct AccessRecord {
+	int64_t StartUs;				// Unix time
+	uint32_t DurationMs;
+	int32_t Error;					// error_code value of the failed handshake or connect, 0 on success
+	uint64_t BytesUp, BytesDown;	// client -> target, target -> client
+	QueryType Typ;
+	uint8_t Ver;					// first handshake byte: 4, 5 or the HTTP method letter
+	bool Offloaded;					// relayed in the kernel by the BPF sockmap
+	bool CacheHit;					// HTTP response served from the cache
+	ProxyEndPoint Client, Target;
+
+	AccessRecord()
+		: StartUs(0)
+		, DurationMs(0)
+		, Error(0)
+		, BytesUp(0)
+		, BytesDown(0)
+		, Typ(QueryType::Connect)
+		, Ver(0)
+		, Offloaded(false)
+		, CacheHit(false)
+	{}
+
+	void Begin();
+	void End(uint64_t bytesUp, uint64_t bytesDown);
+};
+
+// Bytes sent and received on a TCP socket as seen by the kernel, 0 if unavailable
+void GetTcpBytes(int fd, uint64_t& sent, uint64_t& received);
+
+// "ip:port" or "[ipv6]:port" as a JSON string, null if ep is empty
+void AppendJsonEndPoint(string& s, const ProxyEndPoint& ep);
+
+ENUM_CLASS(AccessLogFormat) {
+	JsonLines
+	, Binary
+} END_ENUM_CLASS(AccessLogFormat);
+
+// Connection threads push records into per-thread SPSC rings, a background thread drains them and writes in batches.
+// Records are dropped and counted when a ring is full. Only the pages of the slots written become resident: a thread per
+// connection writes one record, from the first slot
+class CAccessLog : public Thread {
+	typedef Thread base;
+public:
+	static const unsigned RING_SIZE = 128;				// power of 2, drained every 100 ms or at a quarter full
+	static const size_t MAX_FREE_RINGS = 64;			// released by ended threads, kept for new ones; the rest are freed
+
+	CAccessLog(thread_group *tg, RCString path, AccessLogFormat format = AccessLogFormat::JsonLines, uint64_t maxSize = 64 << 20, int keep = 4);
+	~CAccessLog();
+
+	void Push(const AccessRecord& rec);					// lock-free unless the calling thread pushes for the first time
+	uint64_t Dropped() const { return m_dropped; }
+	void Stop() override;
+
+	struct AccessRing;
+	AccessRing *AcquireRing();
+	void ReleaseRing(AccessRing *ring);
+protected:
+	void Execute() override;
+private:
+	const String m_path;
+	const AccessLogFormat m_format;
+	const uint64_t m_maxSize;
+	const int m_keep;
+	int m_fd;
+	uint64_t m_size;
+
+	mutex m_mtx;
+	vector<unique_ptr<AccessRing>> m_rings;
+	vector<AccessRing*> m_freeRings;
+	AutoResetEvent m_ev;
+	atomic<uint64_t> m_dropped;
+	uint64_t m_droppedReported;
+	string m_buf;
+
+	void Open();
+	void Rotate();
+	void Drain();
+	void TrimFreeRings();
+	void FormatJson(const AccessRecord& rec);
+};
+
+}} // Ext::Inet::
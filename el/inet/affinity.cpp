@@ -0,0 +1,153 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "affinity.h"
+
+#if UCFG_INET_AFFINITY
+
+#include <dirent.h>
+#include <sched.h>
+
+namespace Ext {
+	namespace Inet {
+
+static CpuSet ToCpuSet(const cpu_set_t& mask) {
+	CpuSet r;
+	for (int i = 0; i < CPU_SETSIZE; ++i)
+		if (CPU_ISSET(i, &mask))
+			r.push_back(i);
+	return r;
+}
+
+static cpu_set_t ToMask(const CpuSet& cpus) {
+	cpu_set_t mask;
+	CPU_ZERO(&mask);
+	for (int cpu : cpus)
+		CPU_SET(cpu, &mask);
+	return mask;
+}
+
+static CpuSet GetProcessCpus() {
+	cpu_set_t mask;
+	return ::sched_getaffinity(0, sizeof mask, &mask) == 0 ? ToCpuSet(mask) : CpuSet();
+}
+
+static CpuSet s_processCpus = GetProcessCpus();		// captured on the main thread, before workers narrow their own masks
+
+static vector<int> ReadCpuNodes() {
+	vector<int> r;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		char path[64];
+		snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d", cpu);
+		DIR *dir = ::opendir(path);
+		if (!dir)
+			break;
+		int node = 0;
+		while (dirent *e = ::readdir(dir))
+			if (!strncmp(e->d_name, "node", 4) && isdigit((uint8_t)e->d_name[4])) {
+				node = atoi(e->d_name + 4);
+				break;
+			}
+		::closedir(dir);
+		r.push_back(node);
+	}
+	return r;
+}
+
+CpuSet ParseCpuList(const char *s) {
+	CpuSet r;
+	for (const char *p = s; *p;) {
+		char *end;
+		long a = strtol(p, &end, 10), b = a;
+		if (end == p)
+			Throw(errc::invalid_argument);
+		if (*end == '-') {
+			p = end + 1;
+			b = strtol(p, &end, 10);
+			if (end == p)
+				Throw(errc::invalid_argument);
+		}
+		if (a < 0 || b < a || b >= CPU_SETSIZE || (*end && *end != ','))
+			Throw(errc::invalid_argument);
+		for (long i = a; i <= b; ++i)
+			r.push_back(int(i));
+		p = *end ? end + 1 : end;
+	}
+	return r;
+}
+
+void SetProcessAffinity(const CpuSet& cpus) {
+	if (cpus.empty())
+		return;
+	cpu_set_t mask = ToMask(cpus);
+	CCheck(::sched_setaffinity(0, sizeof mask, &mask));
+	s_processCpus = cpus;
+}
+
+void SetThreadAffinity(const CpuSet& cpus) {
+	if (cpus.empty())
+		return;
+	cpu_set_t mask = ToMask(cpus);
+	if (int rc = ::pthread_setaffinity_np(::pthread_self(), sizeof mask, &mask))
+		Throw(error_code(rc, generic_category()));
+}
+
+int CpuNode(int cpu) {
+	static const vector<int> s_nodes = ReadCpuNodes();
+	return cpu >= 0 && size_t(cpu) < s_nodes.size() ? s_nodes[cpu] : 0;
+}
+
+int CurrentCpu() {
+	return ::sched_getcpu();
+}
+
+CpuSet NodeCpus(int node) {
+	CpuSet r;
+	for (int cpu : s_processCpus)
+		if (CpuNode(cpu) == node)
+			r.push_back(cpu);
+	return r;
+}
+
+int SocketIncomingCpu(int fd) {
+#ifdef SO_INCOMING_CPU
+	int cpu = -1;
+	socklen_t len = sizeof cpu;
+	if (::getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0)
+		return cpu;
+#endif
+	return -1;
+}
+
+void PlacementStats::Add(int rxCpu, uint64_t bytes) {
+	if (rxCpu < 0)
+		++UnknownTunnels;
+	else if (CpuNode(rxCpu) == CpuNode(CurrentCpu())) {
+		++LocalTunnels;
+		LocalBytes += bytes;
+	} else {
+		++RemoteTunnels;
+		RemoteBytes += bytes;
+	}
+}
+
+int SteerToSocket(int fd, Steering steering) {
+	int cpu = SocketIncomingCpu(fd);
+	if (cpu < 0 || steering == Steering::None)
+		return cpu;
+	if (find(s_processCpus.begin(), s_processCpus.end(), cpu) == s_processCpus.end())		// RX queue served by a CPU we may not use
+		return cpu;
+	try {
+		SetThreadAffinity(steering == Steering::Core ? CpuSet(1, cpu) : NodeCpus(CpuNode(cpu)));
+	} catch (const system_error&) {
+	}
+	return cpu;
+}
+
+}} // Ext::Inet::
+
+#endif // UCFG_INET_AFFINITY
@@ -0,0 +1,62 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include <el/libext/ext-net.h>
+
+#ifdef __linux__
+#	define UCFG_INET_AFFINITY 1
+#else
+#	define UCFG_INET_AFFINITY 0
+#endif
+
+namespace Ext {
+	namespace Inet {
+
+#if UCFG_INET_AFFINITY
+
+typedef vector<int> CpuSet;
+
+// "0-7,16-23" -> {0..7, 16..23}. Throws errc::invalid_argument
+CpuSet ParseCpuList(const char *s);
+
+// Empty set: leave as is. Threads started afterwards inherit the mask
+void SetProcessAffinity(const CpuSet& cpus);
+void SetThreadAffinity(const CpuSet& cpus);
+
+int CpuNode(int cpu);							// from sysfs, 0 on non-NUMA machines
+int CurrentCpu();
+CpuSet NodeCpus(int node);						// intersected with the process mask
+
+// CPU that ran the softirq of the socket's last received packet, i.e. its RX queue; -1 if unknown
+int SocketIncomingCpu(int fd);
+
+ENUM_CLASS(Steering) {
+	None
+	, Core										// pin to the RX CPU itself
+	, Node										// pin to the RX CPU's NUMA node
+} END_ENUM_CLASS(Steering);
+
+// Placement of relaying threads relative to the RX queue of their client socket.
+// Bytes of tunnels relayed on another node cross the interconnect at least once per direction
+struct PlacementStats {
+	atomic<uint64_t> LocalTunnels, RemoteTunnels, UnknownTunnels;
+	atomic<uint64_t> LocalBytes, RemoteBytes;
+
+	PlacementStats()
+		: LocalTunnels(0), RemoteTunnels(0), UnknownTunnels(0)
+		, LocalBytes(0), RemoteBytes(0)
+	{}
+
+	void Add(int rxCpu, uint64_t bytes);			// called at the end of the tunnel, on the relaying thread
+};
+
+// Moves the calling thread next to the RX queue of sock. Returns the RX CPU or -1
+int SteerToSocket(int fd, Steering steering);
+
+#endif // UCFG_INET_AFFINITY
+
+}} // Ext::Inet::
@@ -0,0 +1,114 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "circuitbreaker.h"
+
+namespace Ext {
+	namespace Inet {
+
+static const chrono::seconds PROBE_TIMEOUT(30);		// a probe that never reports back, e.g. its thread was stopped
+
+CCircuitBreaker::CCircuitBreaker(size_t maxEntries, chrono::milliseconds backoff, chrono::milliseconds maxBackoff)
+	: FastFailed(0)
+	, Opened(0)
+	, m_maxEntries(maxEntries)
+	, m_backoff(backoff)
+	, m_maxBackoff(maxBackoff)
+	, m_size(0)
+{}
+
+string CCircuitBreaker::MakeKey(const ProxyEndPoint& ep) {
+	string key(1, char(ep.Kind));
+	switch (ep.Kind) {
+	case ProxyEndPoint::IPv4:
+		key.append((const char*)ep.Address, 4);
+		break;
+	case ProxyEndPoint::IPv6:
+		key.append((const char*)ep.Address, 16);
+		break;
+	case ProxyEndPoint::Host:
+		for (size_t i = 0; i < ep.HostLength; ++i)
+			key += char(tolower((uint8_t)ep.HostName[i]));
+		break;
+	default:
+		break;
+	}
+	key += char(ep.Port >> 8);
+	key += char(ep.Port);
+	return key;
+}
+
+bool CCircuitBreaker::IsTracked(const error_code& ec) {
+	return ec == errc::connection_refused || ec == errc::timed_out || ec == errc::host_unreachable || ec == errc::network_unreachable;
+}
+
+bool CCircuitBreaker::Admit(const ProxyEndPoint& ep, error_code& ec) {
+	ec.clear();
+	if (!m_size)
+		return true;
+	string key = MakeKey(ep);
+	lock_guard<mutex> lk(m_mtx);
+	auto it = m_entries.find(key);
+	if (it == m_entries.end())
+		return true;
+	Entry& e = it->second;
+	auto now = chrono::steady_clock::now();
+	if (now >= e.Until) {									// window over, or the previous probe is lost
+		e.Probing = true;
+		e.Until = now + PROBE_TIMEOUT;
+		return true;
+	}
+	ec = e.Ec;
+	++FastFailed;
+	return false;
+}
+
+void CCircuitBreaker::OnResult(const ProxyEndPoint& ep, const error_code& ec) {
+	bool bFailed = IsTracked(ec);
+	if (!bFailed && !m_size)
+		return;
+	string key = MakeKey(ep);
+	lock_guard<mutex> lk(m_mtx);
+	auto it = m_entries.find(key);
+	if (!bFailed) {
+		if (it != m_entries.end()) {
+			m_entries.erase(it);
+			m_size = m_entries.size();
+		}
+		return;
+	}
+	auto now = chrono::steady_clock::now();
+	if (it == m_entries.end()) {
+		if (m_entries.size() >= m_maxEntries) {
+			for (auto i = m_entries.begin(); i != m_entries.end();)
+				if (!i->second.Probing && i->second.Until <= now)
+					i = m_entries.erase(i);
+				else
+					++i;
+			if (m_entries.size() >= m_maxEntries)
+				return;
+		}
+		Entry& e = m_entries[key];
+		e.Backoff = m_backoff;
+		e.Probing = false;
+		e.Ec = ec;
+		e.Until = now + e.Backoff;
+		m_size = m_entries.size();
+		++Opened;
+		return;
+	}
+	Entry& e = it->second;
+	if (e.Probing) {										// failed probe: back off longer
+		e.Backoff = (min)(e.Backoff * 2, m_maxBackoff);
+		e.Probing = false;
+		++Opened;
+	}
+	e.Ec = ec;
+	e.Until = now + e.Backoff;
+}
+
+}} // Ext::Inet::
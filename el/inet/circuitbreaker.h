@@ -0,0 +1,44 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include "proxy.h"
+
+namespace Ext {
+	namespace Inet {
+
+// Per-destination connect health. After a refused / unreachable / timed out connect the destination is open for a backoff
+// window and requests for it fail at once with the cached error. When the window ends a single request probes it,
+// concurrent ones keep failing fast; a failed probe doubles the window up to maxBackoff, a successful one forgets the destination
+class CCircuitBreaker {
+public:
+	atomic<uint64_t> FastFailed, Opened;
+
+	CCircuitBreaker(size_t maxEntries = 65536, chrono::milliseconds backoff = chrono::seconds(2), chrono::milliseconds maxBackoff = chrono::seconds(60));
+
+	// Returns false with ec set to fail fast. Otherwise the caller connects and reports the outcome with OnResult()
+	bool Admit(const ProxyEndPoint& ep, error_code& ec);
+	void OnResult(const ProxyEndPoint& ep, const error_code& ec);
+
+	static bool IsTracked(const error_code& ec);
+private:
+	struct Entry {
+		error_code Ec;
+		chrono::steady_clock::time_point Until;			// open until; while probing, when to give up on the probe
+		chrono::milliseconds Backoff;
+		bool Probing;
+	};
+
+	const size_t m_maxEntries;
+	const chrono::milliseconds m_backoff, m_maxBackoff;
+	mutex m_mtx;
+	unordered_map<string, Entry> m_entries;
+	atomic<size_t> m_size;								// lets Admit() skip the lock while every destination is healthy
+
+	static string MakeKey(const ProxyEndPoint& ep);
+};
+
+}} // Ext::Inet::
@@ -0,0 +1,432 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "coro.h"
+
+#if UCFG_INET_COROUTINES
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+namespace Ext {
+	namespace Inet {
+
+namespace {
+
+// Eager fire-and-forget coroutine, frees itself on completion
+struct DetachedTask {
+	struct promise_type {
+		DetachedTask get_return_object() noexcept { return {}; }
+		suspend_never initial_suspend() noexcept { return {}; }
+		suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept {}
+	};
+};
+
+DetachedTask RunDetached(Task<void> task) {
+	try {
+		co_await task;
+	} catch (RCExc) {
+	}
+}
+
+} // anonymous::
+
+CEpollLoop::CEpollLoop(thread_group *tg)
+	: base(tg)
+	, m_epfd(CCheck(::epoll_create1(EPOLL_CLOEXEC)))
+	, m_evfd(-1)
+	, m_offloadIdle(0)
+	, m_bOffloadStop(false)
+{
+	if ((m_evfd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+		::close(m_epfd);
+		CCheck(-1);
+	}
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.ptr = nullptr;
+	CCheck(::epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_evfd, &ev));
+}
+
+CEpollLoop::~CEpollLoop() {
+	{
+		lock_guard<mutex> lk(m_mtxOffload);
+		m_bOffloadStop = true;
+	}
+	m_cvOffload.notify_all();
+	for (auto& t : m_offloadThreads)
+		t.join();
+	::close(m_evfd);
+	::close(m_epfd);
+}
+
+void CEpollLoop::Post(function<void()> fn) {
+	{
+		lock_guard<mutex> lk(m_mtx);
+		m_pending.push_back(move(fn));
+	}
+	uint64_t v = 1;
+	(void)::write(m_evfd, &v, sizeof v);
+}
+
+void CEpollLoop::Spawn(Task<void>&& task) {
+	auto t = make_shared<Task<void>>(move(task));
+	Post([t] {
+		RunDetached(move(*t));
+	});
+}
+
+void CEpollLoop::Stop() {
+	base::Stop();
+	uint64_t v = 1;
+	(void)::write(m_evfd, &v, sizeof v);
+}
+
+void CEpollLoop::OffloadAwaiter::await_suspend(coroutine_handle<> h) {
+	lock_guard<mutex> lk(Loop.m_mtxOffload);
+	Loop.m_offload.push_back([this, h] {
+		try {
+			Fn();
+		} catch (...) {
+			Exc = current_exception();
+		}
+		Loop.Post([h] {
+			h.resume();
+		});
+	});
+	if (!Loop.m_offloadIdle && Loop.m_offloadThreads.size() < OFFLOAD_THREADS)
+		Loop.m_offloadThreads.emplace_back(&CEpollLoop::OffloadWorker, &Loop);
+	else
+		Loop.m_cvOffload.notify_one();
+}
+
+void CEpollLoop::OffloadWorker() {
+	unique_lock<mutex> lk(m_mtxOffload);
+	while (true) {
+		++m_offloadIdle;
+		m_cvOffload.wait(lk, [this] { return m_bOffloadStop || !m_offload.empty(); });
+		--m_offloadIdle;
+		if (m_bOffloadStop)
+			break;
+		function<void()> fn = move(m_offload.front());
+		m_offload.pop_front();
+		lk.unlock();
+		fn();
+		lk.lock();
+	}
+}
+
+int CEpollLoop::RunTimers() {
+	while (!m_timers.empty() || !m_deadlines.empty()) {
+		auto it = m_timers.begin();
+		auto itD = m_deadlines.begin();
+		bool bDeadline = itD != m_deadlines.end() && (it == m_timers.end() || itD->first < it->first);
+		chrono::steady_clock::duration left = (bDeadline ? itD->first : it->first) - chrono::steady_clock::now();
+		if (left > chrono::steady_clock::duration::zero())
+			return int(chrono::duration_cast<chrono::milliseconds>(left).count()) + 1;
+		if (bDeadline) {
+			AsyncSocket& s = *itD->second;
+			m_deadlines.erase(itD);
+			s.Expire();
+		} else {
+			coroutine_handle<> h = it->second;
+			m_timers.erase(it);
+			h.resume();
+		}
+	}
+	return -1;
+}
+
+void CEpollLoop::Watch(AsyncSocket& s) {
+	epoll_event ev = {};
+	ev.events = EPOLLONESHOT | (s.m_reader ? uint32_t(EPOLLIN | EPOLLRDHUP) : 0) | (s.m_writer ? uint32_t(EPOLLOUT) : 0);
+	ev.data.ptr = &s;
+	CCheck(::epoll_ctl(m_epfd, s.m_bAdded ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, s.Fd, &ev));
+	s.m_bAdded = true;
+}
+
+void CEpollLoop::Execute() {
+	epoll_event evs[256];
+	while (!m_bStop) {
+		int n = ::epoll_wait(m_epfd, evs, size(evs), RunTimers());
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			CCheck(-1);
+		}
+		for (int i = 0; i < n; ++i) {
+			if (!evs[i].data.ptr) {
+				uint64_t v;
+				(void)::read(m_evfd, &v, sizeof v);
+				vector<function<void()>> pending;
+				{
+					lock_guard<mutex> lk(m_mtx);
+					pending.swap(m_pending);
+				}
+				for (auto& fn : pending)
+					fn();
+				continue;
+			}
+			AsyncSocket& s = *(AsyncSocket*)evs[i].data.ptr;
+			uint32_t rev = evs[i].events;
+			coroutine_handle<> r, w;
+			if (rev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+				r = exchange(s.m_reader, nullptr);
+			if (rev & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+				w = exchange(s.m_writer, nullptr);
+			if (s.m_reader || s.m_writer)
+				Watch(s);							// re-arm the other direction before resuming, the socket may be gone after
+			if (r)
+				r.resume();
+			if (w)
+				w.resume();
+		}
+	}
+}
+
+AsyncSocket::AsyncSocket(CEpollLoop& loop, int fd)
+	: Loop(loop)
+	, Fd(-1)
+{
+	if (fd >= 0)
+		Attach(fd);
+}
+
+AsyncSocket::~AsyncSocket() {
+	ClearDeadline();
+	if (Fd >= 0)
+		::close(Fd);					// also removes it from the epoll set
+}
+
+void AsyncSocket::Attach(int fd) {
+	Fd = fd;
+	CCheck(::fcntl(Fd, F_SETFL, ::fcntl(Fd, F_GETFL) | O_NONBLOCK));
+}
+
+int AsyncSocket::Detach() {
+	if (m_bAdded)
+		::epoll_ctl(Loop.m_epfd, EPOLL_CTL_DEL, Fd, nullptr);
+	m_bAdded = false;
+	return exchange(Fd, -1);
+}
+
+bool AsyncSocket::ReadyAwaiter::await_suspend(coroutine_handle<> h) {
+	if (Sock.m_bTimedOut)
+		return false;
+	(Write ? Sock.m_writer : Sock.m_reader) = h;
+	Sock.Loop.Watch(Sock);
+	return true;
+}
+
+void AsyncSocket::ReadyAwaiter::await_resume() const {
+	if (Sock.m_bTimedOut)
+		Throw(errc::timed_out);
+}
+
+void AsyncSocket::SetDeadline(chrono::milliseconds d) {
+	ClearDeadline();
+	if (d.count() > 0) {
+		m_deadline = Loop.m_deadlines.emplace(chrono::steady_clock::now() + d, this);
+		m_bDeadline = true;
+	}
+}
+
+void AsyncSocket::ClearDeadline() {
+	if (m_bDeadline)
+		Loop.m_deadlines.erase(m_deadline);
+	m_bDeadline = false;
+	m_bTimedOut = false;
+}
+
+// The suspended awaits are resumed to throw; the epoll registration stays armed, an event for nobody is ignored
+void AsyncSocket::Expire() {
+	m_bDeadline = false;
+	m_bTimedOut = true;
+	coroutine_handle<> r = exchange(m_reader, nullptr), w = exchange(m_writer, nullptr);
+	if (r)
+		r.resume();
+	if (w)
+		w.resume();											// a different coroutine than the reader's, when both wait
+}
+
+int AsyncSocket::Listen(const IPEndPoint& ep) {
+	int s = CCheck(::socket(ep.c_sockaddr()->sa_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, IPPROTO_TCP));
+	int on = 1;
+	::setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+	if (::bind(s, ep.c_sockaddr(), socklen_t(ep.sockaddr_len())) < 0 || ::listen(s, SOMAXCONN) < 0) {
+		int err = errno;
+		::close(s);
+		Throw(error_code(err, system_category()));
+	}
+	return s;
+}
+
+Task<int> AsyncSocket::Accept() {
+	while (true) {
+		int s = ::accept4(Fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+		if (s >= 0)
+			co_return s;
+		switch (errno) {
+		case EAGAIN:
+			co_await Readable();
+			break;
+		case EINTR:
+		case ECONNABORTED:
+			break;
+		case EMFILE:
+		case ENFILE:
+		case ENOBUFS:
+		case ENOMEM:
+			co_await Loop.Sleep(chrono::milliseconds(100));		// out of descriptors: the connection stays queued until some are closed
+			break;
+		default:
+			CCheck(-1);
+		}
+	}
+}
+
+Task<size_t> AsyncSocket::Receive(void *buf, size_t size) {
+	while (true) {
+		ssize_t r = ::recv(Fd, buf, size, 0);
+		if (r >= 0)
+			co_return size_t(r);
+		if (errno == EAGAIN)
+			co_await Readable();
+		else if (errno != EINTR)
+			CCheck(-1);
+	}
+}
+
+Task<void> AsyncSocket::Send(const void *buf, size_t size) {
+	for (const uint8_t *p = (const uint8_t*)buf; size;) {
+		ssize_t r = ::send(Fd, p, size, MSG_NOSIGNAL);
+		if (r >= 0) {
+			p += r;
+			size -= r;
+		} else if (errno == EAGAIN)
+			co_await Writable();
+		else if (errno != EINTR)
+			CCheck(-1);
+	}
+}
+
+Task<void> AsyncSocket::Send(SendVector& v) {
+	while (!v.TrySend(Fd))
+		co_await Writable();
+}
+
+Task<size_t> AsyncSocket::Forward(AsyncSocket& to) {
+	uint8_t *buf = Loop.m_relayBuf;
+	ssize_t r;
+	while ((r = ::recv(Fd, buf, CEpollLoop::RELAY_BUF_SIZE, 0)) < 0) {
+		if (errno == EAGAIN)
+			co_await Readable();
+		else if (errno != EINTR)
+			CCheck(-1);
+	}
+	size_t off = 0;
+	while (off < size_t(r)) {
+		ssize_t n = ::send(to.Fd, buf + off, r - off, MSG_NOSIGNAL);
+		if (n >= 0)
+			off += n;
+		else if (errno == EAGAIN)
+			break;
+		else if (errno != EINTR)
+			CCheck(-1);
+	}
+	if (off < size_t(r)) {
+		vector<uint8_t> rest(buf + off, buf + r);			// other sockets reuse the loop buffer while this one waits
+		co_await to.Send(rest.data(), rest.size());
+	}
+	co_return size_t(r);
+}
+
+Task<error_code> AsyncSocket::Connect(const IPEndPoint& ep, int fd) {
+	Fd = fd >= 0 ? fd : CCheck(::socket(ep.c_sockaddr()->sa_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, IPPROTO_TCP));
+	if (::connect(Fd, ep.c_sockaddr(), socklen_t(ep.sockaddr_len())) == 0)
+		co_return error_code();
+	if (errno != EINPROGRESS)
+		co_return error_code(errno, generic_category());
+	try {
+		co_await Writable();
+	} catch (RCExc) {
+		co_return make_error_code(errc::timed_out);
+	}
+	int err = 0;
+	socklen_t len = sizeof err;
+	::getsockopt(Fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	co_return error_code(err, generic_category());
+}
+
+Task<void> AsyncStream::Fill() {
+	if (m_beg == m_end)
+		m_beg = m_end = 0;
+	size_t r = co_await Sock.Receive(m_buf + m_end, sizeof(m_buf) - m_end);
+	if (!r)
+		Throw(ExtErr::EndOfStream);
+	m_end += r;
+}
+
+Task<void> AsyncStream::ReadBuffer(void *buf, size_t count) {
+	for (uint8_t *p = (uint8_t*)buf; count;) {
+		if (m_beg == m_end)
+			co_await Fill();
+		size_t n = (min)(count, m_end - m_beg);
+		memcpy(p, m_buf + m_beg, n);
+		m_beg += n;
+		p += n;
+		count -= n;
+	}
+}
+
+Task<uint8_t> AsyncStream::ReadByte() {
+	if (m_beg == m_end)
+		co_await Fill();
+	co_return m_buf[m_beg++];
+}
+
+Task<void> AsyncStream::ReadLine(String& line) {
+	string s;
+	while (true) {
+		if (m_beg == m_end)
+			co_await Fill();
+		const uint8_t *b = m_buf + m_beg, *e = (const uint8_t*)memchr(b, '\n', m_end - m_beg);
+		size_t n = (e ? e + 1 : m_buf + m_end) - b;
+		s.append((const char*)b, n);
+		m_beg += n;
+		if (e)
+			break;
+		if (s.size() > 8192)
+			Throw(ExtErr::PROXY_InvalidHttpRequest);
+	}
+	s.resize(s.size() - 1);
+	if (!s.empty() && s.back() == '\r')
+		s.resize(s.size() - 1);
+	line += String(s.data(), s.size());
+}
+
+Task<Span> AsyncStream::Peek(size_t count) {
+	if (count > sizeof m_buf)
+		Throw(errc::message_size);
+	if (m_beg + count > sizeof m_buf) {
+		memmove(m_buf, m_buf + m_beg, m_end - m_beg);
+		m_end -= exchange(m_beg, 0);
+	}
+	while (m_end - m_beg < count)
+		co_await Fill();
+	co_return Span(m_buf + m_beg, m_end - m_beg);
+}
+
+Task<void> AsyncStream::WriteBuffer(const void *buf, size_t count) {
+	co_await Sock.Send(buf, count);
+}
+
+}} // Ext::Inet::
+
+#endif // UCFG_INET_COROUTINES
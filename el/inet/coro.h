@@ -0,0 +1,272 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include <el/libext/ext-net.h>
+#include <el/inet/sendv.h>
+
+#if defined(__cpp_impl_coroutine) && defined(__linux__) && __has_include(<coroutine>)
+#	define UCFG_INET_COROUTINES 1
+#	include <coroutine>
+#else
+#	define UCFG_INET_COROUTINES 0
+#endif
+
+#if UCFG_INET_COROUTINES
+
+namespace Ext {
+	namespace Inet {
+
+// Lazy coroutine, started by co_await, resumes the awaiter on completion
+template <class T = void>
+class Task;
+
+namespace detail {
+
+template <class T>
+struct TaskPromiseBase {
+	coroutine_handle<> Continuation;
+	exception_ptr Exc;
+
+	suspend_always initial_suspend() noexcept { return {}; }
+
+	struct FinalAwaiter {
+		bool await_ready() const noexcept { return false; }
+
+		template <class P>
+		coroutine_handle<> await_suspend(coroutine_handle<P> h) noexcept {
+			coroutine_handle<> c = h.promise().Continuation;
+			return c ? c : noop_coroutine();
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { Exc = current_exception(); }
+};
+
+template <class T>
+struct TaskPromise : TaskPromiseBase<T> {
+	optional<T> Value;
+
+	Task<T> get_return_object();
+	void return_value(T v) { Value.emplace(move(v)); }
+
+	T Result() {
+		if (this->Exc)
+			rethrow_exception(this->Exc);
+		return move(*Value);
+	}
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase<void> {
+	Task<void> get_return_object();
+	void return_void() {}
+
+	void Result() {
+		if (Exc)
+			rethrow_exception(Exc);
+	}
+};
+
+} // detail::
+
+template <class T>
+class Task {
+public:
+	typedef detail::TaskPromise<T> promise_type;
+
+	explicit Task(coroutine_handle<promise_type> h)
+		: m_h(h)
+	{}
+
+	Task(Task&& x) noexcept
+		: m_h(exchange(x.m_h, nullptr))
+	{}
+
+	~Task() {
+		if (m_h)
+			m_h.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	coroutine_handle<> await_suspend(coroutine_handle<> awaiter) noexcept {
+		m_h.promise().Continuation = awaiter;
+		return m_h;
+	}
+
+	T await_resume() { return m_h.promise().Result(); }
+private:
+	coroutine_handle<promise_type> m_h;
+
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+};
+
+namespace detail {
+
+template <class T>
+inline Task<T> TaskPromise<T>::get_return_object() { return Task<T>(coroutine_handle<TaskPromise<T>>::from_promise(*this)); }
+
+inline Task<void> TaskPromise<void>::get_return_object() { return Task<void>(coroutine_handle<TaskPromise<void>>::from_promise(*this)); }
+
+} // detail::
+
+class AsyncSocket;
+
+// Single-threaded epoll reactor. Coroutines spawned on it run only on its thread
+class CEpollLoop : public Thread {
+	typedef Thread base;
+public:
+	static const size_t RELAY_BUF_SIZE = 16384;
+
+	CEpollLoop(thread_group *tg = nullptr);
+	~CEpollLoop();
+
+	void Spawn(Task<void>&& task);				// thread-safe, the task is started on the loop thread
+	void Post(function<void()> fn);				// thread-safe
+	void Stop() override;
+
+	// Runs a blocking call (DNS, legacy connect) on a helper thread, the coroutine is resumed on the loop thread
+	struct OffloadAwaiter {
+		CEpollLoop& Loop;
+		function<void()> Fn;
+		exception_ptr Exc;
+
+		bool await_ready() const noexcept { return false; }
+		void await_suspend(coroutine_handle<> h);
+		void await_resume() {
+			if (Exc)
+				rethrow_exception(Exc);
+		}
+	};
+
+	OffloadAwaiter Offload(function<void()> fn) { return OffloadAwaiter{ *this, move(fn), nullptr }; }
+
+	// Resumes the coroutine on the loop thread after d. Awaited on the loop thread only
+	struct SleepAwaiter {
+		CEpollLoop& Loop;
+		chrono::milliseconds Duration;
+
+		bool await_ready() const noexcept { return Duration.count() <= 0; }
+		void await_suspend(coroutine_handle<> h) { Loop.m_timers.emplace(chrono::steady_clock::now() + Duration, h); }
+		void await_resume() const noexcept {}
+	};
+
+	SleepAwaiter Sleep(chrono::milliseconds d) { return SleepAwaiter{ *this, d }; }
+protected:
+	void Execute() override;
+private:
+	static const size_t OFFLOAD_THREADS = 8;	// blocking calls beyond that wait in m_offload
+
+	int m_epfd, m_evfd;
+	mutex m_mtx;
+	vector<function<void()>> m_pending;
+	multimap<chrono::steady_clock::time_point, coroutine_handle<>> m_timers;
+	multimap<chrono::steady_clock::time_point, AsyncSocket*> m_deadlines;
+	uint8_t m_relayBuf[RELAY_BUF_SIZE];			// shared by all Forward() calls, never held across a suspension
+
+	mutex m_mtxOffload;
+	condition_variable m_cvOffload;
+	deque<function<void()>> m_offload;
+	vector<thread> m_offloadThreads;
+	size_t m_offloadIdle;
+	bool m_bOffloadStop;
+
+	void Watch(AsyncSocket& s);
+	void OffloadWorker();
+	int RunTimers();							// epoll_wait timeout till the next timer or deadline, ms
+
+	friend class AsyncSocket;
+};
+
+// Non-blocking socket owned by a coroutine; at most one reader and one writer may be suspended on it
+class AsyncSocket {
+public:
+	CEpollLoop& Loop;
+	int Fd;
+
+	AsyncSocket(CEpollLoop& loop, int fd);
+	~AsyncSocket();
+
+	void Attach(int fd);
+	int Detach();
+
+	struct ReadyAwaiter {
+		AsyncSocket& Sock;
+		bool Write;
+
+		bool await_ready() const noexcept { return false; }
+		bool await_suspend(coroutine_handle<> h);			// false past the deadline
+		void await_resume() const;							// throws errc::timed_out past the deadline
+	};
+
+	ReadyAwaiter Readable() { return ReadyAwaiter{ *this, false }; }
+	ReadyAwaiter Writable() { return ReadyAwaiter{ *this, true }; }
+
+	static int Listen(const IPEndPoint& ep);
+	Task<int> Accept();
+	Task<size_t> Receive(void *buf, size_t size);			// 0 on EOF
+	Task<void> Send(const void *buf, size_t size);
+	Task<void> Send(SendVector& v);							// one sendmsg() unless the socket buffer is full
+	Task<error_code> Connect(const IPEndPoint& ep, int fd = -1);		// creates the socket unless given a non-blocking one.
+																	// errc::timed_out past the deadline
+
+	// Awaits on the socket, suspended or later, end with errc::timed_out once d has passed, until ClearDeadline().
+	// Bounds a handshake or a connect without a racing timer coroutine. d <= 0 - none
+	void SetDeadline(chrono::milliseconds d);
+	void ClearDeadline();
+
+	// Moves one readable chunk to `to` through the loop's buffer, so a waiting tunnel holds no buffer of its own: only what
+	// `to` does not take at once is copied aside. 0 on EOF
+	Task<size_t> Forward(AsyncSocket& to);
+private:
+	coroutine_handle<> m_reader, m_writer;
+	multimap<chrono::steady_clock::time_point, AsyncSocket*>::iterator m_deadline;
+	CBool m_bAdded, m_bDeadline, m_bTimedOut;
+
+	void Expire();
+
+	AsyncSocket(const AsyncSocket&) = delete;
+	AsyncSocket& operator=(const AsyncSocket&) = delete;
+
+	friend class CEpollLoop;
+};
+
+// Buffered handshake reader/writer over AsyncSocket, mirrors the subset of Stream used by the relays
+class AsyncStream {
+public:
+	AsyncSocket& Sock;
+
+	AsyncStream(AsyncSocket& sock)
+		: Sock(sock)
+		, m_beg(0)
+		, m_end(0)
+	{}
+
+	Task<void> ReadBuffer(void *buf, size_t count);
+	Task<uint8_t> ReadByte();
+	Task<void> ReadLine(String& line);						// appends the line without CRLF
+	Task<void> WriteBuffer(const void *buf, size_t count);
+
+	Task<Span> Peek(size_t count);							// at least count buffered bytes, count <= sizeof m_buf
+	void Skip(size_t count) { m_beg += count; }
+
+	// Read-ahead bytes past the handshake, they belong to the tunnel payload
+	Span Unread() const { return Span(m_buf + m_beg, m_end - m_beg); }
+private:
+	uint8_t m_buf[1024];
+	size_t m_beg, m_end;
+
+	Task<void> Fill();
+};
+
+}} // Ext::Inet::
+
+#endif // UCFG_INET_COROUTINES
@@ -0,0 +1,67 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "handshake.h"
+#include "proxyrelay.h"
+#include "proxyprotocol.h"
+#include "httpcache.h"
+#include "sni.h"
+
+namespace Ext {
+	namespace Inet {
+
+size_t CSpanStream::Read(void *buf, size_t count) const {
+	size_t n = (min)(count, size_t(m_end - m_p));
+	memcpy(buf, m_p, n);
+	m_p += n;
+	return n;
+}
+
+void CSpanStream::ReadBuffer(void *buf, size_t count) const {
+	if (count > size_t(m_end - m_p))
+		Throw(ExtErr::EndOfStream);
+	Read(buf, count);
+}
+
+bool ReplayHandshake(RCSpan input) {
+	static const unordered_map<string, string> s_users = { { "user", "password" } };
+
+	if (!input.size())
+		return false;
+	uint8_t flags = input.data()[0];
+	CSpanStream s(Span(input.data() + 1, input.size() - 1));
+	CReadAheadStream stm(s);
+	try {
+		if (flags & REPLAY_PROXY_HEADER) {
+			ProxyProtocolHeader hdr;
+			stm.ReadProxyHeader(hdr);
+		}
+		HandshakeKind kind;
+		for (size_t need = 1; (kind = SniffHandshake(stm.Peek(need))) == HandshakeKind::Unknown;)
+			need = stm.Unread().size() + 1;
+		uint8_t ver;
+		stm.ReadBuffer(&ver, 1);
+		CProxyRelayHolder holder;
+		CProxyRelay& relay = holder.Emplace(kind);			// throws for the kinds socksd rejects
+		relay.m_pStm = &stm;
+		relay.m_pUsers = flags & REPLAY_AUTH ? &s_users : nullptr;
+		CProxyQuery target = relay.GetQuery(ver);
+		if (relay.m_qs) {
+			Span reqLine = relay.m_qs->AsSpan();
+			CHttpCache::Key(target.Ep, string((const char*)reqLine.data(), reqLine.size()) + (relay.m_bHead ? string() : ReadHttpHead(stm)));
+		}
+		relay.SendReply(target.Ep);
+		relay.SendReply(ProxyEndPoint(), make_error_code(errc::connection_refused));
+		Span serverName;
+		FindSni(stm.Unread(), serverName);					// the ClientHello an optimistic reply lets through
+	} catch (RCExc) {
+		return false;
+	}
+	return true;
+}
+
+}} // Ext::Inet::
@@ -0,0 +1,44 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include "proxy.h"
+
+namespace Ext {
+	namespace Inet {
+
+// Recorded client bytes as a Stream: reads past the end throw ExtErr::EndOfStream, writes are counted and dropped
+class CSpanStream : public Stream {
+public:
+	size_t Written;
+
+	CSpanStream(RCSpan s)
+		: Written(0)
+		, m_p(s.data())
+		, m_end(s.data() + s.size())
+	{}
+
+	size_t Read(void *buf, size_t count) const override;
+	int ReadByte() const override { return m_p == m_end ? -1 : *m_p++; }
+	void ReadBuffer(void *buf, size_t count) const override;
+	void WriteBuffer(const void *buf, size_t count) override { Written += count; }
+	bool Eof() const override { return m_p == m_end; }
+private:
+	mutable const uint8_t *m_p;
+	const uint8_t *m_end;
+};
+
+// Corpus and fuzzer input: byte 0 holds these flags, the rest is what the client sent
+enum {
+	REPLAY_AUTH = 1,							// SOCKS5 clients must authenticate as user/password
+	REPLAY_PROXY_HEADER = 2						// a PROXY v1/v2 header comes first
+};
+
+// Runs input through the parsers socksd picks for it: PROXY header, SniffHandshake(), relay GetQuery(), the HTTP request head and
+// its cache key, success and error replies, then FindSni() over the bytes after the request. False if a parser rejected the input
+bool ReplayHandshake(RCSpan input);
+
+}} // Ext::Inet::
@@ -0,0 +1,429 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "httpcache.h"
+#include "sendv.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace Ext {
+	namespace Inet {
+
+static const size_t MAX_HEAD_SIZE = 64 * 1024;
+static const int64_t MAX_HEURISTIC_LIFETIME = 24 * 3600;
+
+string ReadHttpHead(const Stream& stm) {
+	string head;
+	size_t lineStart = 0;
+	for (int ch; (ch = stm.ReadByte()) >= 0;) {
+		head += char(ch);
+		if (ch == '\n') {
+			if (head.size() - lineStart == 1 || (head.size() - lineStart == 2 && head[lineStart] == '\r'))
+				return head;
+			lineStart = head.size();
+		}
+		if (head.size() > MAX_HEAD_SIZE)
+			Throw(errc::message_size);
+	}
+	Throw(ExtErr::EndOfStream);
+}
+
+// Header lines of a head, the first line (request or status) skipped. Values without leading/trailing blanks
+static vector<pair<string, string>> ParseHeaders(const string& head) {
+	vector<pair<string, string>> r;
+	size_t pos = head.find('\n');
+	for (size_t e; pos != string::npos && (e = head.find('\n', ++pos)) != string::npos; pos = e) {
+		string line = head.substr(pos, e - pos);
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		size_t colon = line.find(':');
+		if (colon == string::npos)
+			continue;
+		size_t b = line.find_first_not_of(" \t", colon + 1), end = line.find_last_not_of(" \t");
+		r.emplace_back(line.substr(0, colon), b == string::npos ? string() : line.substr(b, end - b + 1));
+	}
+	return r;
+}
+
+static bool IsHeader(const pair<string, string>& h, const char *name) {
+	return !strcasecmp(h.first.c_str(), name);
+}
+
+// Cache-Control directive: -1 absent, 0 present without a value, otherwise the value + 1
+static int64_t Directive(const string& cacheControl, const char *name) {
+	size_t len = strlen(name);
+	for (size_t pos = 0; (pos = cacheControl.find_first_not_of(" \t,", pos)) != string::npos;) {
+		size_t e = cacheControl.find(',', pos);
+		string d = cacheControl.substr(pos, e == string::npos ? string::npos : e - pos);
+		if (!strncasecmp(d.c_str(), name, len) && (d.size() == len || d[len] == '=' || d[len] == ' '))
+			return d.size() > len + 1 && d[len] == '=' ? atoll(d.c_str() + len + 1) + 1 : 0;
+		pos = e;
+	}
+	return -1;
+}
+
+static int64_t ParseHttpDate(const string& s) {
+	tm t = tm();
+	if (!::strptime(s.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &t))
+		return 0;
+	return ::timegm(&t);
+}
+
+static int64_t Now() {
+	return ::time(nullptr);
+}
+
+// Hop-by-hop headers are dropped from stored heads and replaced on the way out
+static bool IsHopByHop(const pair<string, string>& h) {
+	return IsHeader(h, "Connection") || IsHeader(h, "Keep-Alive") || IsHeader(h, "Proxy-Connection") || IsHeader(h, "Transfer-Encoding")
+		|| IsHeader(h, "TE") || IsHeader(h, "Trailer") || IsHeader(h, "Upgrade") || IsHeader(h, "Age");
+}
+
+static string FirstLine(const string& head) {
+	string r = head.substr(0, head.find('\n'));
+	if (!r.empty() && r.back() == '\r')
+		r.pop_back();
+	return r;
+}
+
+static bool SendAll(int fd, const void *p, size_t size) {
+	for (const uint8_t *q = (const uint8_t*)p; size;) {
+		ssize_t r = ::send(fd, q, size, MSG_NOSIGNAL);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		q += r;
+		size -= r;
+	}
+	return true;
+}
+
+struct CHttpCache::Body {
+	const uint8_t *Data;
+	size_t Size;
+	string Mem;
+	void *Map;
+	String File;
+
+	Body()
+		: Data(nullptr)
+		, Size(0)
+		, Map(MAP_FAILED)
+	{}
+
+	~Body() {
+		if (Map != MAP_FAILED)
+			::munmap(Map, Size);
+		if (!File.empty())
+			::unlink(File.c_str());					// evicted, or replaced by a new response; readers still hold the mapping
+	}
+};
+
+CHttpCache::CHttpCache(size_t memLimit, RCString dir, uint64_t diskLimit, size_t memObjectLimit)
+	: Hits(0)
+	, Revalidated(0)
+	, Misses(0)
+	, Stored(0)
+	, BytesSaved(0)
+	, m_memLimit(memLimit)
+	, m_memObjectLimit(memObjectLimit)
+	, m_dir(dir)
+	, m_diskLimit(dir.empty() ? 0 : diskLimit)
+	, m_memBytes(0)
+	, m_diskBytes(0)
+	, m_fileSeq(0)
+{
+	if (m_diskLimit)
+		::mkdir(m_dir.c_str(), 0700);
+}
+
+CHttpCache::~CHttpCache() {
+	lock_guard<mutex> lk(m_mtx);
+	m_lru.clear();
+}
+
+string CHttpCache::Key(const ProxyEndPoint& target, const string& head) {
+	string line = FirstLine(head);
+	if (line.compare(0, 4, "GET "))
+		return string();
+	size_t e = line.find(' ', 4);
+	for (auto& h : ParseHeaders(head))
+		if (IsHeader(h, "Authorization") || IsHeader(h, "Cookie") || IsHeader(h, "Range")
+			|| (IsHeader(h, "Cache-Control") && Directive(h.second, "no-store") >= 0))
+			return string();
+	ostringstream os;
+	os << target;
+	string key = os.str();
+	transform(key.begin(), key.end(), key.begin(), [](char c) { return char(tolower((uint8_t)c)); });
+	return key + line.substr(4, e == string::npos ? string::npos : e - 4);
+}
+
+shared_ptr<const CHttpCache::Entry> CHttpCache::Lookup(const string& key) {
+	lock_guard<mutex> lk(m_mtx);
+	auto it = m_map.find(key);
+	if (it == m_map.end())
+		return nullptr;
+	m_lru.splice(m_lru.begin(), m_lru, it->second);
+	return it->second->second;
+}
+
+void CHttpCache::Trim(bool bDisk) {
+	uint64_t& bytes = bDisk ? m_diskBytes : m_memBytes;
+	uint64_t limit = bDisk ? m_diskLimit : m_memLimit;
+	for (auto it = m_lru.end(); bytes > limit && it != m_lru.begin();) {
+		const Entry& e = *(--it)->second;
+		if (!e.Data->File.empty() != bDisk)
+			continue;
+		bytes -= e.Data->Size;
+		m_map.erase(it->first);
+		it = m_lru.erase(it);
+	}
+}
+
+void CHttpCache::Insert(const string& key, shared_ptr<const Entry> e) {
+	bool bDisk = !e->Data->File.empty();
+	lock_guard<mutex> lk(m_mtx);
+	auto it = m_map.find(key);
+	if (it != m_map.end()) {
+		const Body& old = *it->second->second->Data;
+		(old.File.empty() ? m_memBytes : m_diskBytes) -= old.Size;
+		m_lru.erase(it->second);
+		m_map.erase(it);
+	}
+	(bDisk ? m_diskBytes : m_memBytes) += e->Data->Size;
+	m_lru.emplace_front(key, e);
+	m_map[key] = m_lru.begin();
+	Trim(bDisk);
+}
+
+// Fills the freshness fields of e. False if the response may not be stored
+bool CHttpCache::ParseResponse(const string& head, Entry& e, int& status, int64_t& contentLength) const {
+	string line = FirstLine(head);
+	status = line.size() > 9 ? atoi(line.c_str() + 9) : 0;
+	contentLength = -1;
+	bool bStorable = true, bChunked = false;
+	int64_t sMaxAge = 0, maxAge = 0, expires = 0;		// directive values + 1, 0 if absent
+	e.Date = Now();
+	e.MustRevalidate = false;
+	e.Head = line + "\r\n";
+	for (auto& h : ParseHeaders(head)) {
+		if (IsHeader(h, "Cache-Control")) {
+			if (Directive(h.second, "no-store") >= 0 || Directive(h.second, "private") >= 0)
+				bStorable = false;
+			if (Directive(h.second, "no-cache") >= 0)
+				e.MustRevalidate = true;
+			sMaxAge = (max)(sMaxAge, Directive(h.second, "s-maxage"));
+			maxAge = (max)(maxAge, Directive(h.second, "max-age"));
+		} else if (IsHeader(h, "Expires"))
+			expires = ParseHttpDate(h.second);
+		else if (IsHeader(h, "Date")) {
+			if (int64_t d = ParseHttpDate(h.second))
+				e.Date = d;
+		} else if (IsHeader(h, "ETag"))
+			e.ETag = h.second;
+		else if (IsHeader(h, "Last-Modified"))
+			e.LastModified = h.second;
+		else if (IsHeader(h, "Content-Length"))
+			contentLength = atoll(h.second.c_str());
+		else if (IsHeader(h, "Transfer-Encoding"))
+			bChunked = true;
+		else if (IsHeader(h, "Vary") || IsHeader(h, "Set-Cookie"))
+			bStorable = false;
+		if (!IsHopByHop(h))
+			e.Head += h.first + ": " + h.second + "\r\n";
+	}
+	int64_t lifetime = 0;
+	if (sMaxAge > 0)
+		lifetime = sMaxAge - 1;
+	else if (maxAge > 0)
+		lifetime = maxAge - 1;
+	else if (expires)
+		lifetime = (max)(expires - e.Date, int64_t(0));
+	else if (int64_t lm = ParseHttpDate(e.LastModified))
+		lifetime = (min)((max)((e.Date - lm) / 10, int64_t(0)), MAX_HEURISTIC_LIFETIME);
+	if (e.MustRevalidate)
+		lifetime = 0;
+	e.Expires = Now() + lifetime;
+	if (bChunked)
+		contentLength = -1;
+	if (status == 204 || status == 304 || status / 100 == 1)
+		contentLength = 0;										// no body, whatever the headers say
+	return bStorable && status == 200 && contentLength >= 0 && (lifetime > 0 || !e.ETag.empty() || !e.LastModified.empty());
+}
+
+uint64_t CHttpCache::SendEntry(int fdClient, const Entry& e, bool bNotModified) {
+	string head = bNotModified ? "HTTP/1.1 304 Not Modified\r\n" + e.Head.substr(e.Head.find('\n') + 1) : e.Head;
+	head += "Age: " + to_string((max)(Now() - e.Date, int64_t(0))) + "\r\nConnection: close\r\n\r\n";
+	SendVector v;
+	v.Add(head.data(), head.size());
+	if (!bNotModified)
+		v.Add(e.Data->Data, e.Data->Size);
+	try {
+		v.Send(fdClient);
+	} catch (RCExc) {
+		return 0;
+	}
+	if (!bNotModified)
+		BytesSaved += e.Data->Size;
+	return head.size() + (bNotModified ? 0 : e.Data->Size);
+}
+
+string CHttpCache::Stats() {
+	uint64_t memBytes, diskBytes;
+	{
+		lock_guard<mutex> lk(m_mtx);
+		memBytes = m_memBytes;
+		diskBytes = m_diskBytes;
+	}
+	uint64_t hits = Hits, revalidated = Revalidated, misses = Misses, requests = hits + revalidated + misses;
+	ostringstream os;
+	os << "{\"hits\":" << hits << ",\"revalidated\":" << revalidated << ",\"misses\":" << misses << ",\"stored\":" << Stored
+		<< ",\"hit_ratio\":" << (requests ? (hits + revalidated) * 100 / requests : 0) << ",\"bytes_saved\":" << BytesSaved
+		<< ",\"mem_bytes\":" << memBytes << ",\"disk_bytes\":" << diskBytes << "}";
+	return os.str();
+}
+
+pair<uint64_t, uint64_t> CHttpCache::Serve(const string& key, const string& head, int fdClient, const function<int()>& connect, bool& bHit) {
+	bHit = false;
+	shared_ptr<const Entry> cached = Lookup(key);
+	bool bClientNoCache = false;
+	string clientEtag, clientSince, req = FirstLine(head) + "\r\n";
+	for (auto& h : ParseHeaders(head)) {
+		if ((IsHeader(h, "Cache-Control") && (Directive(h.second, "no-cache") >= 0 || Directive(h.second, "max-age") == 1))
+			|| (IsHeader(h, "Pragma") && h.second == "no-cache"))
+			bClientNoCache = true;
+		if (IsHeader(h, "If-None-Match"))
+			clientEtag = h.second;
+		else if (IsHeader(h, "If-Modified-Since"))
+			clientSince = h.second;
+		else if (!IsHopByHop(h))
+			req += h.first + ": " + h.second + "\r\n";
+	}
+	bool bClientMatch = cached && !clientEtag.empty() && clientEtag == cached->ETag;
+	if (cached && !bClientNoCache && Now() < cached->Expires) {
+		bHit = true;
+		++Hits;
+		return make_pair(uint64_t(0), SendEntry(fdClient, *cached, bClientMatch));
+	}
+
+	if (cached && !cached->ETag.empty())
+		req += "If-None-Match: " + cached->ETag + "\r\n";
+	else if (cached && !cached->LastModified.empty())
+		req += "If-Modified-Since: " + cached->LastModified + "\r\n";
+	else if (!cached) {													// nothing to answer them from: the origin does, its 304 is not stored
+		if (!clientEtag.empty())
+			req += "If-None-Match: " + clientEtag + "\r\n";
+		if (!clientSince.empty())
+			req += "If-Modified-Since: " + clientSince + "\r\n";
+	}
+	req += "Connection: close\r\n\r\n";
+	int fdD = connect();
+	uint64_t up = req.size(), down = 0;
+	if (!SendAll(fdD, req.data(), req.size()))
+		return make_pair(uint64_t(0), down);
+
+	uint8_t buf[65536];
+	string respHead;
+	size_t bodyStart = string::npos;
+	while (bodyStart == string::npos) {
+		ssize_t r = ::recv(fdD, buf, sizeof buf, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return make_pair(up, down);
+		respHead.append((const char*)buf, r);
+		if ((bodyStart = respHead.find("\r\n\r\n")) != string::npos)
+			bodyStart += 4;
+		else if (respHead.size() > MAX_HEAD_SIZE)
+			Throw(errc::message_size);
+	}
+
+	Entry e;
+	int status;
+	int64_t contentLength;
+	bool bStore = ParseResponse(respHead.substr(0, bodyStart), e, status, contentLength);
+	if (cached && status == 304) {
+		++Revalidated;
+		Entry refreshed = *cached;										// new freshness, same body
+		refreshed.Date = e.Date;
+		refreshed.Expires = e.Expires;
+		bHit = true;
+		down = SendEntry(fdClient, refreshed, bClientMatch);
+		Insert(key, make_shared<Entry>(move(refreshed)));
+		return make_pair(up, down);
+	}
+	++Misses;
+
+	string out = e.Head;
+	for (auto& h : ParseHeaders(respHead.substr(0, bodyStart)))
+		if (IsHeader(h, "Transfer-Encoding"))
+			out += h.first + ": " + h.second + "\r\n";							// the body is relayed as is
+	out += "Connection: close\r\n\r\n";
+	auto body = make_shared<Body>();
+	bool bDisk = bStore && (size_t)contentLength > m_memObjectLimit;
+	if (bStore && (bDisk ? (uint64_t)contentLength > m_diskLimit / 4 : (uint64_t)contentLength > m_memLimit / 4))
+		bStore = false;
+	int fdFile = -1;
+	if (bStore && bDisk) {
+		body->File = m_dir + "/" + Convert::ToString(::getpid()) + "." + Convert::ToString(++m_fileSeq);
+		if ((fdFile = ::open(body->File.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+			body->File = String();
+			bStore = false;
+		}
+	} else if (bStore)
+		body->Mem.reserve(contentLength);
+
+	if (!SendAll(fdClient, out.data(), out.size()))
+		bStore = false;
+	down += out.size();
+	uint64_t received = 0;
+	auto consume = [&](const uint8_t *p, size_t n) {
+		if (!SendAll(fdClient, p, n))
+			return false;
+		down += n;
+		received += n;
+		if (bStore) {
+			if (fdFile >= 0)
+				bStore = ::write(fdFile, p, n) == ssize_t(n);
+			else
+				body->Mem.append((const char*)p, n);
+		}
+		return true;
+	};
+	bool bOk = consume((const uint8_t*)respHead.data() + bodyStart, respHead.size() - bodyStart);
+	while (bOk && (contentLength < 0 || received < (uint64_t)contentLength)) {
+		ssize_t r = ::recv(fdD, buf, sizeof buf, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		bOk = consume(buf, r);
+	}
+	if (bStore && received == (uint64_t)contentLength) {
+		body->Size = received;
+		if (fdFile >= 0) {
+			body->Map = received ? ::mmap(nullptr, received, PROT_READ, MAP_SHARED, fdFile, 0) : MAP_FAILED;
+			body->Data = (const uint8_t*)body->Map;
+			bStore = !received || body->Map != MAP_FAILED;
+		} else
+			body->Data = (const uint8_t*)body->Mem.data();
+	} else
+		bStore = false;
+	if (fdFile >= 0)
+		::close(fdFile);
+	if (bStore) {
+		e.Data = body;
+		Insert(key, make_shared<Entry>(move(e)));
+		++Stored;
+	}
+	return make_pair(up, down);
+}
+
+}} // Ext::Inet::
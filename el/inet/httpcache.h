@@ -0,0 +1,74 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include "proxy.h"
+
+#include <list>
+
+namespace Ext {
+	namespace Inet {
+
+// Header lines through the blank line, CRLF or LF line ends. Throws errc::message_size beyond 64 KiB
+string ReadHttpHead(const Stream& stm);
+
+// Shared cache for plain HTTP GETs (RFC 9111 subset): freshness from Cache-Control max-age / s-maxage, Expires or 10% of the
+// Last-Modified age, revalidation with If-None-Match / If-Modified-Since. The client's own conditionals are answered from
+// the entry, or forwarded when there is none. Responses with Vary, Set-Cookie, no-store or
+// private, and requests with Authorization, Cookie or Range bypass it. Small bodies are kept in memory, larger ones in
+// files under a directory, served by mmap. Both tiers are LRU by bytes
+class CHttpCache {
+public:
+	atomic<uint64_t> Hits					// fresh, served without connecting
+		, Revalidated						// origin answered 304, served from the cache
+		, Misses
+		, Stored
+		, BytesSaved;						// body bytes served from the cache
+
+	CHttpCache(size_t memLimit, RCString dir = String(), uint64_t diskLimit = 0, size_t memObjectLimit = 64 * 1024);
+	~CHttpCache();
+
+	// Empty if the request may not be served from the cache. head is the request line as sent to the origin and the
+	// client's header lines
+	static string Key(const ProxyEndPoint& target, const string& head);
+
+	// One GET on blocking sockets, the connection is closed after it. connect() is called only on a miss or to revalidate
+	// and may throw: nothing has been sent to the client then. Later I/O errors end the exchange quietly.
+	// Returns bytes client -> origin, origin -> client. bHit is set if the body came from the cache
+	pair<uint64_t, uint64_t> Serve(const string& key, const string& head, int fdClient, const function<int()>& connect, bool& bHit);
+
+	// One JSON object: the counters above, hit_ratio in percent, mem_bytes and disk_bytes in use
+	string Stats();
+private:
+	struct Body;
+
+	struct Entry {
+		string Head;						// status line and end-to-end headers, no blank line
+		shared_ptr<const Body> Data;
+		int64_t Date, Expires;				// Unix time
+		string ETag, LastModified;
+		bool MustRevalidate;
+	};
+
+	typedef list<pair<string, shared_ptr<const Entry>>> Lru;
+
+	const size_t m_memLimit, m_memObjectLimit;
+	const String m_dir;
+	const uint64_t m_diskLimit;
+	mutex m_mtx;
+	Lru m_lru;
+	unordered_map<string, Lru::iterator> m_map;
+	uint64_t m_memBytes, m_diskBytes;
+	atomic<uint64_t> m_fileSeq;
+
+	shared_ptr<const Entry> Lookup(const string& key);
+	void Insert(const string& key, shared_ptr<const Entry> e);
+	void Trim(bool bDisk);
+	uint64_t SendEntry(int fdClient, const Entry& e, bool bNotModified);
+	bool ParseResponse(const string& head, Entry& e, int& status, int64_t& contentLength) const;
+};
+
+}} // Ext::Inet::
@@ -0,0 +1,165 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "phasetrace.h"
+
+#include <poll.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#	include <cpuid.h>
+#endif
+
+namespace Ext {
+	namespace Inet {
+
+bool PhaseClock::s_bTsc;
+double PhaseClock::s_nsPerTick = 1;
+
+void PhaseClock::Calibrate() {
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned a, b, c, d;
+	if (!__get_cpuid(0x80000007, &a, &b, &c, &d) || !(d & (1 << 8)))		// invariant TSC: constant rate, ticks in deep C-states
+		return;
+	timespec ts0, ts1;
+	::clock_gettime(CLOCK_MONOTONIC, &ts0);
+	uint64_t t0 = __rdtsc();
+	this_thread::sleep_for(chrono::milliseconds(20));
+	::clock_gettime(CLOCK_MONOTONIC, &ts1);
+	uint64_t t1 = __rdtsc();
+	double ns = double(ts1.tv_sec - ts0.tv_sec) * 1e9 + double(ts1.tv_nsec - ts0.tv_nsec);
+	s_nsPerTick = ns / double(t1 - t0);
+	s_bTsc = true;
+#endif
+}
+
+static const char * const s_phaseNames[PhaseTimes::COUNT] = { "accept", "version", "query", "resolve", "connect", "reply", "first_byte" };
+
+static int BucketIndex(uint64_t ns) {
+	if (ns < 4)
+		return int(ns);
+	int b = 63 - __builtin_clzll(ns);
+	return 4 * (b - 1) + int((ns >> (b - 2)) & 3);
+}
+
+static uint64_t BucketUpperNs(int idx) {
+	++idx;
+	return idx <= 4 ? uint64_t(idx - 1) : (uint64_t(4 + idx % 4) << (idx / 4 - 1)) - 1;
+}
+
+// A thread may migrate between marks; TSCs are synchronized but not to the cycle
+static uint64_t Elapsed(const PhaseTimes& times, int from, int to) {
+	return times.T[to] > times.T[from] ? PhaseClock::ToNs(times.T[to] - times.T[from]) : 0;
+}
+
+CPhaseTracer::CPhaseTracer(unsigned sampleEvery, RCString tracePath)
+	: m_sampleEvery(tracePath.empty() ? 0 : sampleEvery)
+	, m_fd(-1)
+	, m_shards(new Shard[SHARDS])
+{
+	for (int i = 0; i < SHARDS; ++i) {
+		Shard& sh = m_shards[i];
+		sh.Seq = 0;
+		for (auto& phase : sh.Buckets)
+			for (auto& bucket : phase)
+				bucket = 0;
+	}
+	if (m_sampleEvery)
+		m_fd = CCheck(::open(tracePath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644));
+}
+
+CPhaseTracer::~CPhaseTracer() {
+	if (m_fd >= 0)
+		::close(m_fd);
+}
+
+void CPhaseTracer::Record(const PhaseTimes& times, const AccessRecord& rec) {
+#ifdef __linux__
+	Shard& sh = m_shards[unsigned(::sched_getcpu()) % SHARDS];		// vDSO / rseq, no syscall
+#else
+	Shard& sh = m_shards[0];
+#endif
+	for (int i = 1, prev = 0; i < PhaseTimes::COUNT; ++i) {
+		if (!times.T[i])
+			continue;
+		if (times.T[prev])
+			sh.Buckets[i][BucketIndex(Elapsed(times, prev, i))].fetch_add(1, memory_order_relaxed);
+		prev = i;
+	}
+	if (m_sampleEvery && sh.Seq.fetch_add(1, memory_order_relaxed) % m_sampleEvery == 0)
+		WriteTrace(times, rec);
+}
+
+// {"ts_us":..,"client":..,"target":..,"error":..,"version_us":..,...}, phases not reached are omitted
+void CPhaseTracer::WriteTrace(const PhaseTimes& times, const AccessRecord& rec) {
+	string s = "{\"ts_us\":" + to_string(rec.StartUs) + ",\"client\":";
+	AppendJsonEndPoint(s, rec.Client);
+	s += ",\"target\":";
+	AppendJsonEndPoint(s, rec.Target);
+	s += ",\"error\":" + to_string(rec.Error);
+	char buf[64];
+	for (int i = 1, prev = 0; i < PhaseTimes::COUNT; ++i) {
+		if (!times.T[i])
+			continue;
+		if (times.T[prev]) {
+			snprintf(buf, sizeof buf, ",\"%s_us\":%.1f", s_phaseNames[i], Elapsed(times, prev, i) / 1000.);
+			s += buf;
+		}
+		prev = i;
+	}
+	s += "}\n";
+	ssize_t r = ::write(m_fd, s.data(), s.size());					// single write, O_APPEND keeps lines whole
+	(void)r;
+}
+
+void WaitFirstByte(int fdA, int fdB, PhaseTimes& phases, volatile bool& bStop) {
+	pollfd pfd[2] = { { fdA, POLLIN, 0 }, { fdB, POLLIN, 0 } };
+	while (!bStop) {
+		int r = ::poll(pfd, 2, 1000);						// Stop() closes the sockets, which doesn't wake poll()
+		if (r > 0) {
+			phases.Mark(PhaseTimes::FirstByte);
+			return;
+		}
+		if (r < 0 && errno != EINTR)
+			return;
+	}
+}
+
+uint64_t CPhaseTracer::Count(int phase) const {
+	uint64_t n = 0;
+	for (int i = 0; i < SHARDS; ++i)
+		for (auto& bucket : m_shards[i].Buckets[phase])
+			n += bucket.load(memory_order_relaxed);
+	return n;
+}
+
+uint64_t CPhaseTracer::PercentileNs(int phase, double q) const {
+	uint64_t counts[BUCKETS] = {}, total = 0;
+	for (int i = 0; i < SHARDS; ++i)
+		for (int j = 0; j < BUCKETS; ++j) {
+			uint64_t n = m_shards[i].Buckets[phase][j].load(memory_order_relaxed);
+			counts[j] += n;
+			total += n;
+		}
+	uint64_t rank = uint64_t(q * double(total)), sum = 0;
+	for (int j = 0; j < BUCKETS; ++j)
+		if ((sum += counts[j]) > rank)
+			return BucketUpperNs(j);
+	return 0;
+}
+
+void CPhaseTracer::Print(ostream& os) const {
+	os << "Handshake phases, us p50/p99/p99.9:";
+	char buf[64];
+	for (int i = 1; i < PhaseTimes::COUNT; ++i)
+		if (uint64_t n = Count(i)) {
+			snprintf(buf, sizeof buf, "%.1f/%.1f/%.1f", PercentileNs(i, 0.5) / 1000., PercentileNs(i, 0.99) / 1000., PercentileNs(i, 0.999) / 1000.);
+			os << " " << s_phaseNames[i] << " " << buf << " (" << n << ")";
+		}
+	os << endl;
+}
+
+}} // Ext::Inet::
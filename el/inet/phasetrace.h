@@ -0,0 +1,92 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include "accesslog.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#	include <x86intrin.h>
+#endif
+
+namespace Ext {
+	namespace Inet {
+
+// RDTSC when the TSC is invariant, CLOCK_MONOTONIC (vDSO, no syscall) otherwise
+class PhaseClock {
+public:
+	static uint64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+		if (s_bTsc)
+			return __rdtsc();
+#endif
+		timespec ts;
+		::clock_gettime(CLOCK_MONOTONIC, &ts);
+		return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+	}
+
+	static uint64_t ToNs(uint64_t ticks) { return uint64_t(double(ticks) * s_nsPerTick); }
+
+	static void Calibrate();						// once at startup, before any thread takes timestamps. Takes ~20 ms
+private:
+	static bool s_bTsc;
+	static double s_nsPerTick;
+};
+
+// Handshake timestamps of one connection, 0 - phase not reached or not applicable.
+// The duration of a phase is from the previous reached one
+struct PhaseTimes {
+	enum Phase {
+		Accept											// connection thread or coroutine starts serving the socket
+		, Version										// first handshake byte read
+		, Query											// GetQuery() done
+		, Resolve										// only when socksd resolves the name itself: source pool, Tor RESOLVE
+		, Connect
+		, Reply
+		, FirstByte										// first byte either way after the reply; copy, splice and coro relays
+		, COUNT
+	};
+
+	uint64_t T[COUNT];
+
+	PhaseTimes() {
+		memset(T, 0, sizeof T);
+	}
+
+	void Mark(Phase phase) {
+		T[phase] = PhaseClock::Now();
+	}
+};
+
+// Marks PhaseTimes::FirstByte when either socket becomes readable, leaving the data for the relay. Polls bStop every second
+void WaitFirstByte(int fdA, int fdB, PhaseTimes& phases, volatile bool& bStop);
+
+// Per-phase log-linear histograms (4 buckets per power of 2, so percentiles are within 25%), sharded by CPU so
+// connections finishing on different cores don't share cache lines. Every sampleEvery-th record is written as a JSON line
+class CPhaseTracer {
+public:
+	CPhaseTracer(unsigned sampleEvery, RCString tracePath = String());		// sampleEvery or tracePath empty - histograms only
+	~CPhaseTracer();
+
+	void Record(const PhaseTimes& times, const AccessRecord& rec);
+	uint64_t Count(int phase) const;
+	uint64_t PercentileNs(int phase, double q) const;
+	void Print(ostream& os) const;
+private:
+	static const int SHARDS = 16, BUCKETS = 252;
+
+	struct alignas(64) Shard {
+		atomic<uint64_t> Seq;
+		atomic<uint64_t> Buckets[PhaseTimes::COUNT][BUCKETS];
+	};
+
+	const unsigned m_sampleEvery;
+	int m_fd;
+	unique_ptr<Shard[]> m_shards;
+
+	void WriteTrace(const PhaseTimes& times, const AccessRecord& rec);
+};
+
+}} // Ext::Inet::
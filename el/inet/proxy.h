@@ -33,9 +33,135 @@ ENUM_CLASS(QueryType) {
 	, RevResolve,
 } END_ENUM_CLASS(QueryType);
 
+// Handshake endpoint held by value: inline IP address or host name, so parsing and replying allocate nothing and need no RTTI
+struct ProxyEndPoint {
+	enum EKind : uint8_t {
+		None,
+		IPv4,
+		IPv6,
+		Host
+	};
+
+	EKind Kind;
+	uint8_t HostLength;
+	uint16_t Port;					// host byte order
+	union {
+		uint8_t Address[16];		// network byte order
+		char HostName[256];			// NUL-terminated
+	};
+
+	ProxyEndPoint()
+		: Kind(None)
+		, HostLength(0)
+		, Port(0)
+	{
+		HostName[0] = 0;
+	}
+
+	explicit ProxyEndPoint(const sockaddr& sa)
+		: ProxyEndPoint()
+	{
+		switch (sa.sa_family) {
+		case AF_INET:
+			Kind = IPv4;
+			memcpy(Address, &((const sockaddr_in&)sa).sin_addr, 4);
+			Port = ntohs(((const sockaddr_in&)sa).sin_port);
+			break;
+		case AF_INET6:
+			Kind = IPv6;
+			memcpy(Address, &((const sockaddr_in6&)sa).sin6_addr, 16);
+			Port = ntohs(((const sockaddr_in6&)sa).sin6_port);
+			break;
+		}
+	}
+
+	ProxyEndPoint(const IPEndPoint& ep)
+		: ProxyEndPoint(*ep.c_sockaddr())
+	{}
+
+	static ProxyEndPoint FromAddress(EKind kind, const uint8_t *p, uint16_t port) {
+		ProxyEndPoint r;
+		r.Kind = kind;
+		r.Port = port;
+		memcpy(r.Address, p, kind == IPv4 ? 4 : 16);
+		return r;
+	}
+
+	static ProxyEndPoint FromHost(const char *host, size_t len, uint16_t port) {
+		if (len > 255)
+			Throw(ExtErr::SOCKS_IncorrectProtocol);
+		ProxyEndPoint r;
+		r.Kind = Host;
+		r.Port = port;
+		r.HostLength = uint8_t(len);
+		memcpy(r.HostName, host, len);
+		r.HostName[len] = 0;
+		return r;
+	}
+
+	// IP literal or host name
+	static ProxyEndPoint Parse(const char *s, size_t len, uint16_t port) {
+		ProxyEndPoint r = FromHost(s, len, port);
+		uint8_t a[16];
+		if (::inet_pton(AF_INET, r.HostName, a) == 1)
+			return FromAddress(IPv4, a, port);
+		if (::inet_pton(AF_INET6, r.HostName, a) == 1)
+			return FromAddress(IPv6, a, port);
+		return r;
+	}
+
+	bool IsIP() const { return Kind == IPv4 || Kind == IPv6; }
+
+	socklen_t ToSockAddr(sockaddr_storage& ss) const {
+		memset(&ss, 0, sizeof ss);
+		switch (Kind) {
+		case IPv4:
+			{
+				sockaddr_in& sa = (sockaddr_in&)ss;
+				sa.sin_family = AF_INET;
+				sa.sin_port = htons(Port);
+				memcpy(&sa.sin_addr, Address, 4);
+				return sizeof sa;
+			}
+		case IPv6:
+			{
+				sockaddr_in6& sa = (sockaddr_in6&)ss;
+				sa.sin6_family = AF_INET6;
+				sa.sin6_port = htons(Port);
+				memcpy(&sa.sin6_addr, Address, 16);
+				return sizeof sa;
+			}
+		default:
+			Throw(errc::address_family_not_supported);
+		}
+	}
+
+	IPEndPoint ToIPEndPoint() const {
+		switch (Kind) {
+		case IPv4:	return IPEndPoint(IPAddress(*(const uint32_t*)Address), Port);
+		case IPv6:	return IPEndPoint(IPAddress(ConstBuf(Address, 16)), Port);
+		default:	Throw(errc::address_family_not_supported);
+		}
+	}
+
+	DnsEndPoint ToDnsEndPoint() const {
+		return DnsEndPoint(String(HostName, HostLength), Port);
+	}
+};
+
+inline ostream& operator<<(ostream& os, const ProxyEndPoint& ep) {
+	char buf[INET6_ADDRSTRLEN];
+	switch (ep.Kind) {
+	case ProxyEndPoint::IPv4:	return os << ::inet_ntop(AF_INET, ep.Address, buf, sizeof buf) << ":" << ep.Port;
+	case ProxyEndPoint::IPv6:	return os << "[" << ::inet_ntop(AF_INET6, ep.Address, buf, sizeof buf) << "]:" << ep.Port;
+	case ProxyEndPoint::Host:	return os << ep.HostName << ":" << ep.Port;
+	default:					return os << "<none>";
+	}
+}
+
 struct CProxyQuery {
 	QueryType Typ;
-	ptr<EndPoint> Ep;
+	ProxyEndPoint Ep;
 };
 
 inline ostream& operator<<(ostream& os, const CProxyQuery& pq) {
@@ -46,7 +172,7 @@ inline ostream& operator<<(ostream& os, const CProxyQuery& pq) {
 	case QueryType::Resolve:		os << "QueryType::Resolve"; break;
 	case QueryType::RevResolve:		os << "QueryType::RevResolve"; break;
 	}
-	return os << " " << *pq.Ep;
+	return os << " " << pq.Ep;
 }
 
 #pragma pack(push,1)
@@ -54,7 +180,7 @@ inline ostream& operator<<(ostream& os, const CProxyQuery& pq) {
 struct CSocks5Header {
 	uint8_t Cmd;
 	uint8_t AddrType;
-	ptr<InternetEndPoint> EndPoint;
+	ProxyEndPoint EndPoint;
 };
 
 struct SSocks5ReplyHeader {
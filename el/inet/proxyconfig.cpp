@@ -0,0 +1,154 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "proxyconfig.h"
+
+namespace Ext {
+	namespace Inet {
+
+bool ProxyRoute::Matches(const ProxyEndPoint& ep) const {
+	if (Net.Kind == ProxyEndPoint::Host) {
+		const char *pat = Net.HostName;
+		if (!strcmp(pat, "*"))
+			return true;
+		if (ep.Kind != ProxyEndPoint::Host)
+			return false;
+		if (pat[0] == '*' && pat[1] == '.') {
+			size_t n = Net.HostLength - 2;
+			if (ep.HostLength == n)
+				return !strcasecmp(ep.HostName, pat + 2);
+			return ep.HostLength > n && ep.HostName[ep.HostLength - n - 1] == '.' && !strcasecmp(ep.HostName + ep.HostLength - n, pat + 2);
+		}
+		return !strcasecmp(ep.HostName, pat);
+	}
+	if (ep.Kind != Net.Kind)
+		return false;
+	int bytes = PrefixLength / 8, bits = PrefixLength % 8;
+	if (memcmp(ep.Address, Net.Address, bytes))
+		return false;
+	return !bits || !((ep.Address[bytes] ^ Net.Address[bytes]) & (0xFF00 >> bits));
+}
+
+bool ProxyConfig::IsAllowed(const ProxyEndPoint& ep) const {
+	for (auto& r : Routes)
+		if (r.Matches(ep))
+			return r.Allow;
+	return true;
+}
+
+bool ProxyConfig::IsAddressAllowed(const ProxyEndPoint& ep) const {
+	for (auto& r : Routes)
+		if (r.Net.Kind != ProxyEndPoint::Host && r.Matches(ep))
+			return r.Allow;
+	return true;
+}
+
+bool ProxyConfig::HasAddressRoutes() const {
+	return any_of(Routes.begin(), Routes.end(), [](const ProxyRoute& r) { return r.Net.Kind != ProxyEndPoint::Host; });
+}
+
+SniAction ProxyConfig::RouteSni(const ProxyEndPoint& serverName) const {
+	for (auto& r : SniRoutes)
+		if (r.Name.Matches(serverName))
+			return r.Action;
+	return SniAction::None;
+}
+
+// "1.2.3.4", "::1", with an optional "/prefix". Returns false if s is not an address
+static bool ParseNet(const string& s, ProxyEndPoint& ep, int& prefixLength) {
+	size_t slash = s.find('/');
+	string a = s.substr(0, slash);
+	uint8_t buf[16];
+	if (::inet_pton(AF_INET, a.c_str(), buf) == 1)
+		ep = ProxyEndPoint::FromAddress(ProxyEndPoint::IPv4, buf, 0);
+	else if (::inet_pton(AF_INET6, a.c_str(), buf) == 1)
+		ep = ProxyEndPoint::FromAddress(ProxyEndPoint::IPv6, buf, 0);
+	else
+		return false;
+	int maxLen = ep.Kind == ProxyEndPoint::IPv4 ? 32 : 128;
+	prefixLength = slash == string::npos ? maxLen : atoi(s.c_str() + slash + 1);
+	if (prefixLength < 0 || prefixLength > maxLen)
+		Throw(errc::invalid_argument);
+	return true;
+}
+
+ProxyRoute ProxyRoute::Parse(const string& s, bool allow) {
+	ProxyRoute r;
+	r.Allow = allow;
+	if (!ParseNet(s, r.Net, r.PrefixLength)) {
+		r.Net = ProxyEndPoint::FromHost(s.c_str(), s.size(), 0);
+		r.PrefixLength = 0;
+	}
+	return r;
+}
+
+// "port", "ip:port" or "[ipv6]:port"
+static IPEndPoint ParseListener(const string& s) {
+	size_t colon = s.rfind(':');
+	string host = colon == string::npos ? "0.0.0.0" : s.substr(0, colon);
+	if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+		host = host.substr(1, host.size() - 2);
+	int port = atoi(s.c_str() + (colon == string::npos ? 0 : colon + 1));
+	ProxyEndPoint ep;
+	int prefixLength;
+	if (port <= 0 || port > 65535 || !ParseNet(host, ep, prefixLength))
+		Throw(errc::invalid_argument);
+	ep.Port = uint16_t(port);
+	return ep.ToIPEndPoint();
+}
+
+void ProxyConfig::Load(const path& p) {
+	ifstream ifs(p.c_str());
+	if (!ifs)
+		throw system_error(make_error_code(errc::no_such_file_or_directory), p.string());
+	int lineNo = 0;
+	for (string line; getline(ifs, line);) {
+		++lineNo;
+		line = line.substr(0, line.find('#'));
+		istringstream is(line);
+		vector<string> args;
+		for (string w; is >> w;)
+			args.push_back(w);
+		if (args.empty())
+			continue;
+		const string& key = args[0];
+		try {
+			if (key == "listen" && args.size() == 2)
+				Listeners.push_back(ParseListener(args[1]));
+			else if (key == "max_connections" && args.size() == 2)
+				MaxConnections = stoul(args[1]);
+			else if (key == "handshake_timeout" && args.size() == 2)
+				HandshakeTimeoutMs = int(stod(args[1]) * 1000);
+			else if (key == "connect_timeout" && args.size() == 2)
+				ConnectTimeoutMs = int(stod(args[1]) * 1000);
+			else if ((key == "allow" || key == "deny") && args.size() == 2)
+				Routes.push_back(ProxyRoute::Parse(args[1], key == "allow"));
+			else if (key == "sni" && args.size() == 3) {
+				SniRoute r;
+				if (args[1] == "direct")
+					r.Action = SniAction::Direct;
+				else if (args[1] == "upstream")
+					r.Action = SniAction::Upstream;
+				else if (args[1] == "deny")
+					r.Action = SniAction::Deny;
+				else
+					Throw(errc::invalid_argument);
+				r.Name = ProxyRoute::Parse(args[2], r.Action != SniAction::Deny);
+				SniRoutes.push_back(r);
+			} else if (key == "user" && args.size() == 3)
+				Users[args[1]] = args[2];
+			else if (key == "mux_secret" && args.size() == 2)
+				MuxSecret = args[1];
+			else
+				Throw(errc::invalid_argument);
+		} catch (const exception&) {
+			throw system_error(make_error_code(errc::invalid_argument), p.string() + ":" + to_string(lineNo) + ": " + line);
+		}
+	}
+}
+
+}} // Ext::Inet::
@@ -0,0 +1,105 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include "proxy.h"
+
+namespace Ext {
+	namespace Inet {
+
+// Read-mostly pointer. Each thread caches its last snapshot and revalidates it with an acquire load of the generation,
+// so Get() takes no lock: the load and the copy's refcount increment. Only a thread that sees a new generation takes
+// the mutex, once, to refresh its cache. A replaced snapshot stays alive until every thread has called Get() again
+template <class T> class RcuPtr {
+public:
+	RcuPtr(shared_ptr<const T> p = make_shared<T>())
+		: m_cur(move(p))
+	{}
+
+	shared_ptr<const T> Get() const {
+		Cache& c = t_cache;
+		uint64_t gen = m_gen.load(memory_order_acquire);
+		if (c.Owner != this || c.Gen != gen) {
+			lock_guard<mutex> lk(m_mtx);
+			c.Owner = this;
+			c.Gen = m_gen.load(memory_order_relaxed);
+			c.Ptr = m_cur;
+		}
+		return c.Ptr;
+	}
+
+	void Publish(shared_ptr<const T> p) {							// the old snapshot is released with p, after the lock
+		lock_guard<mutex> lk(m_mtx);
+		m_cur.swap(p);
+		m_gen.store(m_gen.load(memory_order_relaxed) + 1, memory_order_release);
+	}
+private:
+	struct Cache {
+		const RcuPtr *Owner = nullptr;
+		uint64_t Gen = 0;
+		shared_ptr<const T> Ptr;
+	};
+	static thread_local Cache t_cache;
+
+	mutable mutex m_mtx;
+	shared_ptr<const T> m_cur;
+	atomic<uint64_t> m_gen { 0 };
+};
+
+template <class T> thread_local typename RcuPtr<T>::Cache RcuPtr<T>::t_cache;
+
+struct ProxyRoute {
+	bool Allow;
+	ProxyEndPoint Net;								// IPv4 / IPv6 network, or Host: "*", "name" or "*.suffix"
+	int PrefixLength;
+
+	bool Matches(const ProxyEndPoint& ep) const;
+
+	// "1.2.3.0/24", "::1", "name", "*.suffix" or "*". Throws errc::invalid_argument for a bad prefix length
+	static ProxyRoute Parse(const string& s, bool allow = true);
+};
+
+ENUM_CLASS(SniAction) {
+	None											// no rule matched, the tunnel goes as without SNI rules
+	, Direct										// connect from here, also with -u
+	, Upstream										// through the -u peer
+	, Deny
+} END_ENUM_CLASS(SniAction);
+
+// "sni direct|upstream|deny pattern": tunnels to port 443 are routed by the server name of their ClientHello
+struct SniRoute {
+	SniAction Action;
+	ProxyRoute Name;								// host name pattern only
+};
+
+// Immutable once published. A handshake takes the current snapshot and keeps it for the life of the tunnel
+struct ProxyConfig {
+	vector<IPEndPoint> Listeners;
+	size_t MaxConnections;							// 0 - unlimited
+	int HandshakeTimeoutMs, ConnectTimeoutMs;		// 0 - none / the kernel's SYN retries
+	vector<ProxyRoute> Routes;						// first match wins, allow if none matches
+	vector<SniRoute> SniRoutes;						// first match wins
+	unordered_map<string, string> Users;			// SOCKS5 username/password or HTTP Basic auth is required if not empty, SOCKS4 is refused
+	string MuxSecret;								// -u sends it, -U requires it of every session
+
+	ProxyConfig()
+		: MaxConnections(0)
+		, HandshakeTimeoutMs(0)
+		, ConnectTimeoutMs(0)
+	{}
+
+	bool IsAllowed(const ProxyEndPoint& ep) const;
+
+	// The address a host name resolved to, against the IPv4 / IPv6 network routes only. Allow if none matches
+	bool IsAddressAllowed(const ProxyEndPoint& ep) const;
+	bool HasAddressRoutes() const;
+	SniAction RouteSni(const ProxyEndPoint& serverName) const;
+
+	// "keyword args..." lines, # comments. Throws errc::invalid_argument naming the file and line
+	void Load(const path& p);
+};
+
+}} // Ext::Inet::
@@ -0,0 +1,244 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "proxyprotocol.h"
+
+namespace Ext {
+	namespace Inet {
+
+static const uint8_t s_v2Sig[12] = { 0x0D, 0x0A, 0x0D, 0x0A, 0x00, 0x0D, 0x0A, 0x51, 0x55, 0x49, 0x54, 0x0A };
+static const char s_v1Sig[] = "PROXY ";
+
+static size_t ParseV2(const uint8_t *p, size_t len, ProxyProtocolHeader& hdr) {
+	if (len < 16)
+		return 0;
+	size_t size = 16 + (size_t(p[14]) << 8 | p[15]);
+	if ((p[12] & 0xF0) != 0x20)
+		Throw(errc::protocol_error);
+	if (len < size)
+		return 0;
+	if ((p[12] & 0x0F) == 1) {							// PROXY; LOCAL keeps the connection's addresses
+		const uint8_t *a = p + 16;
+		switch (p[13] & 0xF0) {
+		case 0x10:										// AF_INET
+			if (size < 16 + 12)
+				Throw(errc::protocol_error);
+			hdr.Src = ProxyEndPoint::FromAddress(ProxyEndPoint::IPv4, a, uint16_t(a[8] << 8 | a[9]));
+			hdr.Dst = ProxyEndPoint::FromAddress(ProxyEndPoint::IPv4, a + 4, uint16_t(a[10] << 8 | a[11]));
+			break;
+		case 0x20:										// AF_INET6
+			if (size < 16 + 36)
+				Throw(errc::protocol_error);
+			hdr.Src = ProxyEndPoint::FromAddress(ProxyEndPoint::IPv6, a, uint16_t(a[32] << 8 | a[33]));
+			hdr.Dst = ProxyEndPoint::FromAddress(ProxyEndPoint::IPv6, a + 16, uint16_t(a[34] << 8 | a[35]));
+			break;
+		}
+	}
+	return size;
+}
+
+static ProxyEndPoint ParseV1Address(ProxyEndPoint::EKind kind, const char *s, const char *port) {
+	uint8_t a[16];
+	char *end;
+	unsigned long n = strtoul(port, &end, 10);
+	if (::inet_pton(kind == ProxyEndPoint::IPv4 ? AF_INET : AF_INET6, s, a) != 1 || *end || n > 65535)
+		Throw(errc::protocol_error);
+	return ProxyEndPoint::FromAddress(kind, a, uint16_t(n));
+}
+
+static size_t ParseV1(const uint8_t *p, size_t len, ProxyProtocolHeader& hdr) {
+	const uint8_t *e = (const uint8_t*)memchr(p, '\n', (min)(len, PROXY_V1_MAX_SIZE));
+	if (!e) {
+		if (len >= PROXY_V1_MAX_SIZE)
+			Throw(errc::protocol_error);
+		return 0;
+	}
+	if (e[-1] != '\r')
+		Throw(errc::protocol_error);
+	char line[PROXY_V1_MAX_SIZE + 1];
+	size_t n = e - 1 - p;
+	memcpy(line, p, n);
+	line[n] = 0;
+
+	char *save = nullptr, *tok[6];
+	int nTok = 0;
+	for (char *t = strtok_r(line, " ", &save); t; t = strtok_r(nullptr, " ", &save))
+		if (nTok < 6)
+			tok[nTok++] = t;
+	if (nTok >= 2 && !strcmp(tok[1], "UNKNOWN"))
+		return e + 1 - p;
+	if (nTok != 6)
+		Throw(errc::protocol_error);
+	ProxyEndPoint::EKind kind;
+	if (!strcmp(tok[1], "TCP4"))
+		kind = ProxyEndPoint::IPv4;
+	else if (!strcmp(tok[1], "TCP6"))
+		kind = ProxyEndPoint::IPv6;
+	else
+		Throw(errc::protocol_error);
+	hdr.Src = ParseV1Address(kind, tok[2], tok[4]);
+	hdr.Dst = ParseV1Address(kind, tok[3], tok[5]);
+	return e + 1 - p;
+}
+
+size_t ParseProxyHeader(const uint8_t *p, size_t len, ProxyProtocolHeader& hdr) {
+	if (!len)
+		return 0;
+	if (p[0] == s_v2Sig[0]) {
+		if (memcmp(p, s_v2Sig, (min)(len, sizeof s_v2Sig)))
+			Throw(errc::protocol_error);
+		return len < sizeof s_v2Sig ? 0 : ParseV2(p, len, hdr);
+	}
+	if (memcmp(p, s_v1Sig, (min)(len, strlen(s_v1Sig))))
+		Throw(errc::protocol_error);
+	return len < strlen(s_v1Sig) ? 0 : ParseV1(p, len, hdr);
+}
+
+// Total bytes to wait for after ParseProxyHeader() asked for more: the v2 header with its length field, else one more byte
+// of the v1 line, whose CRLF can't be known in advance
+static size_t ProxyHeaderNeed(const uint8_t *p, size_t len) {
+	if (len && p[0] == s_v2Sig[0])
+		return len < 16 ? 16 : 16 + (size_t(p[14]) << 8 | p[15]);
+	return len + 1;
+}
+
+size_t FormatProxyHeaderV2(uint8_t buf[PROXY_V2_MAX_SIZE], const ProxyEndPoint& src, const ProxyEndPoint& dst) {
+	memcpy(buf, s_v2Sig, sizeof s_v2Sig);
+	uint8_t *a = buf + 16;
+	if (!src.IsIP() || !dst.IsIP()) {
+		buf[12] = 0x20;									// LOCAL
+		buf[13] = 0;
+		buf[14] = buf[15] = 0;
+		return 16;
+	}
+	buf[12] = 0x21;										// PROXY
+	if (src.Kind == ProxyEndPoint::IPv4 && dst.Kind == ProxyEndPoint::IPv4) {
+		buf[13] = 0x11;									// TCP over IPv4
+		memcpy(a, src.Address, 4);
+		memcpy(a + 4, dst.Address, 4);
+		a += 8;
+	} else {
+		buf[13] = 0x21;									// TCP over IPv6, IPv4 ends as v4-mapped
+		for (const ProxyEndPoint *ep : { &src, &dst }) {
+			if (ep->Kind == ProxyEndPoint::IPv4) {
+				memset(a, 0, 10);
+				a[10] = a[11] = 0xFF;
+				memcpy(a + 12, ep->Address, 4);
+			} else
+				memcpy(a, ep->Address, 16);
+			a += 16;
+		}
+	}
+	for (const ProxyEndPoint *ep : { &src, &dst }) {
+		*a++ = uint8_t(ep->Port >> 8);
+		*a++ = uint8_t(ep->Port);
+	}
+	size_t len = a - buf - 16;
+	buf[14] = uint8_t(len >> 8);
+	buf[15] = uint8_t(len);
+	return a - buf;
+}
+
+void CReadAheadStream::Fill() const {
+	if (m_beg == m_end)
+		m_beg = m_end = 0;
+	size_t r = m_stm.Read(m_buf + m_end, BUF_SIZE - m_end);
+	if (!r)
+		Throw(ExtErr::EndOfStream);
+	m_end += r;
+}
+
+size_t CReadAheadStream::Read(void *buf, size_t count) const {
+	if (m_beg == m_end) {
+		if (count >= BUF_SIZE)
+			return m_stm.Read(buf, count);
+		m_beg = m_end = 0;
+		size_t r = m_stm.Read(m_buf, BUF_SIZE);
+		if (!r)
+			return 0;
+		m_end = r;
+	}
+	size_t n = (min)(count, m_end - m_beg);
+	memcpy(buf, m_buf + m_beg, n);
+	m_beg += n;
+	return n;
+}
+
+int CReadAheadStream::ReadByte() const {
+	uint8_t b;
+	return Read(&b, 1) ? b : -1;
+}
+
+void CReadAheadStream::ReadBuffer(void *buf, size_t count) const {
+	for (uint8_t *p = (uint8_t*)buf; count;) {
+		if (m_beg == m_end)
+			Fill();
+		size_t n = (min)(count, m_end - m_beg);
+		memcpy(p, m_buf + m_beg, n);
+		m_beg += n;
+		p += n;
+		count -= n;
+	}
+}
+
+Span CReadAheadStream::Peek(size_t count) const {
+	if (count > BUF_SIZE)
+		Throw(errc::message_size);
+	if (m_beg + count > BUF_SIZE) {
+		memmove(m_buf, m_buf + m_beg, m_end - m_beg);
+		m_end -= exchange(m_beg, 0);
+	}
+	while (m_end - m_beg < count)
+		Fill();
+	return Span(m_buf + m_beg, m_end - m_beg);
+}
+
+static void ThrowRecvError(ssize_t r) {
+	if (r < 0)
+		Throw(error_code(errno == EAGAIN ? ETIMEDOUT : errno, system_category()));
+	Throw(ExtErr::EndOfStream);
+}
+
+void ReadProxyHeader(int fd, ProxyProtocolHeader& hdr) {
+	uint8_t buf[CReadAheadStream::BUF_SIZE];
+	size_t n = 0;
+	for (size_t need = sizeof buf, flags = MSG_PEEK; !n;) {
+		ssize_t r = ::recv(fd, buf, need, int(flags));		// the first peek takes what has arrived, usually the whole header
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			ThrowRecvError(r);
+		}
+		if (!(n = ParseProxyHeader(buf, r, hdr))) {
+			if ((need = ProxyHeaderNeed(buf, r)) > sizeof buf)
+				Throw(errc::message_size);
+			flags = MSG_PEEK | MSG_WAITALL;					// only an incomplete header waits, for need bytes
+		}
+	}
+	for (size_t got = 0; got < n;) {
+		ssize_t r = ::recv(fd, buf + got, n - got, MSG_WAITALL);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			ThrowRecvError(r);
+		}
+		got += r;
+	}
+}
+
+void CReadAheadStream::ReadProxyHeader(ProxyProtocolHeader& hdr) {
+	for (size_t need = 1;;) {
+		Span s = Peek(need);
+		if (size_t n = ParseProxyHeader(s.data(), s.size(), hdr)) {
+			Skip(n);
+			return;
+		}
+		need = ProxyHeaderNeed(s.data(), s.size());
+	}
+}
+
+}} // Ext::Inet::
@@ -0,0 +1,63 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include "proxy.h"
+
+namespace Ext {
+	namespace Inet {
+
+// HAProxy PROXY protocol, v1 (text) and v2 (binary)
+
+const size_t PROXY_V1_MAX_SIZE = 107;
+const size_t PROXY_V2_MAX_SIZE = 16 + 36;					// without TLVs, as we emit it
+
+struct ProxyProtocolHeader {
+	ProxyEndPoint Src, Dst;								// None for LOCAL / UNKNOWN, the connection's own addresses apply
+};
+
+// Returns the header length, 0 if more bytes are needed. Throws errc::protocol_error if p does not start with a valid header
+size_t ParseProxyHeader(const uint8_t *p, size_t len, ProxyProtocolHeader& hdr);
+
+// Blocking socket: consumes exactly the header, leaving what follows (e.g. a TLS ClientHello) in the socket
+void ReadProxyHeader(int fd, ProxyProtocolHeader& hdr);
+
+// v2 PROXY command, or LOCAL if either end point is not an IP address
+size_t FormatProxyHeaderV2(uint8_t buf[PROXY_V2_MAX_SIZE], const ProxyEndPoint& src, const ProxyEndPoint& dst);
+
+// Stream with a read-ahead buffer: one recv usually brings the PROXY header together with the start of the handshake.
+// Bytes left after the handshake belong to the tunnel, see Unread(). Big enough to peek at a ClientHello with post-quantum key shares
+class CReadAheadStream : public Stream {
+public:
+	static const size_t BUF_SIZE = 4096;
+
+	CReadAheadStream(Stream& stm)
+		: m_stm(stm)
+		, m_beg(0)
+		, m_end(0)
+	{}
+
+	size_t Read(void *buf, size_t count) const override;
+	int ReadByte() const override;
+	void ReadBuffer(void *buf, size_t count) const override;
+	void WriteBuffer(const void *buf, size_t count) override { m_stm.WriteBuffer(buf, count); }
+	void Flush() override { m_stm.Flush(); }
+	bool Eof() const override { return m_beg == m_end && m_stm.Eof(); }
+
+	Span Peek(size_t count) const;							// at least count buffered bytes, count <= BUF_SIZE
+	void Skip(size_t count) { m_beg += count; }
+	Span Unread() const { return Span(m_buf + m_beg, m_end - m_beg); }
+
+	void ReadProxyHeader(ProxyProtocolHeader& hdr);
+private:
+	Stream& m_stm;
+	mutable uint8_t m_buf[BUF_SIZE];
+	mutable size_t m_beg, m_end;
+
+	void Fill() const;
+};
+
+}} // Ext::Inet::
@@ -11,26 +11,27 @@
 namespace Ext {
 	namespace Inet {
 
+// SOCKS4 has no password: with users configured it is refused
 class CSocks4Relay : public CProxyRelay {
-	String ReadSocks4String() {
-		String s;
-		while (true) {
-			char ch;
-			m_pStm->ReadBuffer(&ch, 1);
-			if (!ch)
-				return s;
-			s += String(ch);
+	// Reads a NUL-terminated string into buf, returns its length
+	size_t ReadSocks4String(char *buf, size_t size) {
+		for (size_t len = 0; len < size; ++len) {
+			m_pStm->ReadBuffer(buf + len, 1);
+			if (!buf[len])
+				return len;
 		}
+		Throw(ExtErr::SOCKS_IncorrectProtocol);
 	}
-public:
-	CProxyQuery GetQuery(char beg) override {
+
+	// SOCKS4a: 0.0.0.x means the host name follows the user ID
+	static bool IsSocks4a(const uint8_t buf[7]) {
+		return !buf[3] && !buf[4] && !buf[5] && buf[6];
+	}
+
+	static CProxyQuery MakeQuery(const uint8_t buf[7], const char *hostName, size_t hostLen) {
 		CProxyQuery pq;
-		uint8_t buf[7];
-		m_pStm->ReadBuffer(buf,7);
-		uint16_t port = ntohs(*(uint16_t*)(buf+1));
-		uint32_t host = *(uint32_t*)(buf + 3);
-		String userID = ReadSocks4String();
-		pq.Ep = host < 256 ? (EndPoint*)new DnsEndPoint(ReadSocks4String(), port) : new IPEndPoint(host, port);
+		uint16_t port = uint16_t(buf[1] << 8 | buf[2]);
+		pq.Ep = IsSocks4a(buf) ? ProxyEndPoint::FromHost(hostName, hostLen, port) : ProxyEndPoint::FromAddress(ProxyEndPoint::IPv4, buf + 3, port);
 		switch (*buf) {
 		case 1: pq.Typ = QueryType::Connect; break;
 		case 2: pq.Typ = QueryType::Bind;    break;
@@ -38,84 +39,202 @@ public:
 		}
 		return pq;
 	}
+public:
+	CProxyQuery GetQuery(char beg) override {
+		uint8_t buf[7];
+		m_pStm->ReadBuffer(buf,7);
+		char userID[256], hostName[256];
+		ReadSocks4String(userID, sizeof userID);
+		size_t hostLen = IsSocks4a(buf) ? ReadSocks4String(hostName, sizeof hostName) : 0;
+		if (IsAuthRequired()) {
+			SendReply(ProxyEndPoint(), make_error_code(errc::permission_denied));
+			Throw(errc::permission_denied);
+		}
+		return MakeQuery(buf, hostName, hostLen);
+	}
+
+#if UCFG_INET_COROUTINES
+	static Task<size_t> ReadSocks4StringAsync(AsyncStream& stm, char *buf, size_t size) {
+		for (size_t len = 0; len < size; ++len) {
+			if (!(buf[len] = (char)co_await stm.ReadByte()))
+				co_return len;
+		}
+		Throw(ExtErr::SOCKS_IncorrectProtocol);
+	}
 
-	void SendReply(const InternetEndPoint& ep, const error_code& ec) override {
-		uint8_t ar[8] = {0};
+	Task<CProxyQuery> GetQueryAsync(AsyncStream& stm, char beg) override {
+		uint8_t buf[7];
+		co_await stm.ReadBuffer(buf, 7);
+		char userID[256], hostName[256];
+		co_await ReadSocks4StringAsync(stm, userID, sizeof userID);
+		size_t hostLen = 0;
+		if (IsSocks4a(buf))
+			hostLen = co_await ReadSocks4StringAsync(stm, hostName, sizeof hostName);
+		if (IsAuthRequired()) {
+			co_await SendReplyAsync(stm, ProxyEndPoint(), make_error_code(errc::permission_denied));
+			Throw(errc::permission_denied);
+		}
+		co_return MakeQuery(buf, hostName, hostLen);
+	}
+#endif
+protected:
+	size_t FormatReply(uint8_t ar[MAX_REPLY_SIZE], const ProxyEndPoint& ep, const error_code& ec) override {
+		memset(ar, 0, 8);
 		if (ec)
 			ar[1] = 91;
 		else {
 			ar[1] = 90;
-			*(uint16_t*)(ar + 2) = htons(ep.Port);
-			const IPEndPoint& ipEp = dynamic_cast<const IPEndPoint&>(ep);
-			*(uint32_t*)(ar + 4) = htonl(ipEp.Address.GetIP());
+			ar[2] = uint8_t(ep.Port >> 8);
+			ar[3] = uint8_t(ep.Port);
+			if (ep.Kind == ProxyEndPoint::IPv4)
+				memcpy(ar + 4, ep.Address, 4);
 		}
-		m_pStm->WriteBuffer(ar, sizeof ar);
+		return 8;
 	}
 };
 
 // RFC 1928
 class CSocks5Relay : public CProxyRelay {
-public:
-	void ReadEndPoint(CSocks5Header& header, Stream& stm) {
-		BinaryReader rd(stm);
-		switch (header.AddrType) {
-		case 1:
-			header.EndPoint = new IPEndPoint(IPAddress(rd.ReadUInt32()), 0);
-			break;
-		case 4:
-			{
-				uint8_t har[16];
-				rd.Read(har, sizeof(har));
-				header.EndPoint = new IPEndPoint(IPAddress(ConstBuf(har, 16)), 0);
-			}
-			break;
-		case 2:
-			break;
-		case 3:
-			{
-				uint8_t len = rd.ReadByte();
-				uint8_t *hp = (uint8_t*)alloca(len);
-				rd.Read(hp, len);
-				header.EndPoint = new DnsEndPoint(String((char*)hp, len), 0);
-			}
-			break;
+	static const int NO_REPLY = -1;
+	static const uint8_t METHOD_NONE = 0, METHOD_PASSWORD = 2, METHOD_UNACCEPTABLE = 0xFF;
+
+	// Method for the selection reply, NO_REPLY for a legacy client that offered none
+	int SelectMethod(const uint8_t *pm, uint8_t nMethods) const {
+		bool bAuth = IsAuthRequired();
+		if (!nMethods && !bAuth)
+			return NO_REPLY;
+		uint8_t method = bAuth ? METHOD_PASSWORD : METHOD_NONE;
+		return memchr(pm, method, nMethods) ? method : METHOD_UNACCEPTABLE;
+	}
+
+	// RFC 1929 request: ver, ulen, user, plen, password. Returns the status byte
+	uint8_t CheckPassword(const uint8_t *user, size_t ulen, const uint8_t *password, size_t plen) const {
+		auto it = m_pUsers->find(string((const char*)user, ulen));
+		return it != m_pUsers->end() && it->second.size() == plen && !memcmp(it->second.data(), password, plen) ? 0 : 1;
+	}
+
+	void Authenticate(Stream& stm) {
+		uint8_t ver, user[256], password[256], ulen, plen;
+		stm.ReadBuffer(&ver, 1);
+		stm.ReadBuffer(&ulen, 1);
+		stm.ReadBuffer(user, ulen);
+		stm.ReadBuffer(&plen, 1);
+		stm.ReadBuffer(password, plen);
+		uint8_t ar[] = { 1, CheckPassword(user, ulen, password, plen) };
+		stm.WriteBuffer(ar, 2);
+		if (ver != 1 || ar[1])
+			Throw(errc::permission_denied);
+	}
+
+	static CSocks5Header ParseRequestHeader(const uint8_t ar[4]) {
+		if (ar[0] != 5)
+			Throw(ExtErr::SOCKS_InvalidVersion);
+		CSocks5Header header;
+		header.Cmd = ar[1];
+		header.AddrType = ar[3];
+		return header;
+	}
+
+	// Fixed address length for the type, 0 for a length-prefixed domain name
+	static size_t AddressLength(uint8_t addrType) {
+		switch (addrType) {
+		case 1: return 4;
+		case 4: return 16;
+		case 3: return 0;
 		default:
 			Throw(ExtErr::SOCKS_IncorrectProtocol);
 		}
-		header.EndPoint->Port = ntohs(rd.ReadUInt16());
+	}
+
+	// p points to the address bytes followed by the port
+	static ProxyEndPoint MakeEndPoint(uint8_t addrType, const uint8_t *p, size_t len) {
+		uint16_t port = uint16_t(p[len] << 8 | p[len + 1]);
+		switch (addrType) {
+		case 1: return ProxyEndPoint::FromAddress(ProxyEndPoint::IPv4, p, port);
+		case 4: return ProxyEndPoint::FromAddress(ProxyEndPoint::IPv6, p, port);
+		default: return ProxyEndPoint::FromHost((const char*)p, len, port);
+		}
+	}
+public:
+	void ReadEndPoint(CSocks5Header& header, Stream& stm) {
+		uint8_t buf[256 + 2];
+		size_t len = AddressLength(header.AddrType);
+		if (!len) {
+			stm.ReadBuffer(buf, 1);
+			len = buf[0];
+		}
+		stm.ReadBuffer(buf, len + 2);
+		header.EndPoint = MakeEndPoint(header.AddrType, buf, len);
 	}
 
 	CProxyQuery GetQuery(char beg) override {
 		Stream& stm = *m_pStm;
-		BinaryReader rd(stm);
-		uint8_t nMethods = rd.ReadByte();
-		uint8_t *pm = (uint8_t*)alloca(nMethods);
-		rd.Read(pm, nMethods);
-		if (nMethods) {
-			for (int i = 0; i < nMethods; i++) {
-				if (!pm[i]) {
-					uint8_t ar[] = {5, 0};
-					stm.WriteBuffer(ar, 2);
-					goto out;
-				}
-			}
-			Throw(ExtErr::PROXY_MethodNotSupported);
+		uint8_t pm[256];
+		stm.ReadBuffer(pm, 1);
+		uint8_t nMethods = pm[0];
+		stm.ReadBuffer(pm, nMethods);
+		int method = SelectMethod(pm, nMethods);
+		if (method != NO_REPLY) {
+			uint8_t ar[] = { 5, uint8_t(method) };
+			stm.WriteBuffer(ar, 2);
 		}
-out:
+		if (method == METHOD_UNACCEPTABLE)
+			Throw(ExtErr::PROXY_MethodNotSupported);
+		if (method == METHOD_PASSWORD)
+			Authenticate(stm);
 		uint8_t ar[4];
-		rd.Read(ar, 4);
-		if (ar[0] != 5)
-			Throw(ExtErr::SOCKS_InvalidVersion);
-		CSocks5Header header;
-		header.Cmd = ar[1];
-		header.AddrType = ar[3];
+		stm.ReadBuffer(ar, 4);
+		CSocks5Header header = ParseRequestHeader(ar);
 		ReadEndPoint(header, stm);
-		return OnCommand(header, stm);
+		return OnCommand(header);
+	}
+
+#if UCFG_INET_COROUTINES
+	Task<void> AuthenticateAsync(AsyncStream& stm) {
+		uint8_t user[256], password[256];
+		uint8_t ver = co_await stm.ReadByte(), ulen = co_await stm.ReadByte();
+		co_await stm.ReadBuffer(user, ulen);
+		uint8_t plen = co_await stm.ReadByte();
+		co_await stm.ReadBuffer(password, plen);
+		uint8_t ar[] = { 1, CheckPassword(user, ulen, password, plen) };
+		co_await stm.WriteBuffer(ar, 2);
+		if (ver != 1 || ar[1])
+			Throw(errc::permission_denied);
 	}
 
-	void SendReply(const InternetEndPoint& hp, const error_code& ec) override {
-		uint8_t ar[264] = { 5, 0, 0, 1 };
-		int len = 10;
+	Task<void> ReadEndPointAsync(CSocks5Header& header, AsyncStream& stm) {
+		uint8_t buf[256 + 2];
+		size_t len = AddressLength(header.AddrType);
+		if (!len)
+			len = co_await stm.ReadByte();
+		co_await stm.ReadBuffer(buf, len + 2);
+		header.EndPoint = MakeEndPoint(header.AddrType, buf, len);
+	}
+
+	Task<CProxyQuery> GetQueryAsync(AsyncStream& stm, char beg) override {
+		uint8_t pm[256];
+		uint8_t nMethods = co_await stm.ReadByte();
+		co_await stm.ReadBuffer(pm, nMethods);
+		int method = SelectMethod(pm, nMethods);
+		if (method != NO_REPLY) {
+			uint8_t ar[] = { 5, uint8_t(method) };
+			co_await stm.WriteBuffer(ar, 2);
+		}
+		if (method == METHOD_UNACCEPTABLE)
+			Throw(ExtErr::PROXY_MethodNotSupported);
+		if (method == METHOD_PASSWORD)
+			co_await AuthenticateAsync(stm);
+		uint8_t ar[4];
+		co_await stm.ReadBuffer(ar, 4);
+		CSocks5Header header = ParseRequestHeader(ar);
+		co_await ReadEndPointAsync(header, stm);
+		co_return OnCommand(header);
+	}
+#endif
+protected:
+	size_t FormatReply(uint8_t ar[MAX_REPLY_SIZE], const ProxyEndPoint& hp, const error_code& ec) override {
+		static const uint8_t s_header[4] = { 5, 0, 0, 1 };
+		memcpy(ar, s_header, 4);
 		if (ec) {
 			if (ec == errc::permission_denied)
 				ar[1] = 2;
@@ -133,40 +252,33 @@ out:
 				ar[1] = 8;
 			else
 				ar[1] = 1;
-		} else {
-			uint8_t* p = &ar[4];
-			if (const IPEndPoint* ipEp = dynamic_cast<const IPEndPoint*>(&hp)) {
-				IPAddress ip = ipEp->Address;
-				switch ((int)ip.get_AddressFamily()) {
-				case AF_INET:
-					ar[3] = 1;
-					*(uint32_t*)p = htonl(ip.GetIP());
-					p += 4;
-					break;
-				case AF_INET6:
-					ar[3] = 4;
-					memcpy(p, ip.GetAddressBytes().constData(), 16);
-					p += 16;
-					break;
-				}
-			} else {
-				const DnsEndPoint& dnsEp = dynamic_cast<const DnsEndPoint&>(hp);
-				ar[3] = 3;
-				String host = dnsEp.Host;
-				const char* hostname = host;
-				size_t slen = strlen(hostname);
-				if (slen > 255)
-					Throw(E_FAIL);
-				*p++ = (uint8_t)slen;
-				memcpy(exchange(p, p + slen), hostname, slen);
-			}
-			*(uint16_t*)p = htons(hp.Port);
-			len = p + 2 - ar;
+			memset(ar + 4, 0, 6);
+			return 10;
 		}
-		m_pStm->WriteBuffer(ar, len);
+		uint8_t* p = &ar[4];
+		switch (hp.Kind) {
+		case ProxyEndPoint::IPv4:
+			ar[3] = 1;
+			memcpy(exchange(p, p + 4), hp.Address, 4);
+			break;
+		case ProxyEndPoint::IPv6:
+			ar[3] = 4;
+			memcpy(exchange(p, p + 16), hp.Address, 16);
+			break;
+		case ProxyEndPoint::Host:
+			ar[3] = 3;
+			*p++ = hp.HostLength;
+			memcpy(exchange(p, p + hp.HostLength), hp.HostName, hp.HostLength);
+			break;
+		default:
+			memset(exchange(p, p + 4), 0, 4);
+		}
+		p[0] = uint8_t(hp.Port >> 8);
+		p[1] = uint8_t(hp.Port);
+		return p + 2 - ar;
 	}
-protected:
-	virtual CProxyQuery OnCommand(CSocks5Header& header, Stream& stm) {
+
+	virtual CProxyQuery OnCommand(CSocks5Header& header) {
 		CProxyQuery pq;
 		pq.Ep = header.EndPoint;
 		switch (header.Cmd) {
@@ -175,7 +287,7 @@ protected:
 		case 3: pq.Typ = QueryType::Udp; break;
 		default: Throw(ExtErr::SOCKS_IncorrectProtocol);
 		}
-		TRC(3, "SOCKS5 req " << (int)header.Cmd  << " for " << *pq.Ep );
+		TRC(3, "SOCKS5 req " << (int)header.Cmd  << " for " << pq.Ep );
 		return pq;
 	}
 };
@@ -183,30 +295,73 @@ protected:
 class TorSocks5Relay : public CSocks5Relay {
 	typedef CSocks5Relay base;
 protected:
-	CProxyQuery OnCommand(CSocks5Header& header, Stream& stm);
+	CProxyQuery OnCommand(CSocks5Header& header) override;
 };
 
 static regex s_reRequest("^(\\w+)\\s+(?:http://)?([-.\\w]+)(?::(\\d+))?(.*)", regex_constants::icase);
 
-static ptr<InternetEndPoint> ParseHost(RCString s) {
-	IPAddress ip;
-	ptr<InternetEndPoint> ep;
-	if (IPAddress::TryParse(s, ip))
-		ep = new IPEndPoint(ip, 0);
-	else
-		ep = new DnsEndPoint(s, 0);
-	return ep;
+static const size_t MAX_HTTP_HEAD_SIZE = 64 * 1024;
+
+// RFC 4648, up to the first character outside the alphabet: the padding
+static string DecodeBase64(const char *s) {
+	static const char s_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	string r;
+	uint32_t acc = 0;
+	int bits = 0;
+	for (const char *p; *s && (p = strchr(s_alphabet, *s)); ++s) {
+		acc = acc << 6 | uint32_t(p - s_alphabet);
+		if ((bits += 6) >= 8)
+			r += char(acc >> (bits -= 8));
+	}
+	return r;
 }
 
 class CHttpRelay : public CProxyRelay {
-	bool m_bConnect;
-public:
-	CProxyQuery GetQuery(char beg) override {
-		Stream& stm = *m_pStm;
+	bool m_bConnect, m_bAuthorized;
+
+	// "Basic base64(user:password)", RFC 7617
+	bool CheckCredentials(const char *value) const {
+		value += strspn(value, " \t");
+		if (strncasecmp(value, "Basic", 5) || (value[5] != ' ' && value[5] != '\t'))
+			return false;
+		string cred = DecodeBase64(value + 5 + strspn(value + 5, " \t"));
+		size_t colon = cred.find(':');
+		if (colon == string::npos)
+			return false;
+		auto it = m_pUsers->find(cred.substr(0, colon));
+		return it != m_pUsers->end() && !it->second.compare(0, string::npos, cred, colon + 1, string::npos);
+	}
+
+	// A header line of a request that needs auth. The credentials are checked and not forwarded, the other lines of a plain
+	// request go to the upstream after its request line
+	void OnHeaderLine(RCString line) {
+		static const char s_name[] = "Proxy-Authorization:";
+		const char *s = line.c_str();
+		if (!strncasecmp(s, s_name, sizeof(s_name) - 1))
+			m_bAuthorized = m_bAuthorized || CheckCredentials(s + sizeof(s_name) - 1);
+		else if (m_qs) {
+			m_qs->WriteBuffer(s, strlen(s));
+			m_qs->WriteBuffer("\r\n", 2);
+			if (m_qs->AsSpan().size() > MAX_HTTP_HEAD_SIZE)
+				Throw(errc::message_size);
+		}
+	}
+
+	// After the blank line. False if the client has to be asked for a password
+	bool OnHeaderEnd() {
+		if (m_qs) {
+			m_qs->WriteBuffer("\r\n", 2);
+			m_bHead = true;
+		}
+		return m_bAuthorized;
+	}
+
+	static constexpr char s_authRequired[] = "HTTP/1.0 407 Proxy Authentication Required\r\nProxy-Authenticate: Basic realm=\"socksd\"\r\n\r\n";
+
+	// CONNECT requests leave m_bConnect set, their headers have to be skipped by the caller
+	CProxyQuery ParseRequestLine(RCString line) {
 		CProxyQuery pq;
 		pq.Typ = QueryType::Connect;
-		String line(beg);
-		ReadOneLineFromStream(stm, line);
 		const char *strLine = line.c_str();
 
 		cmatch m;
@@ -214,11 +369,9 @@ public:
 			Throw(ExtErr::PROXY_InvalidHttpRequest);
 		String method = m[1];
 		method.MakeUpper();
-		ptr<InternetEndPoint> ep = ParseHost(m[2]);
 		uint16_t port = 80;
 		if (m_bConnect = (method == "CONNECT")) {
 			port = (uint16_t)atoi(String(m[3]));
-			ReadHttpHeader(stm);
 		} else {
 			if (String(m[3]) != "")
 				port = (uint16_t)atoi(String(m[3]));
@@ -227,8 +380,29 @@ public:
 			const char* strReqLine = reqLine.c_str();
 			m_qs->WriteBuffer(strReqLine, strlen(strReqLine));
 		}
-		ep->Port = port;
-		pq.Ep = ep;
+		pq.Ep = ProxyEndPoint::Parse(m[2].first, m[2].length(), port);
+		return pq;
+	}
+public:
+	CHttpRelay()
+		: m_bConnect(false)
+		, m_bAuthorized(false)
+	{}
+
+	CProxyQuery GetQuery(char beg) override {
+		Stream& stm = *m_pStm;
+		String line(beg);
+		ReadOneLineFromStream(stm, line);
+		CProxyQuery pq = ParseRequestLine(line);
+		if (IsAuthRequired()) {
+			for (String h; h = String(), ReadOneLineFromStream(stm, h), !h.empty();)
+				OnHeaderLine(h);
+			if (!OnHeaderEnd()) {
+				stm.WriteBuffer(s_authRequired, sizeof(s_authRequired) - 1);
+				Throw(errc::permission_denied);
+			}
+		} else if (m_bConnect)
+			ReadHttpHeader(stm);
 		/*!!!
 		String oline(line);
 		int i = line.FindOneOf(" \t");
@@ -264,33 +438,107 @@ public:
 		return pq;
 	}
 
-	void SendReply(const InternetEndPoint& ep, const error_code& ec) override {
-		if (ec || m_bConnect) {
-			ostringstream os;
-			os << "HTTP/1.0 " << (ec ? 400 : 200) << "\r\n\r\n";
-			String s = os.str();
-			m_pStm->WriteBuffer((const char*)s, s.length());
+#if UCFG_INET_COROUTINES
+	Task<CProxyQuery> GetQueryAsync(AsyncStream& stm, char beg) override {
+		String line(beg);
+		co_await stm.ReadLine(line);
+		CProxyQuery pq = ParseRequestLine(line);
+		if (IsAuthRequired()) {
+			for (String h; co_await stm.ReadLine(h), !h.empty(); h = String())
+				OnHeaderLine(h);
+			if (!OnHeaderEnd()) {
+				co_await stm.WriteBuffer(s_authRequired, sizeof(s_authRequired) - 1);
+				Throw(errc::permission_denied);
+			}
+		} else if (m_bConnect) {
+			for (String h; co_await stm.ReadLine(h), !h.empty(); h = String())
+				;
 		}
+		co_return pq;
+	}
+#endif
+protected:
+	size_t FormatReply(uint8_t buf[MAX_REPLY_SIZE], const ProxyEndPoint& ep, const error_code& ec) override {
+		static const char s_ok[] = "HTTP/1.0 200 Connection established\r\n\r\n", s_bad[] = "HTTP/1.0 400 Bad Request\r\n\r\n";
+
+		if (!ec && !m_bConnect)
+			return 0;
+		size_t len = ec ? sizeof(s_bad) - 1 : sizeof(s_ok) - 1;
+		memcpy(buf, ec ? s_bad : s_ok, len);
+		return len;
 	}
 };
 
-CProxyRelay *CProxyRelay::CreateSocks4Relay() {
-	return new CSocks4Relay;
-}
+static const size_t MAX_HTTP_METHOD = 16;
+
+HandshakeKind SniffHandshake(RCSpan s) {
+	static const uint8_t s_proxyV2[12] = { '\r', '\n', '\r', '\n', 0, '\r', '\n', 'Q', 'U', 'I', 'T', '\n' };
 
-CProxyRelay *CProxyRelay::CreateSocks5Relay() {
-	return new CSocks5Relay;
+	const uint8_t *p = s.data();
+	size_t len = s.size();
+	if (!len)
+		return HandshakeKind::Unknown;
+	switch (p[0]) {
+	case 4:
+		if (len >= 2 && p[1] != 1 && p[1] != 2)						// CONNECT or BIND
+			return HandshakeKind::Invalid;
+		if (len < 8)
+			return HandshakeKind::Unknown;
+		return !p[4] && !p[5] && !p[6] && p[7] ? HandshakeKind::Socks4a : HandshakeKind::Socks4;
+	case 5:
+		return HandshakeKind::Socks5;									// a legacy client may offer no methods at all
+	case 0x16:															// handshake record, TLS 1.0 .. 1.3 record versions
+		if ((len >= 2 && p[1] != 3) || (len >= 3 && p[2] > 4))
+			return HandshakeKind::Invalid;
+		return len < 3 ? HandshakeKind::Unknown : HandshakeKind::Tls;
+	case '\r':
+		if (memcmp(p, s_proxyV2, (min)(len, sizeof s_proxyV2)))
+			return HandshakeKind::Invalid;
+		return len < sizeof s_proxyV2 ? HandshakeKind::Unknown : HandshakeKind::ProxyHeader;
+	}
+	size_t n = 0;
+	while (n < len && n <= MAX_HTTP_METHOD && (p[n] | 0x20) >= 'a' && (p[n] | 0x20) <= 'z')
+		++n;
+	if (n > MAX_HTTP_METHOD)
+		return HandshakeKind::Invalid;
+	if (n == len)
+		return HandshakeKind::Unknown;
+	if (!n || (p[n] != ' ' && p[n] != '\t'))
+		return HandshakeKind::Invalid;
+	if (n == 5 && !memcmp(p, "PROXY", 5))
+		return HandshakeKind::ProxyHeader;
+	return n == 7 && !strncasecmp((const char*)p, "CONNECT", 7) ? HandshakeKind::HttpConnect : HandshakeKind::Http;
 }
 
-CProxyRelay *CProxyRelay::CreateTorSocks5Relay() {
-	return new TorSocks5Relay;
+static_assert(sizeof(CSocks4Relay) <= CProxyRelayHolder::MAX_SIZE && sizeof(TorSocks5Relay) <= CProxyRelayHolder::MAX_SIZE
+	&& sizeof(CHttpRelay) <= CProxyRelayHolder::MAX_SIZE, "CProxyRelayHolder::MAX_SIZE");
+
+CProxyRelay& CProxyRelayHolder::Emplace(HandshakeKind kind) {
+	Reset();
+	switch (kind) {
+	case HandshakeKind::Socks4:
+	case HandshakeKind::Socks4a:
+		m_p = new(m_buf) CSocks4Relay;
+		break;
+	case HandshakeKind::Socks5:
+		m_p = new(m_buf) TorSocks5Relay;
+		break;
+	case HandshakeKind::HttpConnect:
+	case HandshakeKind::Http:
+		m_p = new(m_buf) CHttpRelay;
+		break;
+	default:
+		Throw(errc::protocol_not_supported);
+	}
+	return *m_p;
 }
 
-CProxyRelay *CProxyRelay::CreateHttpRelay() {
-	return new CHttpRelay;
+void CProxyRelayHolder::Reset() {
+	if (m_p)
+		exchange(m_p, nullptr)->~CProxyRelay();
 }
 
-CProxyQuery TorSocks5Relay::OnCommand(CSocks5Header& header, Stream& stm) {
+CProxyQuery TorSocks5Relay::OnCommand(CSocks5Header& header) {
 	CProxyQuery pq;
 	pq.Ep = header.EndPoint;
 
@@ -302,7 +550,7 @@ CProxyQuery TorSocks5Relay::OnCommand(CSocks5Header& header, Stream& stm) {
 		pq.Typ = QueryType::RevResolve;
 		break;
 	default:
-		return base::OnCommand(header, stm);
+		return base::OnCommand(header);
 	}
 	return pq;
 }
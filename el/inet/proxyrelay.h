@@ -6,32 +6,100 @@
 #pragma once
 
 #include <el/inet/proxy.h>
+#include <el/inet/coro.h>
 
 namespace Ext {
 	namespace Inet {
 
+// What a connection starts with, told from its first bytes before anything is read or allocated for it
+ENUM_CLASS(HandshakeKind) {
+	Unknown										// more bytes needed
+	, Invalid									// none of the below: reject the connection
+	, Socks4
+	, Socks4a
+	, Socks5
+	, HttpConnect
+	, Http										// plain request with an absolute URI, forward proxy
+	, Tls										// TLS record with a ClientHello
+	, ProxyHeader								// PROXY v1/v2
+} END_ENUM_CLASS(HandshakeKind);
+
+const size_t SNIFF_MAX_SIZE = 18;				// no kind needs more bytes: an HTTP method of 16 letters and a blank
+
+// One pass over the peeked bytes, which are not consumed. Unknown only while len < SNIFF_MAX_SIZE
+HandshakeKind SniffHandshake(RCSpan s);
+
 class CProxyRelay : public NonInterlockedObject {
 public:
+	static const size_t MAX_REPLY_SIZE = 264;
+
 	Stream *m_pStm;
 	unique_ptr<MemoryStream> m_qs;
+	const unordered_map<string, string> *m_pUsers;		// if not empty: SOCKS5 requires username/password auth (RFC 1929), HTTP
+														// Basic auth, SOCKS4 is refused
+	bool m_bHead;										// m_qs holds the whole request head, not just the request line
+
+	CProxyRelay()
+		: m_pStm(nullptr)
+		, m_pUsers(nullptr)
+		, m_bHead(false)
+	{}
 
 	virtual ~CProxyRelay() {}
 	virtual CProxyQuery GetQuery(char beg) { return CProxyQuery(); }
-	virtual void SendReply(const InternetEndPoint &ep, const error_code &ec = error_code()) {
+	virtual void SendReply(const ProxyEndPoint &ep, const error_code &ec = error_code()) {
+		uint8_t buf[MAX_REPLY_SIZE];
+		if (size_t len = FormatReply(buf, ep, ec))
+			m_pStm->WriteBuffer(buf, len);
+	}
+
+	// Queues the request head rewritten for the upstream, sent together with the rest of the buffered request
+	void AfterConnect(SendVector& upstream) {
+		if (m_qs)
+			upstream.Add(m_qs->AsSpan());
 	}
 
-	void AfterConnect(Stream& ostm) {
-		if (m_qs) {
-			Span s = m_qs->AsSpan();
-			if (s.size() != 0)
-				ostm.Write(s);
-		}
+#if UCFG_INET_COROUTINES
+	// Same handshake over a non-blocking socket, suspends instead of blocking the thread
+	virtual Task<CProxyQuery> GetQueryAsync(AsyncStream& stm, char beg) { co_return CProxyQuery(); }
+
+	Task<void> SendReplyAsync(AsyncStream& stm, const ProxyEndPoint &ep, const error_code &ec = error_code()) {
+		uint8_t buf[MAX_REPLY_SIZE];
+		if (size_t len = FormatReply(buf, ep, ec))
+			co_await stm.WriteBuffer(buf, len);
 	}
+#endif
+protected:
+	bool IsAuthRequired() const { return m_pUsers && !m_pUsers->empty(); }
+
+	virtual size_t FormatReply(uint8_t buf[MAX_REPLY_SIZE], const ProxyEndPoint &ep, const error_code &ec) { return 0; }
+};
+
+// The relay of one connection, constructed in place by HandshakeKind: a handshake costs no heap allocation for its parser.
+// Lives in the thread or coroutine frame serving the connection
+class CProxyRelayHolder {
+public:
+	static const size_t MAX_SIZE = 128;
+
+	CProxyRelayHolder()
+		: m_p(nullptr)
+	{}
+
+	~CProxyRelayHolder() { Reset(); }
+
+	// Socks4/4a, Socks5 (with the Tor extensions), HttpConnect and Http have relays, other kinds throw errc::protocol_not_supported
+	CProxyRelay& Emplace(HandshakeKind kind);
+	void Reset();
+
+	CProxyRelay *get() const { return m_p; }
+	CProxyRelay *operator->() const { return m_p; }
+	explicit operator bool() const { return m_p; }
+private:
+	alignas(max_align_t) uint8_t m_buf[MAX_SIZE];
+	CProxyRelay *m_p;
 
-	static CProxyRelay *CreateSocks4Relay();
-	static CProxyRelay *CreateSocks5Relay();
-	static CProxyRelay *CreateTorSocks5Relay();
-	static CProxyRelay *CreateHttpRelay();
+	CProxyRelayHolder(const CProxyRelayHolder&) = delete;
+	CProxyRelayHolder& operator=(const CProxyRelayHolder&) = delete;
 };
 
 }} // Ext::Inet::
@@ -0,0 +1,179 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "resolver.h"
+
+#include <netdb.h>
+
+namespace Ext {
+	namespace Inet {
+
+CResolverCache::CResolverCache(size_t maxEntries, int ttlSec, int negativeTtlSec)
+	: m_maxEntries(maxEntries)
+	, m_ttl(ttlSec)
+	, m_negativeTtl(negativeTtlSec)
+{}
+
+string CResolverCache::MakeKey(QueryType typ, const ProxyEndPoint& ep) {
+	string key(1, char(typ));
+	key += char(ep.Kind);
+	switch (ep.Kind) {
+	case ProxyEndPoint::IPv4:
+		key.append((const char*)ep.Address, 4);
+		break;
+	case ProxyEndPoint::IPv6:
+		key.append((const char*)ep.Address, 16);
+		break;
+	case ProxyEndPoint::Host:
+		for (size_t i = 0; i < ep.HostLength; ++i)
+			key += char(tolower((uint8_t)ep.HostName[i]));
+		break;
+	default:
+		break;
+	}
+	return key;
+}
+
+static error_code GaiError(int rc) {
+	switch (rc) {
+	case EAI_NONAME:
+#ifdef EAI_NODATA
+	case EAI_NODATA:
+#endif
+		return make_error_code(errc::host_unreachable);
+	case EAI_AGAIN:
+		return make_error_code(errc::timed_out);
+	case EAI_SYSTEM:
+		return error_code(errno, generic_category());
+	default:
+		return make_error_code(errc::network_unreachable);
+	}
+}
+
+void CResolverCache::Resolve(QueryType typ, const ProxyEndPoint& ep, ProxyEndPoint& result, vector<ResolvedAddress>& all, error_code& ec) {
+	ec.clear();
+	all.clear();
+	if (typ == QueryType::Resolve) {
+		if (ep.IsIP()) {
+			result = ProxyEndPoint::FromAddress(ep.Kind, ep.Address, 0);
+			all.push_back(ResolvedAddress{ ep.Kind });
+			memcpy(all.back().Address, ep.Address, sizeof ep.Address);
+			return;
+		}
+		addrinfo hints = {}, *ai = nullptr;
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (int rc = ::getaddrinfo(ep.HostName, nullptr, &hints, &ai)) {
+			ec = GaiError(rc);
+			return;
+		}
+		for (addrinfo *p = ai; p && all.size() < MAX_ADDRESSES; p = p->ai_next) {
+			ProxyEndPoint a(*p->ai_addr);
+			if (a.IsIP()) {
+				all.push_back(ResolvedAddress{ a.Kind });
+				memcpy(all.back().Address, a.Address, sizeof a.Address);
+			}
+		}
+		::freeaddrinfo(ai);
+		if (all.empty()) {
+			ec = make_error_code(errc::host_unreachable);
+			return;
+		}
+		result = all.front().ToEndPoint(0);
+	} else {
+		if (!ep.IsIP()) {
+			ec = make_error_code(errc::address_family_not_supported);
+			return;
+		}
+		sockaddr_storage ss;
+		socklen_t len = ep.ToSockAddr(ss);
+		char host[NI_MAXHOST];
+		if (int rc = ::getnameinfo((const sockaddr*)&ss, len, host, sizeof host, nullptr, 0, NI_NAMEREQD)) {
+			ec = GaiError(rc);
+			return;
+		}
+		result = ProxyEndPoint::FromHost(host, strlen(host), 0);
+	}
+}
+
+void CResolverCache::Trim(chrono::steady_clock::time_point now) {
+	for (auto it = m_entries.begin(); it != m_entries.end();) {
+		if (!it->second->Pending && it->second->Expires <= now)
+			it = m_entries.erase(it);
+		else
+			++it;
+	}
+	for (auto it = m_entries.begin(); m_entries.size() >= m_maxEntries && it != m_entries.end();) {		// still full: evict arbitrary resolved entries
+		if (!it->second->Pending)
+			it = m_entries.erase(it);
+		else
+			++it;
+	}
+}
+
+bool CResolverCache::TryLookup(QueryType typ, const ProxyEndPoint& ep, ProxyEndPoint& result, error_code& ec, vector<ResolvedAddress> *all) {
+	string key = MakeKey(typ, ep);
+	lock_guard<mutex> lk(m_mtx);
+	auto it = m_entries.find(key);
+	if (it == m_entries.end() || it->second->Pending || it->second->Expires <= chrono::steady_clock::now())
+		return false;
+	result = it->second->Result;
+	ec = it->second->Ec;
+	if (all)
+		*all = it->second->All;
+	return true;
+}
+
+void CResolverCache::Lookup(QueryType typ, const ProxyEndPoint& ep, ProxyEndPoint& result, error_code& ec, vector<ResolvedAddress> *all) {
+	string key = MakeKey(typ, ep);
+	shared_ptr<Entry> e;
+	{
+		unique_lock<mutex> lk(m_mtx);
+		auto now = chrono::steady_clock::now();
+		auto it = m_entries.find(key);
+		if (it != m_entries.end() && (it->second->Pending || it->second->Expires > now)) {
+			e = it->second;
+			m_cv.wait(lk, [&e] { return !e->Pending; });
+			result = e->Result;
+			ec = e->Ec;
+			if (all)
+				*all = e->All;
+			return;
+		}
+		if (m_entries.size() >= m_maxEntries)
+			Trim(now);
+		e = make_shared<Entry>();
+		e->Pending = true;
+		m_entries[key] = e;
+	}
+	exception_ptr exc;										// waiters get its error code, the entry is not cached
+	vector<ResolvedAddress> addrs;
+	try {
+		Resolve(typ, ep, result, addrs, ec);
+	} catch (const system_error& ex) {
+		ec = ex.code();
+		exc = current_exception();
+	} catch (...) {
+		ec = make_error_code(errc::not_enough_memory);		// bad_alloc
+		exc = current_exception();
+	}
+	{
+		lock_guard<mutex> lk(m_mtx);
+		e->Result = result;
+		e->All = addrs;
+		e->Ec = ec;
+		e->Expires = chrono::steady_clock::now() + (exc ? chrono::seconds(0) : ec ? m_negativeTtl : m_ttl);
+		e->Pending = false;
+	}
+	m_cv.notify_all();
+	if (all)
+		*all = move(addrs);
+	if (exc)
+		rethrow_exception(exc);
+}
+
+}} // Ext::Inet::
@@ -0,0 +1,55 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include "proxy.h"
+
+namespace Ext {
+	namespace Inet {
+
+// One address of a resolved name, without the port
+struct ResolvedAddress {
+	ProxyEndPoint::EKind Kind;
+	uint8_t Address[16];
+
+	ProxyEndPoint ToEndPoint(uint16_t port) const { return ProxyEndPoint::FromAddress(Kind, Address, port); }
+};
+
+// Name <-> address cache for the Tor RESOLVE / RESOLVE_PTR commands and for connects that need the address.
+// Identical concurrent queries share one lookup
+class CResolverCache {
+public:
+	static const size_t MAX_ADDRESSES = 16;				// kept per name
+
+	CResolverCache(size_t maxEntries = 65536, int ttlSec = 300, int negativeTtlSec = 30);
+
+	// Warm path, never blocks. Returns false on a miss or if the query is still in flight
+	bool TryLookup(QueryType typ, const ProxyEndPoint& ep, ProxyEndPoint& result, error_code& ec, vector<ResolvedAddress> *all = nullptr);
+
+	// Resolves, or waits for an identical query already in flight. Result port is 0, as in Tor replies: the first address.
+	// all gets every address of a Resolve, in the resolver's order (RFC 6724), for a connect to fall back on
+	void Lookup(QueryType typ, const ProxyEndPoint& ep, ProxyEndPoint& result, error_code& ec, vector<ResolvedAddress> *all = nullptr);
+private:
+	struct Entry {
+		ProxyEndPoint Result;
+		vector<ResolvedAddress> All;
+		error_code Ec;
+		chrono::steady_clock::time_point Expires;
+		bool Pending;
+	};
+
+	const size_t m_maxEntries;
+	const chrono::seconds m_ttl, m_negativeTtl;
+	mutex m_mtx;
+	condition_variable m_cv;
+	unordered_map<string, shared_ptr<Entry>> m_entries;
+
+	static string MakeKey(QueryType typ, const ProxyEndPoint& ep);
+	static void Resolve(QueryType typ, const ProxyEndPoint& ep, ProxyEndPoint& result, vector<ResolvedAddress>& all, error_code& ec);
+	void Trim(chrono::steady_clock::time_point now);
+};
+
+}} // Ext::Inet::
@@ -0,0 +1,68 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "sendv.h"
+
+namespace Ext {
+	namespace Inet {
+
+void SendVector::Add(const void *p, size_t size) {
+	if (!size)
+		return;
+	if (m_n == MAX_PARTS)
+		Throw(errc::no_buffer_space);
+	m_iov[m_n].iov_base = const_cast<void*>(p);
+	m_iov[m_n++].iov_len = size;
+	m_size += size;
+}
+
+ssize_t SendVector::SendMsg(int fd, int flags) {
+	msghdr msg = msghdr();
+	msg.msg_iov = m_iov;
+	msg.msg_iovlen = m_n;
+	for (;;) {
+		ssize_t r = ::sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+		if (r >= 0 || errno != EINTR)
+			return r;
+	}
+}
+
+void SendVector::Consume(size_t n) {
+	m_size -= n;
+	int i = 0;
+	for (; n && n >= m_iov[i].iov_len; ++i)
+		n -= m_iov[i].iov_len;
+	if (n) {
+		m_iov[i].iov_base = (uint8_t*)m_iov[i].iov_base + n;
+		m_iov[i].iov_len -= n;
+	}
+	memmove(m_iov, m_iov + i, (m_n -= i) * sizeof(iovec));
+}
+
+void SendVector::Send(int fd, int flags) {
+	while (!empty()) {
+		ssize_t r = SendMsg(fd, flags);
+		if (r < 0)
+			Throw(error_code(errno == EAGAIN ? ETIMEDOUT : errno, system_category()));
+		Consume(r);
+	}
+}
+
+bool SendVector::TrySend(int fd, int flags) {
+	while (!empty()) {
+		ssize_t r = SendMsg(fd, flags);
+		if (r < 0) {
+			if (errno == EAGAIN)
+				return false;
+			CCheck(-1);
+		}
+		Consume(r);
+	}
+	return true;
+}
+
+}} // Ext::Inet::
@@ -0,0 +1,44 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include <el/libext/ext-net.h>
+
+#include <sys/uio.h>
+
+namespace Ext {
+	namespace Inet {
+
+// Buffers bound for one socket, written by a single sendmsg() instead of a send() each. Not copied: they must outlive the send
+class SendVector {
+public:
+	static const int MAX_PARTS = 8;
+
+	SendVector()
+		: m_n(0)
+		, m_size(0)
+	{}
+
+	void Add(const void *p, size_t size);				// empty buffers are skipped
+	void Add(RCSpan s) { Add(s.data(), s.size()); }
+	bool empty() const { return !m_size; }
+	size_t size() const { return m_size; }
+
+	// Blocking socket: returns when everything is sent, throws on errors and on an SO_SNDTIMEO timeout
+	void Send(int fd, int flags = 0);
+
+	// Non-blocking socket: sends what fits and drops it from the vector. Returns true when nothing is left
+	bool TrySend(int fd, int flags = 0);
+private:
+	iovec m_iov[MAX_PARTS];
+	int m_n;
+	size_t m_size;
+
+	ssize_t SendMsg(int fd, int flags);
+	void Consume(size_t n);
+};
+
+}} // Ext::Inet::
@@ -0,0 +1,102 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "sni.h"
+
+namespace Ext {
+	namespace Inet {
+
+// Bounds-checked reads over the bytes at hand (m_avail) of a structure ending at m_limit
+class CHelloCursor {
+public:
+	SniResult State;
+
+	CHelloCursor(const uint8_t *p, const uint8_t *avail, const uint8_t *limit)
+		: State(SniResult::None)
+		, m_p(p)
+		, m_avail(avail)
+		, m_limit(limit)
+	{}
+
+	// n bytes, nullptr if they are past the limit or not received yet, State tells which
+	const uint8_t *Take(size_t n) {
+		if (n > size_t(m_limit - m_p)) {
+			State = SniResult::None;
+			return nullptr;
+		}
+		if (n > size_t(m_avail - m_p)) {
+			State = SniResult::NeedMore;
+			return nullptr;
+		}
+		return exchange(m_p, m_p + n);
+	}
+
+	// Big-endian length of size bytes, then skips that many. False as Take()
+	bool SkipVector(size_t size) {
+		const uint8_t *p = Take(size);
+		if (!p)
+			return false;
+		size_t len = 0;
+		for (size_t i = 0; i < size; ++i)
+			len = len << 8 | p[i];
+		return Take(len);
+	}
+
+	// The next len bytes become the whole structure
+	bool Narrow(size_t len) {
+		if (len > size_t(m_limit - m_p)) {
+			State = SniResult::None;
+			return false;
+		}
+		m_limit = m_p + len;
+		return true;
+	}
+private:
+	const uint8_t *m_p, *m_avail, *m_limit;
+};
+
+SniResult FindSni(RCSpan s, Span& name) {
+	const uint8_t *p = s.data(), *end = p + s.size();
+	if (s.size() < 5)
+		return s.size() && p[0] != 0x16 ? SniResult::None : SniResult::NeedMore;
+	if (p[0] != 0x16 || p[1] != 3)												// handshake record
+		return SniResult::None;
+	CHelloCursor c(p + 5, end, p + 5 + (p[3] << 8 | p[4]));
+	const uint8_t *q = c.Take(4);
+	if (!q)
+		return c.State;
+	if (q[0] != 1 || !c.Narrow(size_t(q[1]) << 16 | q[2] << 8 | q[3]))			// ClientHello, in this record
+		return SniResult::None;
+	if (!c.Take(2 + 32) || !c.SkipVector(1) || !c.SkipVector(2) || !c.SkipVector(1))		// version, random, session ID, ciphers, compression
+		return c.State;
+	if (!(q = c.Take(2)))														// no extensions
+		return c.State;
+	if (!c.Narrow(q[0] << 8 | q[1]))
+		return SniResult::None;
+	while ((q = c.Take(4))) {
+		size_t len = q[2] << 8 | q[3];
+		if (q[0] || q[1]) {
+			if (!c.Take(len))
+				break;
+			continue;
+		}
+		if (!c.Narrow(len) || !(q = c.Take(2 + 1 + 2)))							// server_name: list length, type, name length
+			break;
+		size_t nameLen = q[3] << 8 | q[4];
+		if (q[2] || !nameLen || nameLen > 255)										// host_name only
+			return SniResult::None;
+		if (!(q = c.Take(nameLen)))
+			return c.State;
+		if (memchr(q, 0, nameLen))
+			return SniResult::None;
+		name = Span(q, nameLen);
+		return SniResult::Found;
+	}
+	return c.State;
+}
+
+}} // Ext::Inet::
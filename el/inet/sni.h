@@ -0,0 +1,23 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include "proxy.h"
+
+namespace Ext {
+	namespace Inet {
+
+ENUM_CLASS(SniResult) {
+	NeedMore
+	, Found
+	, None											// not a ClientHello, no server_name extension, or the hello spans records
+} END_ENUM_CLASS(SniResult);
+
+// Server name (RFC 6066) of the TLS ClientHello at the start of s, a single record. Nothing is copied or allocated: name points
+// into s. NeedMore while s ends inside the record before the extension
+SniResult FindSni(RCSpan s, Span& name);
+
+}} // Ext::Inet::
@@ -0,0 +1,244 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "sockmap.h"
+
+#if HAVE_LINUX_BPF_H
+
+#include <linux/bpf.h>
+#include <linux/sockios.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+namespace Ext {
+	namespace Inet {
+
+static int Bpf(int cmd, bpf_attr& attr) {
+	return (int)::syscall(__NR_bpf, cmd, &attr, sizeof attr);
+}
+
+static bpf_insn Insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+	bpf_insn r;
+	r.code = code;
+	r.dst_reg = dst;
+	r.src_reg = src;
+	r.off = off;
+	r.imm = imm;
+	return r;
+}
+
+static int CreateMap(bpf_map_type typ, unsigned keySize, unsigned valueSize, unsigned maxEntries) {
+	bpf_attr attr = {};
+	attr.map_type = typ;
+	attr.key_size = keySize;
+	attr.value_size = valueSize;
+	attr.max_entries = maxEntries;
+	return CCheck(Bpf(BPF_MAP_CREATE, attr));
+}
+
+static int LoadProgram(const vector<bpf_insn>& insns) {
+	static char s_license[] = "GPL";
+	bpf_attr attr = {};
+	attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+	attr.insns = (uintptr_t)insns.data();
+	attr.insn_cnt = unsigned(insns.size());
+	attr.license = (uintptr_t)s_license;
+	return CCheck(Bpf(BPF_PROG_LOAD, attr));
+}
+
+static int Attach(int map, int prog, bpf_attach_type typ) {
+	bpf_attr attr = {};
+	attr.target_fd = unsigned(map);
+	attr.attach_bpf_fd = unsigned(prog);
+	attr.attach_type = typ;
+	return Bpf(BPF_PROG_ATTACH, attr);
+}
+
+static int UpdateElem(int map, const void *key, const void *value) {
+	bpf_attr attr = {};
+	attr.map_fd = unsigned(map);
+	attr.key = (uintptr_t)key;
+	attr.value = (uintptr_t)value;
+	attr.flags = BPF_ANY;
+	return Bpf(BPF_MAP_UPDATE_ELEM, attr);
+}
+
+static void DeleteElem(int map, const void *key) {
+	bpf_attr attr = {};
+	attr.map_fd = unsigned(map);
+	attr.key = (uintptr_t)key;
+	Bpf(BPF_MAP_DELETE_ELEM, attr);
+}
+
+static size_t InQueue(int fd) {
+	int n = 0;
+	return ::ioctl(fd, SIOCINQ, &n) == 0 ? size_t(n) : 1;
+}
+
+CSockMap::CSockMap()
+	: Offloaded(0)
+	, Refused(0)
+	, m_sockMap(-1)
+	, m_peerMap(-1)
+	, m_progParser(-1)
+	, m_progVerdict(-1)
+	, m_cookies(MAX_TUNNELS)
+{
+	try {
+		m_sockMap = CreateMap(BPF_MAP_TYPE_SOCKMAP, 4, 4, MAX_TUNNELS * 2);		// slot i: keys 2i (client) and 2i+1 (target)
+		m_peerMap = CreateMap(BPF_MAP_TYPE_HASH, 8, 4, MAX_TUNNELS * 2);			// socket cookie -> peer key
+		LoadPrograms();
+	} catch (RCExc) {
+		Close();
+		throw;
+	}
+	m_freeSlots.reserve(MAX_TUNNELS);
+	for (unsigned i = MAX_TUNNELS; i--;)
+		m_freeSlots.push_back(i);
+}
+
+CSockMap::~CSockMap() {
+	Close();
+}
+
+void CSockMap::Close() {
+	for (int fd : { m_progVerdict, m_progParser, m_peerMap, m_sockMap })
+		if (fd >= 0)
+			::close(fd);
+}
+
+void CSockMap::LoadPrograms() {
+	const uint8_t R0 = 0, R1 = 1, R2 = 2, R3 = 3, R4 = 4, R6 = 6, R10 = 10;
+
+	// return skb->len: every skb is a complete message
+	m_progParser = LoadProgram({
+		Insn(BPF_LDX | BPF_MEM | BPF_W, R0, R1, offsetof(__sk_buff, len), 0),
+		Insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+	});
+
+	// peer = peerMap[get_socket_cookie(skb)]; return peer ? sk_redirect_map(skb, sockMap, *peer, 0) : SK_PASS
+	m_progVerdict = LoadProgram({
+		Insn(BPF_ALU64 | BPF_MOV | BPF_X, R6, R1, 0, 0),
+		Insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie),
+		Insn(BPF_STX | BPF_MEM | BPF_DW, R10, R0, -8, 0),
+		Insn(BPF_ALU64 | BPF_MOV | BPF_X, R2, R10, 0, 0),
+		Insn(BPF_ALU64 | BPF_ADD | BPF_K, R2, 0, 0, -8),
+		Insn(BPF_LD | BPF_DW | BPF_IMM, R1, BPF_PSEUDO_MAP_FD, 0, m_peerMap),
+		Insn(0, 0, 0, 0, 0),
+		Insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+		Insn(BPF_JMP | BPF_JEQ | BPF_K, R0, 0, 7, 0),
+		Insn(BPF_LDX | BPF_MEM | BPF_W, R3, R0, 0, 0),
+		Insn(BPF_ALU64 | BPF_MOV | BPF_X, R1, R6, 0, 0),
+		Insn(BPF_LD | BPF_DW | BPF_IMM, R2, BPF_PSEUDO_MAP_FD, 0, m_sockMap),
+		Insn(0, 0, 0, 0, 0),
+		Insn(BPF_ALU64 | BPF_MOV | BPF_K, R4, 0, 0, 0),
+		Insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_map),
+		Insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		Insn(BPF_ALU64 | BPF_MOV | BPF_K, R0, 0, 0, SK_PASS),
+		Insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+	});
+
+	// Linux 5.13+ runs a verdict without strparser; older kernels need the parser
+	if (Attach(m_sockMap, m_progVerdict, BPF_SK_SKB_VERDICT) < 0) {
+		CCheck(Attach(m_sockMap, m_progParser, BPF_SK_SKB_STREAM_PARSER));
+		CCheck(Attach(m_sockMap, m_progVerdict, BPF_SK_SKB_STREAM_VERDICT));
+	}
+}
+
+void CSockMap::Unlink(unsigned slot) {
+	uint32_t key = slot * 2;
+	DeleteElem(m_sockMap, &key);
+	++key;
+	DeleteElem(m_sockMap, &key);
+	DeleteElem(m_peerMap, &m_cookies[slot].first);
+	DeleteElem(m_peerMap, &m_cookies[slot].second);
+}
+
+bool CSockMap::Add(int fdS, int fdD, unsigned& slot) {
+	uint64_t cookieS, cookieD;
+	socklen_t len = sizeof(uint64_t);
+	if (::getsockopt(fdS, SOL_SOCKET, SO_COOKIE, &cookieS, &len) < 0 || ::getsockopt(fdD, SOL_SOCKET, SO_COOKIE, &cookieD, &len) < 0) {
+		++Refused;
+		return false;
+	}
+	{
+		lock_guard<mutex> lk(m_mtx);
+		if (m_freeSlots.empty()) {
+			++Refused;
+			return false;
+		}
+		slot = m_freeSlots.back();
+		m_freeSlots.pop_back();
+	}
+	m_cookies[slot] = make_pair(cookieS, cookieD);
+	uint32_t keyS = slot * 2, keyD = keyS + 1;
+	int32_t valS = fdS, valD = fdD;
+	bool ok = UpdateElem(m_peerMap, &cookieS, &keyD) == 0 && UpdateElem(m_peerMap, &cookieD, &keyS) == 0
+		&& UpdateElem(m_sockMap, &keyS, &valS) == 0 && UpdateElem(m_sockMap, &keyD, &valD) == 0;
+
+	// Bytes queued before the insert are seen by the verdict only on the next data_ready, which may never come.
+	// The kernel always consumes the queue head first, so backing out while bytes are still queued keeps the order
+	if (ok && !InQueue(fdS) && !InQueue(fdD)) {
+		++Offloaded;
+		return true;
+	}
+	Remove(slot);
+	++Refused;
+	return false;
+}
+
+void CSockMap::Remove(unsigned slot) {
+	Unlink(slot);
+	lock_guard<mutex> lk(m_mtx);
+	m_freeSlots.push_back(slot);
+}
+
+// Redirected skbs are sent from a kernel work queue; give it time to drain before the FIN goes after them
+static void WaitSendDrained(int fd) {
+	int prev = -1;
+	for (int i = 0; i < 200; ++i) {
+		int n = 0;
+		if (::ioctl(fd, SIOCOUTQ, &n) < 0 || (!n && !prev))
+			break;
+		prev = n;
+		this_thread::sleep_for(chrono::milliseconds(5));
+	}
+}
+
+void SockMapWait(int fdS, int fdD, const volatile bool& bStop) {
+	pollfd fds[2] = { { fdS, POLLRDHUP, 0 }, { fdD, POLLRDHUP, 0 } };
+	bool done[2] = { false, false };
+	while (!bStop && !(done[0] && done[1])) {
+		int r = ::poll(fds, 2, 1000);
+		if (r < 0 && errno != EINTR)
+			break;
+		for (int i = 0; i < 2; ++i) {
+			if (done[i] || !fds[i].revents)
+				continue;
+			if (fds[i].revents & POLLERR) {								// POLLHUP alone is our own SHUT_WR plus the peer's FIN
+				int err = 0;
+				socklen_t len = sizeof err;
+				::getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				if (err == EPIPE)											// the psock redirected the peer's FIN after our SHUT_WR; reading SO_ERROR cleared it
+					continue;
+				::shutdown(fdS, SHUT_RDWR);
+				::shutdown(fdD, SHUT_RDWR);
+				return;
+			}
+			done[i] = true;
+			fds[i].fd = -1;
+			int peer = i ? fdS : fdD;
+			WaitSendDrained(peer);
+			::shutdown(peer, SHUT_WR);
+		}
+	}
+}
+
+}} // Ext::Inet::
+
+#endif // HAVE_LINUX_BPF_H
@@ -0,0 +1,48 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include <el/libext/ext-net.h>
+
+namespace Ext {
+	namespace Inet {
+
+#if HAVE_LINUX_BPF_H
+
+// In-kernel relay: established socket pairs go into a BPF sockmap whose sk_skb verdict program redirects every
+// received skb to the peer socket. Raw bpf() syscalls and hand-assembled programs, no libbpf
+class CSockMap {
+public:
+	static const unsigned MAX_TUNNELS = 65536;
+
+	atomic<uint64_t> Offloaded, Refused;
+
+	CSockMap();											// throws if BPF is not permitted
+	~CSockMap();
+
+	// Returns false and leaves the sockets untouched if bytes already sit in either receive queue
+	bool Add(int fdS, int fdD, unsigned& slot);
+	void Remove(unsigned slot);
+private:
+	int m_sockMap, m_peerMap, m_progParser, m_progVerdict;
+	mutex m_mtx;
+	vector<unsigned> m_freeSlots;
+	vector<pair<uint64_t, uint64_t>> m_cookies;			// per slot
+
+	void Close();
+	void LoadPrograms();
+	void Unlink(unsigned slot);
+
+	CSockMap(const CSockMap&) = delete;
+	CSockMap& operator=(const CSockMap&) = delete;
+};
+
+// Userspace side of an offloaded pair: sleeps until both directions are closed, propagating half-closes. bStop is checked every second
+void SockMapWait(int fdS, int fdD, const volatile bool& bStop);
+
+#endif // HAVE_LINUX_BPF_H
+
+}} // Ext::Inet::
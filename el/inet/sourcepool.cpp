@@ -0,0 +1,87 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "sourcepool.h"
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#	define IP_BIND_ADDRESS_NO_PORT 24				// Linux 4.2
+#endif
+
+namespace Ext {
+	namespace Inet {
+
+CSourceAddressPool::CSourceAddressPool(SourceSelection selection)
+	: AddrNotAvail(0)
+	, Mark(0)
+	, m_selection(selection)
+	, m_next(0)
+{}
+
+void CSourceAddressPool::Add(const IPAddress& ip) {
+	IPEndPoint ep(ip, 0);
+	SourceAddress a;
+	a.Len = socklen_t(ep.sockaddr_len());
+	memcpy(&a.Sa, ep.c_sockaddr(), a.Len);
+	(a.Sa.ss_family == AF_INET6 ? m_v6 : m_v4).push_back(a);
+}
+
+static void Fnv1a(uint64_t& h, const void *p, size_t size) {
+	for (const uint8_t *q = (const uint8_t*)p; size--;)
+		h = (h ^ *q++) * 0x100000001B3ULL;
+}
+
+uint64_t CSourceAddressPool::Hint(const ProxyEndPoint& client, const IPEndPoint& dst) {
+	uint64_t h = 0xCBF29CE484222325ULL;
+	Fnv1a(h, client.Address, client.Kind == ProxyEndPoint::IPv6 ? 16 : 4);
+	Fnv1a(h, dst.c_sockaddr(), dst.sockaddr_len());
+	return h;
+}
+
+int CSourceAddressPool::OpenSocket(const IPEndPoint& dst, uint64_t first, unsigned attempt, int flags) {
+	int family = dst.c_sockaddr()->sa_family;
+	const vector<SourceAddress>& addrs = Addresses(family);
+	if (addrs.empty())
+		return -1;
+	const SourceAddress& a = addrs[(first + attempt) % addrs.size()];
+	int fd = CCheck(::socket(family, SOCK_STREAM | flags, IPPROTO_TCP));
+	int on = 1;
+	::setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof on);
+	if (Mark)
+		::setsockopt(fd, SOL_SOCKET, SO_MARK, &Mark, sizeof Mark);
+	if (::bind(fd, (const sockaddr*)&a.Sa, a.Len) < 0) {
+		int err = errno;
+		::close(fd);
+		Throw(error_code(err, system_category()));
+	}
+	return fd;
+}
+
+void CSourceAddressPool::Connect(Socket& sock, const IPEndPoint& dst, uint64_t hint, int timeoutMs) {
+	size_t n = Addresses(dst.c_sockaddr()->sa_family).size();
+	timeval tv = { timeoutMs / 1000, timeoutMs % 1000 * 1000 };
+	uint64_t first = First(hint);
+	for (unsigned attempt = 0;; ++attempt) {
+		int fd = OpenSocket(dst, first, attempt);
+		if (timeoutMs)
+			::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);		// bounds a blocking connect()
+		if (::connect(fd, dst.c_sockaddr(), socklen_t(dst.sockaddr_len())) == 0) {
+			if (timeoutMs) {
+				timeval none = {};
+				::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &none, sizeof none);	// relay writes may block as long as they need
+			}
+			sock.Attach(fd);
+			return;
+		}
+		int err = errno == EINPROGRESS ? ETIMEDOUT : errno;
+		::close(fd);
+		if (err != EADDRNOTAVAIL || attempt + 1 >= n)
+			Throw(error_code(err, system_category()));
+		++AddrNotAvail;
+	}
+}
+
+}} // Ext::Inet::
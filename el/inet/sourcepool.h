@@ -0,0 +1,55 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include "proxy.h"
+
+namespace Ext {
+	namespace Inet {
+
+ENUM_CLASS(SourceSelection) {
+	RoundRobin
+	, Hash											// by client address and destination: a client keeps its source address per destination
+} END_ENUM_CLASS(SourceSelection);
+
+// Outbound source addresses. Sockets are bound with IP_BIND_ADDRESS_NO_PORT, so the port is chosen at connect() time
+// per 4-tuple and every source address brings its own ~28k ephemeral ports to each destination
+class CSourceAddressPool {
+public:
+	atomic<uint64_t> AddrNotAvail;					// EADDRNOTAVAIL retried on the next address
+	uint32_t Mark;									// SO_MARK of the sockets opened, 0 - none
+
+	CSourceAddressPool(SourceSelection selection = SourceSelection::RoundRobin);
+
+	void Add(const IPAddress& ip);
+	bool HasFamily(int family) const { return !Addresses(family).empty(); }
+	size_t Count(int family) const { return Addresses(family).size(); }	// attempts a connect to that family may take
+
+	// Hint for SourceSelection::Hash
+	static uint64_t Hint(const ProxyEndPoint& client, const IPEndPoint& dst);
+
+	// Where one connection starts in the address list: the hint for SourceSelection::Hash, else the next round robin slot
+	uint64_t First(uint64_t hint) { return m_selection == SourceSelection::Hash ? hint : m_next++; }
+
+	// Socket bound to the source address first + attempt for dst; -1 if the pool has no address of dst's family
+	int OpenSocket(const IPEndPoint& dst, uint64_t first, unsigned attempt = 0, int flags = SOCK_CLOEXEC);
+
+	// Blocking connect, trying the next source address on EADDRNOTAVAIL. Throws on failure
+	void Connect(Socket& sock, const IPEndPoint& dst, uint64_t hint, int timeoutMs = 0);
+private:
+	struct SourceAddress {
+		sockaddr_storage Sa;
+		socklen_t Len;
+	};
+
+	const SourceSelection m_selection;
+	vector<SourceAddress> m_v4, m_v6;
+	atomic<uint64_t> m_next;
+
+	const vector<SourceAddress>& Addresses(int family) const { return family == AF_INET6 ? m_v6 : m_v4; }
+};
+
+}} // Ext::Inet::
@@ -0,0 +1,96 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "splice.h"
+
+#if UCFG_INET_SPLICE
+
+#include <poll.h>
+
+namespace Ext {
+	namespace Inet {
+
+static const size_t SPLICE_PIPE_SIZE = 1 << 20;
+
+struct SpliceDir {
+	int From, To;
+	int Pipe[2];
+	size_t InPipe;
+	uint64_t Bytes;
+	bool Eof, Done;
+
+	// Returns false on a hard error
+	bool Pump(short revFrom, short revTo) {
+		if (!Eof && (revFrom & (POLLIN | POLLHUP | POLLERR))) {
+			ssize_t n = ::splice(From, nullptr, Pipe[1], nullptr, SPLICE_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n > 0)
+				InPipe += n;
+			else if (!n)
+				Eof = true;
+			else if (errno != EAGAIN)
+				return false;
+		}
+		if (InPipe && (revTo & (POLLOUT | POLLHUP | POLLERR) || revFrom)) {
+			ssize_t n = ::splice(Pipe[0], nullptr, To, nullptr, InPipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n > 0) {
+				InPipe -= n;
+				Bytes += n;
+			}
+			else if (n < 0 && errno != EAGAIN)
+				return false;
+		}
+		if (Eof && !InPipe && !Done) {
+			::shutdown(To, SHUT_WR);
+			Done = true;
+		}
+		return true;
+	}
+};
+
+pair<uint64_t, uint64_t> SpliceLoop(int fdS, int fdD, const volatile bool& bStop) {
+	SpliceDir dirs[2] = {
+		{ fdS, fdD, { -1, -1 }, 0, 0, false, false },
+		{ fdD, fdS, { -1, -1 }, 0, 0, false, false }
+	};
+	try {
+		for (auto& d : dirs) {
+			CCheck(::pipe2(d.Pipe, O_NONBLOCK | O_CLOEXEC));
+			::fcntl(d.Pipe[1], F_SETPIPE_SZ, int(SPLICE_PIPE_SIZE));		// best effort, limited by /proc/sys/fs/pipe-max-size
+			::fcntl(d.From, F_SETFL, ::fcntl(d.From, F_GETFL) | O_NONBLOCK);
+		}
+		while (!bStop && !(dirs[0].Done && dirs[1].Done)) {
+			pollfd fds[2] = { { fdS, 0, 0 }, { fdD, 0, 0 } };
+			for (int i = 0; i < 2; ++i) {
+				if (!dirs[i].Eof && dirs[i].InPipe < SPLICE_PIPE_SIZE)
+					fds[i].events |= POLLIN;
+				if (dirs[i].InPipe)
+					fds[1 - i].events |= POLLOUT;
+			}
+			int r = ::poll(fds, 2, 1000);
+			if (r < 0 && errno != EINTR)
+				CCheck(-1);
+			if (r <= 0)
+				continue;
+			if (!dirs[0].Pump(fds[0].revents, fds[1].revents) || !dirs[1].Pump(fds[1].revents, fds[0].revents))
+				break;
+		}
+	} catch (RCExc) {
+	}
+	for (auto& d : dirs) {
+		if (d.Pipe[0] >= 0)
+			::close(d.Pipe[0]);
+		if (d.Pipe[1] >= 0)
+			::close(d.Pipe[1]);
+	}
+	::close(fdS);
+	::close(fdD);
+	return make_pair(dirs[0].Bytes, dirs[1].Bytes);
+}
+
+}} // Ext::Inet::
+
+#endif // UCFG_INET_SPLICE
@@ -0,0 +1,27 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include <el/libext/ext-net.h>
+
+#ifdef __linux__
+#	define UCFG_INET_SPLICE 1
+#else
+#	define UCFG_INET_SPLICE 0
+#endif
+
+namespace Ext {
+	namespace Inet {
+
+#if UCFG_INET_SPLICE
+
+// Zero-copy relay through one pipe per direction. Takes ownership of both descriptors, returns when both directions are shut down
+// or bStop is set (checked every second). Returns bytes relayed S -> D and D -> S
+pair<uint64_t, uint64_t> SpliceLoop(int fdS, int fdD, const volatile bool& bStop);
+
+#endif // UCFG_INET_SPLICE
+
+}} // Ext::Inet::
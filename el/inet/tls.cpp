@@ -0,0 +1,211 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "tls.h"
+
+#if UCFG_INET_TLS
+
+#include <poll.h>
+#include <openssl/err.h>
+
+namespace Ext {
+	namespace Inet {
+
+static const long SESSION_CACHE_SIZE = 20480, SESSION_TIMEOUT = 2 * 3600;		// seconds
+
+CTlsContext::CTlsContext(RCString certFile, RCString keyFile)
+	: Handshakes(0)
+	, Resumed(0)
+	, KernelTx(0)
+	, KernelRx(0)
+	, m_ctx(::SSL_CTX_new(::TLS_server_method()))
+{
+	if (!m_ctx)
+		Throw(errc::not_enough_memory);
+	::SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+	if (::SSL_CTX_use_certificate_chain_file(m_ctx, certFile.c_str()) != 1
+		|| ::SSL_CTX_use_PrivateKey_file(m_ctx, keyFile.c_str(), SSL_FILETYPE_PEM) != 1
+		|| ::SSL_CTX_check_private_key(m_ctx) != 1)
+	{
+		char buf[256];
+		::ERR_error_string_n(::ERR_get_error(), buf, sizeof buf);
+		::SSL_CTX_free(m_ctx);
+		throw system_error(make_error_code(errc::invalid_argument), String(certFile) + ": " + buf);
+	}
+	static const unsigned char s_sidCtx[] = "socksd";
+	::SSL_CTX_set_session_id_context(m_ctx, s_sidCtx, sizeof(s_sidCtx) - 1);
+	::SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_SERVER);		// TLS 1.2 session IDs; TLS 1.3 tickets are on by default
+	::SSL_CTX_sess_set_cache_size(m_ctx, SESSION_CACHE_SIZE);
+	::SSL_CTX_set_timeout(m_ctx, SESSION_TIMEOUT);
+	::SSL_CTX_set_mode(m_ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+	::SSL_CTX_set_options(m_ctx, SSL_OP_ENABLE_KTLS);					// needs the tls kernel module and an AES-GCM suite
+#endif
+}
+
+CTlsContext::~CTlsContext() {
+	::SSL_CTX_free(m_ctx);
+}
+
+CTlsStream::CTlsStream(CTlsContext& ctx, int fd)
+	: m_ssl(::SSL_new(ctx.Handle()))
+	, m_fd(fd)
+{
+	if (!m_ssl)
+		Throw(errc::not_enough_memory);
+	::SSL_set_fd(m_ssl, fd);											// BIO_NOCLOSE: the socket stays owned by the caller
+	::ERR_clear_error();
+	int r = ::SSL_accept(m_ssl);
+	if (r != 1) {
+		try {
+			ThrowSslError(r);
+		} catch (...) {
+			::SSL_free(exchange(m_ssl, nullptr));
+			throw;
+		}
+	}
+	++ctx.Handshakes;
+	if (::SSL_session_reused(m_ssl))
+		++ctx.Resumed;
+	bool bTx = false, bRx = false;
+#ifndef OPENSSL_NO_KTLS
+	bTx = BIO_get_ktls_send(::SSL_get_wbio(m_ssl));
+	bRx = BIO_get_ktls_recv(::SSL_get_rbio(m_ssl));
+#endif
+	ctx.KernelTx += bTx;
+	ctx.KernelRx += bRx;
+	if (bTx && bRx)
+		::SSL_free(exchange(m_ssl, nullptr));							// record state is in the kernel now
+}
+
+CTlsStream::~CTlsStream() {
+	if (m_ssl)
+		::SSL_free(m_ssl);
+}
+
+void CTlsStream::ThrowSslError(int r) const {
+	int err = ::SSL_get_error(m_ssl, r);
+	if (err == SSL_ERROR_SYSCALL && errno)
+		Throw(error_code(errno == EAGAIN ? ETIMEDOUT : errno, system_category()));		// EAGAIN: SO_RCVTIMEO of the handshake
+	if (err == SSL_ERROR_SYSCALL || err == SSL_ERROR_ZERO_RETURN)
+		Throw(ExtErr::EndOfStream);
+	TRC(2, "TLS: " << ::ERR_error_string(::ERR_get_error(), nullptr));
+	Throw(errc::protocol_error);
+}
+
+size_t CTlsStream::Read(void *buf, size_t size) const {
+	if (!m_ssl)
+		return CCheck(int(::recv(m_fd, buf, size, 0)));
+	::ERR_clear_error();
+	int r = ::SSL_read(m_ssl, buf, int((min)(size, size_t(INT_MAX))));
+	if (r > 0)
+		return r;
+	if (::SSL_get_error(m_ssl, r) == SSL_ERROR_ZERO_RETURN)
+		return 0;
+	ThrowSslError(r);
+}
+
+static bool SendAll(int fd, const uint8_t *p, size_t size) {
+	while (size) {
+		ssize_t r = ::send(fd, p, size, MSG_NOSIGNAL);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += r;
+		size -= r;
+	}
+	return true;
+}
+
+// Waits for the socket only if it is non-blocking, i.e. in Relay(). False if bStop was set meanwhile
+bool CTlsStream::Write(const void *buf, size_t size, const volatile bool& bStop) {
+	while (size) {
+		if (!m_ssl) {
+			if (!SendAll(m_fd, (const uint8_t*)buf, size))
+				CCheck(-1);
+			return true;
+		}
+		::ERR_clear_error();
+		int r = ::SSL_write(m_ssl, buf, int((min)(size, size_t(INT_MAX))));		// the whole chunk or nothing
+		if (r > 0) {
+			buf = (const uint8_t*)buf + r;
+			size -= r;
+			continue;
+		}
+		int err = ::SSL_get_error(m_ssl, r);
+		if (err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ)
+			ThrowSslError(r);
+		pollfd pfd = { m_fd, short(err == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN), 0 };
+		while (::poll(&pfd, 1, 1000) <= 0)
+			if (bStop)
+				return false;
+	}
+	return true;
+}
+
+void CTlsStream::WriteBuffer(const void *buf, size_t count) {
+	static const volatile bool s_bFalse = false;
+	Write(buf, count, s_bFalse);
+}
+
+pair<uint64_t, uint64_t> CTlsStream::Relay(int fdD, const volatile bool& bStop) {
+	uint64_t up = 0, down = 0;
+	::fcntl(m_fd, F_SETFL, ::fcntl(m_fd, F_GETFL) | O_NONBLOCK);
+	uint8_t buf[16384];
+	pollfd pfd[2] = { { m_fd, POLLIN, 0 }, { fdD, POLLIN, 0 } };		// fd -1: direction closed
+	try {
+		while ((pfd[0].fd >= 0 || pfd[1].fd >= 0) && !bStop) {
+			bool bPending = pfd[0].fd >= 0 && m_ssl && ::SSL_pending(m_ssl);	// decrypted bytes don't wake poll()
+			if (!bPending) {
+				int r = ::poll(pfd, 2, 1000);
+				if (r < 0 && errno != EINTR)
+					break;
+				if (r <= 0)
+					continue;
+			}
+			if (pfd[0].fd >= 0 && (bPending || pfd[0].revents)) {
+				ssize_t n;
+				if (m_ssl) {
+					::ERR_clear_error();
+					int r = ::SSL_read(m_ssl, buf, sizeof buf);
+					int err = r > 0 ? SSL_ERROR_NONE : ::SSL_get_error(m_ssl, r);
+					n = r > 0 ? r : err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? -1 : 0;		// 0: close_notify, EOF or error
+				} else if ((n = ::recv(m_fd, buf, sizeof buf, 0)) < 0 && errno != EAGAIN && errno != EINTR)
+					n = 0;
+				if (n > 0) {
+					if (!SendAll(fdD, buf, n))
+						break;
+					up += n;
+				} else if (!n) {
+					::shutdown(fdD, SHUT_WR);
+					pfd[0].fd = -1;
+				}
+			}
+			if (pfd[1].fd >= 0 && pfd[1].revents) {
+				ssize_t n = ::recv(fdD, buf, sizeof buf, 0);
+				if (n > 0) {
+					if (!Write(buf, n, bStop))
+						break;
+					down += n;
+				} else if (!n || errno != EINTR) {
+					if (m_ssl)
+						::SSL_shutdown(m_ssl);								// close_notify
+					::shutdown(m_fd, SHUT_WR);
+					pfd[1].fd = -1;
+				}
+			}
+		}
+	} catch (RCExc) {
+	}
+	return make_pair(up, down);
+}
+
+}} // Ext::Inet::
+
+#endif // UCFG_INET_TLS
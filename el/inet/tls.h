@@ -0,0 +1,63 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include <el/libext/ext-net.h>
+
+#if HAVE_OPENSSL_SSL_H
+#	define UCFG_INET_TLS 1
+#	include <openssl/ssl.h>
+#else
+#	define UCFG_INET_TLS 0
+#endif
+
+namespace Ext {
+	namespace Inet {
+
+#if UCFG_INET_TLS
+
+// Server certificate, session cache and ticket keys shared by all TLS listeners
+class CTlsContext {
+public:
+	atomic<uint64_t> Handshakes
+		, Resumed										// by session ID or ticket
+		, KernelTx, KernelRx;							// directions taken over by kTLS
+
+	CTlsContext(RCString certFile, RCString keyFile);		// PEM, the certificate file may hold the chain
+	~CTlsContext();
+
+	SSL_CTX *Handle() const { return m_ctx; }
+private:
+	SSL_CTX *m_ctx;
+};
+
+// Server end of a TLS connection over a blocking socket; the handshake runs in the constructor.
+// If kTLS took both directions the OpenSSL state is freed and the socket itself carries plaintext: callers relay it as
+// a plain socket, including splice(). Otherwise reads and writes go through OpenSSL and Relay() pumps the tunnel
+class CTlsStream : public Stream {
+public:
+	CTlsStream(CTlsContext& ctx, int fd);
+	~CTlsStream();
+
+	bool IsKernel() const { return !m_ssl; }
+
+	size_t Read(void *buf, size_t size) const override;		// 0 on close_notify or EOF
+	void WriteBuffer(const void *buf, size_t count) override;
+	bool Eof() const override { return false; }
+
+	// Non-blocking pump between the TLS client and a plain upstream. Returns bytes relayed client -> upstream, upstream -> client
+	pair<uint64_t, uint64_t> Relay(int fdD, const volatile bool& bStop);
+private:
+	SSL *m_ssl;
+	const int m_fd;
+
+	[[noreturn]] void ThrowSslError(int r) const;
+	bool Write(const void *buf, size_t size, const volatile bool& bStop);
+};
+
+#endif // UCFG_INET_TLS
+
+}} // Ext::Inet::
@@ -0,0 +1,54 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "transparent.h"
+
+#if UCFG_INET_TRANSPARENT
+
+#include <netinet/in.h>
+
+#ifndef SO_ORIGINAL_DST
+#	define SO_ORIGINAL_DST 80						// <linux/netfilter_ipv4.h>
+#endif
+#ifndef IP6T_SO_ORIGINAL_DST
+#	define IP6T_SO_ORIGINAL_DST 80					// <linux/netfilter_ipv6/ip6_tables.h>
+#endif
+
+namespace Ext {
+	namespace Inet {
+
+int ListenTransparent(const IPEndPoint& ep, bool& bTransparent) {
+	int family = ep.c_sockaddr()->sa_family;
+	int fd = CCheck(::socket(family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP));
+	int on = 1;
+	::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+	bTransparent = family == AF_INET6
+		? !::setsockopt(fd, SOL_IPV6, IPV6_TRANSPARENT, &on, sizeof on)
+		: !::setsockopt(fd, SOL_IP, IP_TRANSPARENT, &on, sizeof on);
+	if (::bind(fd, ep.c_sockaddr(), socklen_t(ep.sockaddr_len())) < 0 || ::listen(fd, SOMAXCONN) < 0) {
+		int err = errno;
+		::close(fd);
+		Throw(error_code(err, system_category()));
+	}
+	return fd;
+}
+
+ProxyEndPoint GetOriginalDestination(int fd) {
+	sockaddr_storage ss;
+	socklen_t len = sizeof ss;
+	CCheck(::getsockname(fd, (sockaddr*)&ss, &len));
+	sockaddr_storage orig;
+	socklen_t origLen = sizeof orig;
+	int r = ss.ss_family == AF_INET6
+		? ::getsockopt(fd, SOL_IPV6, IP6T_SO_ORIGINAL_DST, &orig, &origLen)
+		: ::getsockopt(fd, SOL_IP, SO_ORIGINAL_DST, &orig, &origLen);
+	return ProxyEndPoint(*(const sockaddr*)(r ? &ss : &orig));		// ENOENT: no NAT entry, TPROXY or conntrack not loaded
+}
+
+}} // Ext::Inet::
+
+#endif // UCFG_INET_TRANSPARENT
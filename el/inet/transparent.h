@@ -0,0 +1,35 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include "proxy.h"
+
+#ifdef __linux__
+#	define UCFG_INET_TRANSPARENT 1
+#else
+#	define UCFG_INET_TRANSPARENT 0
+#endif
+
+namespace Ext {
+	namespace Inet {
+
+#if UCFG_INET_TRANSPARENT
+
+// Connections redirected to us by netfilter, the client does not know about the proxy:
+//	iptables -t nat -A PREROUTING -p tcp -j REDIRECT --to-ports port
+//	iptables -t mangle -A PREROUTING -p tcp -j TPROXY --on-port port --tproxy-mark 1, with a local route for the mark
+
+// Listening socket bound to ep, IP_TRANSPARENT set before bind() if permitted (CAP_NET_ADMIN), which TPROXY needs.
+// REDIRECT works without it. Throws on bind/listen errors
+int ListenTransparent(const IPEndPoint& ep, bool& bTransparent);
+
+// Where the client connected to: SO_ORIGINAL_DST of a NATed (REDIRECT) connection, otherwise the local address, which TPROXY
+// leaves as it was
+ProxyEndPoint GetOriginalDestination(int fd);
+
+#endif // UCFG_INET_TRANSPARENT
+
+}} // Ext::Inet::
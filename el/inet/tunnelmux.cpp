@@ -0,0 +1,597 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "tunnelmux.h"
+#include "sendv.h"
+
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+
+namespace Ext {
+	namespace Inet {
+
+static const size_t HEADER_SIZE = 8;
+
+static uint32_t LoadBE32(const uint8_t *p) {
+	return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+}
+
+static void StoreBE32(uint8_t *p, uint32_t v) {
+	p[0] = uint8_t(v >> 24);
+	p[1] = uint8_t(v >> 16);
+	p[2] = uint8_t(v >> 8);
+	p[3] = uint8_t(v);
+}
+
+// kind(8) length(8) port(16), then the address or host name
+static void AppendEndPoint(string& s, const ProxyEndPoint& ep) {
+	size_t len = ep.Kind == ProxyEndPoint::IPv4 ? 4 : ep.Kind == ProxyEndPoint::IPv6 ? 16 : ep.Kind == ProxyEndPoint::Host ? ep.HostLength : 0;
+	uint8_t hdr[4] = { uint8_t(ep.Kind), uint8_t(len), uint8_t(ep.Port >> 8), uint8_t(ep.Port) };
+	s.append((const char*)hdr, sizeof hdr);
+	s.append(ep.Kind == ProxyEndPoint::Host ? ep.HostName : (const char*)ep.Address, len);
+}
+
+static bool ParseEndPoint(const uint8_t*& p, const uint8_t *e, ProxyEndPoint& ep) {
+	if (e - p < 4 || e - p - 4 < p[1])
+		return false;
+	size_t len = p[1];
+	uint16_t port = uint16_t(p[2] << 8 | p[3]);
+	const uint8_t *a = p + 4;
+	switch (p[0]) {
+	case ProxyEndPoint::None:
+		ep = ProxyEndPoint();
+		break;
+	case ProxyEndPoint::IPv4:
+	case ProxyEndPoint::IPv6:
+		if (len != (p[0] == ProxyEndPoint::IPv4 ? 4 : 16))
+			return false;
+		ep = ProxyEndPoint::FromAddress(ProxyEndPoint::EKind(p[0]), a, port);
+		break;
+	case ProxyEndPoint::Host:
+		ep = ProxyEndPoint::FromHost((const char*)a, len, port);
+		break;
+	default:
+		return false;
+	}
+	p = a + len;
+	return true;
+}
+
+// Under SO_RCVTIMEO a timeout before the first byte sets bIdle if given, later ones are errors
+static bool RecvAll(int fd, uint8_t *p, size_t size, bool *bIdle = nullptr) {
+	for (size_t got = 0; got < size;) {
+		ssize_t r = ::recv(fd, p + got, size - got, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EAGAIN && !got && bIdle) {
+			*bIdle = true;
+			return false;
+		}
+		if (r <= 0)
+			return false;
+		got += r;
+	}
+	return true;
+}
+
+// In the same time wherever they differ
+static bool SecretEquals(const string& secret, const uint8_t *p, size_t size) {
+	if (size != secret.size())
+		return false;
+	uint8_t d = 0;
+	for (size_t i = 0; i < size; ++i)
+		d |= uint8_t(secret[i]) ^ p[i];
+	return !d;
+}
+
+CMuxStream::CMuxStream(const shared_ptr<CMuxSession>& session, uint32_t id)
+	: Id(id)
+	, m_session(session)
+	, m_rxPos(0)
+	, m_sendWindow(WINDOW)
+	, m_consumed(0)
+	, m_bReplied(false)
+	, m_bRemoteFin(false)
+	, m_bReset(false)
+	, m_evfd(CCheck(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)))
+{}
+
+CMuxStream::~CMuxStream() {
+	::close(m_evfd);
+}
+
+void CMuxStream::Notify() {
+	uint64_t v = 1;
+	(void)::write(m_evfd, &v, sizeof v);
+}
+
+// Waits up to ms for Notify() and clears it
+static void WaitEvent(int evfd, int ms) {
+	pollfd pfd = { evfd, POLLIN, 0 };
+	if (::poll(&pfd, 1, ms) > 0) {
+		uint64_t v;
+		(void)::read(evfd, &v, sizeof v);
+	}
+}
+
+void CMuxStream::WaitReply(int timeoutMs) {
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs ? timeoutMs : 60000);
+	for (;;) {
+		{
+			lock_guard<mutex> lk(m_mtx);
+			if (m_bReplied) {
+				if (!m_ec)
+					return;
+				break;
+			}
+			if (m_bReset) {
+				m_ec = make_error_code(errc::connection_aborted);
+				break;
+			}
+		}
+		int ms = int(chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count());
+		if (ms <= 0) {
+			Reset();
+			throw system_error(make_error_code(errc::timed_out));
+		}
+		WaitEvent(m_evfd, ms);
+	}
+	m_session->Remove(Id);
+	throw system_error(m_ec);
+}
+
+void CMuxStream::SendReply(const ProxyEndPoint& bound, const error_code& ec) {
+	uint8_t v[4];
+	StoreBE32(v, uint32_t(ec.value()));
+	string payload((const char*)v, sizeof v);
+	AppendEndPoint(payload, bound);
+	try {
+		m_session->Send(MuxFrameType::Reply, Id, payload.data(), payload.size());
+	} catch (RCExc) {
+		m_session->Remove(Id);
+		throw;
+	}
+	if (ec)
+		m_session->Remove(Id);
+}
+
+void CMuxStream::Reset() {
+	bool bWasReset;
+	{
+		lock_guard<mutex> lk(m_mtx);
+		bWasReset = exchange(m_bReset, true);
+	}
+	if (!bWasReset) {
+		try {
+			m_session->Send(MuxFrameType::Reset, Id);
+		} catch (RCExc) {
+		}
+	}
+	m_session->Remove(Id);
+}
+
+void CMuxStream::Write(const void *p, size_t size) {
+	for (const uint8_t *q = (const uint8_t*)p; size;) {
+		size_t n;
+		{
+			lock_guard<mutex> lk(m_mtx);
+			if (m_bReset)
+				Throw(errc::connection_reset);
+			n = (min)((min)(size, size_t(m_sendWindow)), size_t(CMuxSession::MAX_PAYLOAD));
+			m_sendWindow -= uint32_t(n);
+		}
+		if (!n) {
+			WaitEvent(m_evfd, 1000);
+			continue;
+		}
+		m_session->Send(MuxFrameType::Data, Id, q, n);
+		q += n;
+		size -= n;
+	}
+}
+
+pair<uint64_t, uint64_t> CMuxStream::Relay(int fd, const volatile bool& bStop) {
+	uint64_t up = 0, down = 0;
+	::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+	uint8_t buf[CMuxSession::MAX_PAYLOAD];
+	bool bInDone = false, bOutDone = false;						// socket -> stream, stream -> socket
+	try {
+		while (!bStop) {
+			uint64_t v;
+			(void)::read(m_evfd, &v, sizeof v);					// before looking at the state, so no Notify() is lost
+			uint32_t window, credit = 0;
+			bool bWantOut = false, bFailed = false;
+			{
+				lock_guard<mutex> lk(m_mtx);
+				if (m_bReset)
+					break;
+				if (size_t pending = m_rx.size() - m_rxPos) {		// non-blocking, so it's fine under the lock the reader appends with
+					ssize_t n = ::send(fd, m_rx.data() + m_rxPos, pending, MSG_NOSIGNAL);
+					if (n > 0) {
+						m_rxPos += n;
+						down += n;
+						if ((m_consumed += uint32_t(n)) >= WINDOW / 2)
+							credit = exchange(m_consumed, 0);
+					} else if (n < 0 && errno != EAGAIN && errno != EINTR)
+						bFailed = true;
+					bWantOut = m_rxPos != m_rx.size();
+				}
+				if (!bWantOut && m_bRemoteFin && !bOutDone) {
+					::shutdown(fd, SHUT_WR);
+					bOutDone = true;
+				}
+				window = m_sendWindow;
+			}
+			if (bFailed)
+				break;
+			if (credit) {
+				uint8_t w[4];
+				StoreBE32(w, credit);
+				m_session->Send(MuxFrameType::Window, Id, w, sizeof w);
+			}
+			if (bInDone && bOutDone)
+				break;
+			if (!bInDone && window) {
+				ssize_t n = ::recv(fd, buf, (min)(sizeof buf, size_t(window)), 0);
+				if (n > 0) {
+					{
+						lock_guard<mutex> lk(m_mtx);
+						m_sendWindow -= uint32_t(n);
+					}
+					m_session->Send(MuxFrameType::Data, Id, buf, n);
+					up += n;
+					continue;
+				}
+				if (!n) {
+					m_session->Send(MuxFrameType::Fin, Id);
+					bInDone = true;
+					continue;
+				}
+				if (errno != EAGAIN && errno != EINTR)
+					break;
+			}
+			pollfd pfd[2] = { { fd, short((!bInDone && window ? POLLIN : 0) | (bWantOut ? POLLOUT : 0)), 0 }, { m_evfd, POLLIN, 0 } };
+			::poll(pfd, 2, 1000);
+		}
+	} catch (RCExc) {
+	}
+	if (bInDone && bOutDone)
+		m_session->Remove(Id);
+	else
+		Reset();
+	return make_pair(up, down);
+}
+
+CMuxSession::CMuxSession(int fd, OpenHandler onOpen, const string& secret)
+	: m_fd(fd)
+	, m_onOpen(move(onOpen))
+	, m_secret(secret)
+	, m_nextId(1)
+	, m_bDead(false)
+	, m_bAuthenticated(!m_onOpen)								// the edge does not check its peer
+{
+	int one = 1, userTimeout = 3 * PING_INTERVAL_MS;
+	::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);			// Open and Reply are tiny and latency bound
+	::setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof one);
+	::setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeout, sizeof userTimeout);	// a send blocked on a dead peer fails
+	timeval tv = { PING_INTERVAL_MS / 1000, PING_INTERVAL_MS % 1000 * 1000 };
+	::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);				// Run() pings when it times out
+}
+
+CMuxSession::~CMuxSession() {
+	::close(m_fd);
+}
+
+size_t CMuxSession::StreamCount() {
+	lock_guard<mutex> lk(m_mtx);
+	return m_streams.size();
+}
+
+void CMuxSession::Close() {
+	m_bDead = true;
+	::shutdown(m_fd, SHUT_RDWR);						// wakes Run()
+}
+
+void CMuxSession::Remove(uint32_t id) {
+	lock_guard<mutex> lk(m_mtx);
+	m_streams.erase(id);
+}
+
+void CMuxSession::Send(MuxFrameType typ, uint32_t id, const void *p, size_t size) {
+	uint8_t hdr[HEADER_SIZE] = { uint8_t(typ), 0, uint8_t(size >> 8), uint8_t(size) };
+	StoreBE32(hdr + 4, id);
+	SendVector v;
+	v.Add(hdr, sizeof hdr);
+	v.Add(p, size);
+	lock_guard<mutex> lk(m_mtxSend);
+	if (m_bDead)
+		Throw(errc::connection_reset);
+	try {
+		v.Send(m_fd);
+	} catch (RCExc) {
+		Close();
+		throw;
+	}
+}
+
+bool CMuxSession::TrySend(MuxFrameType typ) {
+	uint8_t hdr[HEADER_SIZE] = { uint8_t(typ) };
+	unique_lock<mutex> lk(m_mtxSend, try_to_lock);
+	if (!lk || m_bDead)
+		return false;											// another thread is sending: the connection is in use anyway
+	ssize_t n = ::send(m_fd, hdr, sizeof hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n > 0 && size_t(n) < sizeof hdr) {						// never leave a torn frame: the rest of 8 bytes fits soon
+		SendVector v;
+		v.Add(hdr + n, sizeof hdr - n);
+		try {
+			v.Send(m_fd);
+		} catch (RCExc) {
+			Close();
+			return false;
+		}
+	}
+	return n > 0;
+}
+
+shared_ptr<CMuxStream> CMuxSession::Open(const ProxyEndPoint& target, const ProxyEndPoint& client) {
+	shared_ptr<CMuxStream> s;
+	{
+		lock_guard<mutex> lk(m_mtx);
+		s = make_shared<CMuxStream>(shared_from_this(), m_nextId++);
+		s->Target = target;
+		s->Client = client;
+		m_streams[s->Id] = s;
+	}
+	string payload;
+	AppendEndPoint(payload, target);
+	AppendEndPoint(payload, client);
+	try {
+		Send(MuxFrameType::Open, s->Id, payload.data(), payload.size());
+	} catch (RCExc) {
+		Remove(s->Id);
+		throw;
+	}
+	return s;
+}
+
+bool CMuxSession::OnFrame(MuxFrameType typ, uint32_t id, const uint8_t *p, size_t size) {
+	const uint8_t *e = p + size;
+	if (!m_bAuthenticated)
+		return m_bAuthenticated = typ == MuxFrameType::Hello && !m_secret.empty() && SecretEquals(m_secret, p, size);
+	switch (typ) {
+	case MuxFrameType::Hello:
+		return false;
+	case MuxFrameType::Ping:
+		TrySend(MuxFrameType::Pong);
+		return true;
+	case MuxFrameType::Pong:
+		return true;
+	default:
+		break;
+	}
+	if (typ == MuxFrameType::Open) {
+		if (!m_onOpen)
+			return false;
+		auto s = make_shared<CMuxStream>(shared_from_this(), id);
+		if (!ParseEndPoint(p, e, s->Target) || !ParseEndPoint(p, e, s->Client))
+			return false;
+		{
+			lock_guard<mutex> lk(m_mtx);
+			if (!m_streams.emplace(id, s).second)
+				return false;
+		}
+		m_onOpen(s);
+		return true;
+	}
+	shared_ptr<CMuxStream> s;
+	{
+		lock_guard<mutex> lk(m_mtx);
+		auto it = m_streams.find(id);
+		if (it == m_streams.end())
+			return true;								// late frame of a closed stream
+		s = it->second;
+		if (typ == MuxFrameType::Reset)
+			m_streams.erase(it);
+	}
+	lock_guard<mutex> lk(s->m_mtx);
+	switch (typ) {
+	case MuxFrameType::Reply:
+		if (size < 4 || s->m_bReplied)
+			return false;
+		s->m_ec = error_code(int(LoadBE32(p)), system_category());
+		p += 4;
+		if (!ParseEndPoint(p, e, s->Bound))
+			return false;
+		s->m_bReplied = true;
+		break;
+	case MuxFrameType::Data:
+		if (s->m_rx.size() - s->m_rxPos + s->m_consumed + size > CMuxStream::WINDOW)
+			return false;
+		if (s->m_rxPos >= CMuxStream::WINDOW) {
+			s->m_rx.erase(0, s->m_rxPos);
+			s->m_rxPos = 0;
+		}
+		s->m_rx.append((const char*)p, size);
+		break;
+	case MuxFrameType::Window:
+		if (size < 4)
+			return false;
+		s->m_sendWindow += LoadBE32(p);
+		break;
+	case MuxFrameType::Fin:
+		s->m_bRemoteFin = true;
+		break;
+	case MuxFrameType::Reset:
+		s->m_bReset = true;
+		break;
+	default:
+		return false;
+	}
+	s->Notify();
+	return true;
+}
+
+void CMuxSession::Run() {
+	uint8_t buf[HEADER_SIZE + MAX_PAYLOAD];
+	for (bool bPinged = false;;) {
+		bool bIdle = false;
+		if (!RecvAll(m_fd, buf, HEADER_SIZE, &bIdle)) {
+			if (!bIdle || bPinged)								// nothing for two intervals, the Ping unanswered: the peer is gone
+				break;
+			bPinged = TrySend(MuxFrameType::Ping);
+			continue;
+		}
+		bPinged = false;
+		size_t size = size_t(buf[2] << 8 | buf[3]);
+		if (size > MAX_PAYLOAD || !RecvAll(m_fd, buf + HEADER_SIZE, size)
+			|| !OnFrame(MuxFrameType(buf[0]), LoadBE32(buf + 4), buf + HEADER_SIZE, size))
+			break;
+	}
+	Close();
+	unordered_map<uint32_t, shared_ptr<CMuxStream>> streams;
+	{
+		lock_guard<mutex> lk(m_mtx);
+		streams.swap(m_streams);
+	}
+	for (auto& kv : streams) {
+		lock_guard<mutex> lk(kv.second->m_mtx);
+		kv.second->m_bReset = true;
+		kv.second->Notify();
+	}
+}
+
+namespace {
+
+class CMuxReaderThread : public Thread {
+	typedef Thread base;
+public:
+	CMuxReaderThread(thread_group *tg, const shared_ptr<CMuxSession>& session)
+		: base(tg)
+		, m_session(session)
+	{}
+
+	void Stop() override {
+		base::Stop();
+		m_session->Close();
+	}
+protected:
+	void Execute() override {
+		m_session->Run();
+	}
+private:
+	shared_ptr<CMuxSession> m_session;
+};
+
+} // anonymous::
+
+CMuxClient::CMuxClient(thread_group *tg, const ProxyEndPoint& peer, int sessions)
+	: Opened(0)
+	, Reconnects(0)
+	, Mark(0)
+	, m_tg(tg)
+	, m_peer(peer)
+	, m_next(0)
+{
+	for (int i = 0; i < (max)(sessions, 1); ++i)
+		m_slots.push_back(make_unique<Slot>());
+}
+
+CMuxClient::~CMuxClient() {
+	for (auto& slot : m_slots)
+		if (slot->Session)
+			slot->Session->Close();
+}
+
+void CMuxClient::SetSecret(const string& secret) {
+	lock_guard<mutex> lk(m_mtxSecret);
+	m_secret = secret;
+}
+
+shared_ptr<CMuxSession> CMuxClient::Connect(int timeoutMs) {
+	sockaddr_storage ss;
+	socklen_t len;
+	if (m_peer.IsIP())
+		len = m_peer.ToSockAddr(ss);
+	else {
+		addrinfo hints = addrinfo(), *ai;
+		hints.ai_socktype = SOCK_STREAM;
+		if (int r = ::getaddrinfo(m_peer.HostName, to_string(m_peer.Port).c_str(), &hints, &ai))
+			throw system_error(make_error_code(r == EAI_NONAME ? errc::host_unreachable : errc::resource_unavailable_try_again));
+		memcpy(&ss, ai->ai_addr, len = ai->ai_addrlen);
+		::freeaddrinfo(ai);
+	}
+	int fd = CCheck(::socket(ss.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, IPPROTO_TCP));
+	if (Mark)
+		::setsockopt(fd, SOL_SOCKET, SO_MARK, &Mark, sizeof Mark);
+	int err = ::connect(fd, (const sockaddr*)&ss, len) < 0 ? errno : 0;
+	if (err == EINPROGRESS) {
+		pollfd pfd = { fd, POLLOUT, 0 };
+		socklen_t errLen = sizeof err;
+		err = ::poll(&pfd, 1, timeoutMs) <= 0 ? ETIMEDOUT
+			: ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0 ? errno : err;
+	}
+	if (err) {
+		::close(fd);
+		throw system_error(error_code(err, system_category()));
+	}
+	::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) & ~O_NONBLOCK);		// sessions use blocking I/O
+	auto session = make_shared<CMuxSession>(fd);
+	string secret;
+	{
+		lock_guard<mutex> lk(m_mtxSecret);
+		secret = m_secret;
+	}
+	session->Send(MuxFrameType::Hello, 0, secret.data(), secret.size());
+	ptr<CMuxReaderThread> t = new CMuxReaderThread(m_tg, session);
+	t->Start();
+	return session;
+}
+
+shared_ptr<CMuxSession> CMuxClient::SessionOf(Slot& slot, int timeoutMs) {
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+	unique_lock<mutex> lk(slot.Mtx);
+	while (!slot.Session || !slot.Session->IsAlive()) {
+		if (slot.Connecting) {							// tunnels of this slot wait for its connect instead of racing it
+			if (slot.Cv.wait_until(lk, deadline) == cv_status::timeout)
+				throw system_error(make_error_code(errc::timed_out));
+			continue;
+		}
+		slot.Connecting = true;
+		bool bReconnect = bool(slot.Session);
+		lk.unlock();
+		shared_ptr<CMuxSession> session;
+		error_code ec;
+		try {
+			session = Connect((max)(int(chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count()), 0));
+		} catch (const system_error& ex) {
+			ec = ex.code();
+		}
+		lk.lock();
+		slot.Connecting = false;
+		slot.Cv.notify_all();
+		if (ec)
+			throw system_error(ec);
+		if (bReconnect)
+			++Reconnects;
+		slot.Session = session;
+	}
+	return slot.Session;
+}
+
+shared_ptr<CMuxStream> CMuxClient::Open(const ProxyEndPoint& target, const ProxyEndPoint& client, int timeoutMs) {
+	if (!timeoutMs)
+		timeoutMs = 60000;
+	shared_ptr<CMuxSession> session = SessionOf(*m_slots[m_next++ % m_slots.size()], timeoutMs);
+	auto s = session->Open(target, client);
+	s->WaitReply(timeoutMs);
+	++Opened;
+	return s;
+}
+
+}} // Ext::Inet::
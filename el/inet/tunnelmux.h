@@ -0,0 +1,156 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include "proxy.h"
+
+namespace Ext {
+	namespace Inet {
+
+// Tunnels between socksd instances multiplexed over a few persistent TCP connections. The edge opens a stream per tunnel with
+// the target in it, the peer connects and replies: one round trip on a warm connection instead of a TCP handshake, the proxy
+// handshake and slow start per tunnel.
+//
+// Frame: type(8) flags(8) length(16) stream(32), big endian, then length bytes of payload.
+//	Open	target and client endpoints					edge -> peer
+//	Reply	error value(32) and bound endpoint				peer -> edge
+//	Data	tunnel bytes, at most the receiver's window
+//	Window	window increment(32)
+//	Fin		no more Data in this direction
+//	Reset	the stream is gone
+//	Hello	the shared secret, stream 0							edge -> peer, first frame: the peer drops the connection
+//																on anything else
+//	Ping	stream 0, answered by Pong. Sent by either side after PING_INTERVAL_MS without a frame; a session that receives
+//			nothing for another interval is dead
+// Each direction of a stream starts with WINDOW bytes of credit, so a stalled tunnel stops its own sender and never the
+// connection. The reader thread of a session only queues: it never blocks on a send, so two sessions can't deadlock on full
+// buffers. Its Ping and Pong are skipped when they don't fit, frames already queued prove the connection alive as well
+ENUM_CLASS(MuxFrameType) {
+	Open
+	, Reply
+	, Data
+	, Window
+	, Fin
+	, Reset
+	, Hello
+	, Ping
+	, Pong
+} END_ENUM_CLASS(MuxFrameType);
+
+class CMuxSession;
+
+class CMuxStream {
+public:
+	static const uint32_t WINDOW = 256 * 1024;
+
+	const uint32_t Id;
+	ProxyEndPoint Target, Client;					// from Open
+	ProxyEndPoint Bound;							// from Reply
+
+	CMuxStream(const shared_ptr<CMuxSession>& session, uint32_t id);
+	~CMuxStream();
+
+	// Edge: waits for Reply, throws the error of the peer's connect
+	void WaitReply(int timeoutMs);
+
+	// Peer: answers Open
+	void SendReply(const ProxyEndPoint& bound, const error_code& ec);
+
+	// Blocks while the window is closed. Throws errc::connection_reset if the stream is gone
+	void Write(const void *p, size_t size);
+	void Write(RCSpan s) { Write(s.data(), s.size()); }
+
+	// Pumps a connected socket through the stream until both directions are finished, either side fails or bStop.
+	// Returns bytes socket -> stream, stream -> socket. The stream is closed on return
+	pair<uint64_t, uint64_t> Relay(int fd, const volatile bool& bStop);
+
+	void Reset();
+private:
+	const shared_ptr<CMuxSession> m_session;		// the session's map holds the stream until it is closed
+	mutex m_mtx;
+	string m_rx;									// received, not yet written to the socket
+	size_t m_rxPos;
+	uint32_t m_sendWindow, m_consumed;
+	error_code m_ec;
+	bool m_bReplied, m_bRemoteFin, m_bReset;
+	int m_evfd;										// readable on any change of the above
+
+	void Notify();
+
+	friend class CMuxSession;
+};
+
+// One TCP connection. The edge side opens streams, the peer side gets them through onOpen, called on the reader thread
+class CMuxSession : public enable_shared_from_this<CMuxSession> {
+public:
+	typedef function<void(const shared_ptr<CMuxStream>&)> OpenHandler;
+
+	static const size_t MAX_PAYLOAD = 16384;
+	static const int PING_INTERVAL_MS = 10000;
+
+	// The peer side passes onOpen and the secret its edges have to send
+	CMuxSession(int fd, OpenHandler onOpen = nullptr, const string& secret = string());
+	~CMuxSession();
+
+	bool IsAlive() const { return !m_bDead; }
+	size_t StreamCount();
+
+	shared_ptr<CMuxStream> Open(const ProxyEndPoint& target, const ProxyEndPoint& client);
+
+	// Reads frames until the connection fails or Close() is called, then resets all streams
+	void Run();
+	void Close();
+
+	void Send(MuxFrameType typ, uint32_t id, const void *p = nullptr, size_t size = 0);		// thread-safe, throws on errors
+	void Remove(uint32_t id);
+private:
+	const int m_fd;
+	const OpenHandler m_onOpen;
+	const string m_secret;
+	mutex m_mtx, m_mtxSend;
+	unordered_map<uint32_t, shared_ptr<CMuxStream>> m_streams;
+	uint32_t m_nextId;
+	atomic<bool> m_bDead;
+	bool m_bAuthenticated;							// reader thread only
+
+	bool OnFrame(MuxFrameType typ, uint32_t id, const uint8_t *p, size_t size);		// false on a protocol violation
+	bool TrySend(MuxFrameType typ);					// header-only frame of stream 0, false if it would block
+};
+
+// Edge side: a fixed number of sessions to one peer, connected on first use and again after they fail. Tunnels are spread round robin
+class CMuxClient {
+public:
+	atomic<uint64_t> Opened, Reconnects;
+	uint32_t Mark;									// SO_MARK of the sessions' sockets, 0 - none
+
+	CMuxClient(thread_group *tg, const ProxyEndPoint& peer, int sessions = 4);
+	~CMuxClient();
+
+	void SetSecret(const string& secret);			// for the sessions connected from now on
+
+	// Throws the peer's connect error, or errc::timed_out. timeoutMs also bounds connecting the session, 0 - 60 s
+	shared_ptr<CMuxStream> Open(const ProxyEndPoint& target, const ProxyEndPoint& client, int timeoutMs);
+private:
+	struct Slot {
+		mutex Mtx;
+		condition_variable Cv;						// the connect of Session is over
+		shared_ptr<CMuxSession> Session;
+		bool Connecting = false;
+	};
+
+	thread_group *m_tg;
+	const ProxyEndPoint m_peer;
+	vector<unique_ptr<Slot>> m_slots;
+	atomic<unsigned> m_next;
+	mutex m_mtxSecret;
+	string m_secret;
+
+	// The slot's session, connected by the first tunnel to find it dead, outside the lock: the others wait for it
+	shared_ptr<CMuxSession> SessionOf(Slot& slot, int timeoutMs);
+	shared_ptr<CMuxSession> Connect(int timeoutMs);
+};
+
+}} // Ext::Inet::
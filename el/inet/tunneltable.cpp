@@ -0,0 +1,281 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "tunneltable.h"
+#include "accesslog.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+namespace Ext {
+	namespace Inet {
+
+static const char * const s_stateNames[] = { "handshake", "connect", "relay" };
+static const ProxyEndPoint s_epNone;
+
+CTunnelEntry::CTunnelEntry(observer_ptr<CTunnelTable> table, int fdClient)
+	: m_table(table)
+	, m_prev(nullptr)
+	, m_next(nullptr)
+	, m_id(0)
+	, m_state(TunnelState::Handshake)
+	, m_client(&s_epNone)
+	, m_target(&s_epNone)
+	, m_fdClient(fdClient)
+	, m_fdTarget(-1)
+{
+	if (!m_table)
+		return;
+	m_id = m_table->m_nextId.fetch_add(1, memory_order_relaxed);
+	m_start = chrono::steady_clock::now();
+	CTunnelTable::Shard& shard = m_table->ShardOf(*this);
+	lock_guard<mutex> lk(shard.Mtx);
+	if ((m_next = shard.Head))
+		m_next->m_prev = this;
+	shard.Head = this;
+	shard.Count.fetch_add(1, memory_order_relaxed);
+}
+
+void CTunnelEntry::Unregister() {
+	if (!m_table)
+		return;
+	CTunnelTable::Shard& shard = m_table->ShardOf(*this);
+	{
+		lock_guard<mutex> lk(shard.Mtx);
+		(m_prev ? m_prev->m_next : shard.Head) = m_next;
+		if (m_next)
+			m_next->m_prev = m_prev;
+		shard.Count.fetch_sub(1, memory_order_relaxed);
+	}
+	m_table = nullptr;
+}
+
+void CTunnelEntry::Describe(const ProxyEndPoint& client, const ProxyEndPoint& target) {
+	if (!m_table)
+		return;
+	lock_guard<mutex> lk(m_table->ShardOf(*this).Mtx);
+	m_client = &client;
+	m_target = &target;
+}
+
+void CTunnelEntry::SetState(TunnelState state, int fdTarget) {
+	if (!m_table)
+		return;
+	lock_guard<mutex> lk(m_table->ShardOf(*this).Mtx);
+	m_state = state;
+	if (fdTarget >= 0)
+		m_fdTarget = fdTarget;
+}
+
+void TunnelFilter::Parse(const vector<string>& args) {
+	for (auto& a : args) {
+		size_t eq = a.find('=');
+		if (eq == string::npos)
+			Throw(errc::invalid_argument);
+		string key = a.substr(0, eq), val = a.substr(eq + 1);
+		if (key == "id")
+			Id = stoull(val);
+		else if (key == "client")
+			Client.push_back(ProxyRoute::Parse(val));
+		else if (key == "target")
+			Target.push_back(ProxyRoute::Parse(val));
+		else if (key == "age")
+			MinAgeMs = int(stod(val) * 1000);
+		else if (key == "state") {
+			auto it = find_if(begin(s_stateNames), end(s_stateNames), [&val](const char *name) { return val == name; });
+			if (it == end(s_stateNames))
+				Throw(errc::invalid_argument);
+			State = int(it - begin(s_stateNames));
+		} else
+			Throw(errc::invalid_argument);
+	}
+}
+
+CTunnelTable::CTunnelTable()
+	: m_nextId(1)
+{}
+
+size_t CTunnelTable::Count() const {
+	size_t r = 0;
+	for (auto& shard : m_shards)
+		r += shard.Count.load(memory_order_relaxed);
+	return r;
+}
+
+static bool MatchesAny(const vector<ProxyRoute>& routes, const ProxyEndPoint& ep) {
+	if (routes.empty())
+		return true;
+	for (auto& r : routes)
+		if (r.Matches(ep))
+			return true;
+	return false;
+}
+
+bool CTunnelTable::Matches(const CTunnelEntry& e, const TunnelFilter& filter, chrono::steady_clock::time_point now) const {
+	return (!filter.Id || e.m_id == filter.Id)
+		&& (filter.State < 0 || int(e.m_state) == filter.State)
+		&& now - e.m_start >= chrono::milliseconds(filter.MinAgeMs)
+		&& MatchesAny(filter.Client, *e.m_client)
+		&& MatchesAny(filter.Target, *e.m_target);
+}
+
+// Only the fields and the endpoints' JSON are copied under the shard lock, TCP_INFO is read after it is released.
+// The entry may end meanwhile and its descriptor be reused: then the counters are another socket's, nothing is written to it
+void CTunnelTable::List(const TunnelFilter& filter, string& s) {
+	struct Row {
+		uint64_t Id;
+		TunnelState State;
+		chrono::steady_clock::time_point Start;
+		int FdClient, FdTarget;
+		string Client, Target;
+	};
+	auto now = chrono::steady_clock::now();
+	vector<Row> rows;
+	for (auto& shard : m_shards) {
+		lock_guard<mutex> lk(shard.Mtx);
+		for (CTunnelEntry *e = shard.Head; e; e = e->m_next) {
+			if (!Matches(*e, filter, now))
+				continue;
+			Row row = { e->m_id, e->m_state, e->m_start, e->m_fdClient, e->m_fdTarget };
+			AppendJsonEndPoint(row.Client, *e->m_client);			// the endpoints live in the entry owner's frame
+			AppendJsonEndPoint(row.Target, *e->m_target);
+			rows.push_back(std::move(row));
+		}
+	}
+	for (auto& row : rows) {
+		uint64_t up = 0, down = 0;
+		if (row.FdTarget >= 0)
+			GetTcpBytes(row.FdTarget, up, down);
+		else if (row.State == TunnelState::Relay && row.FdClient >= 0)		// multiplexed: no target socket here
+			GetTcpBytes(row.FdClient, down, up);
+		char buf[128];
+		snprintf(buf, sizeof buf, "{\"id\":%llu,\"state\":\"%s\",\"age_ms\":%lld,\"client\":", (unsigned long long)row.Id, s_stateNames[(int)row.State]
+			, (long long)chrono::duration_cast<chrono::milliseconds>(now - row.Start).count());
+		s += buf;
+		s += row.Client;
+		s += ",\"target\":";
+		s += row.Target;
+		snprintf(buf, sizeof buf, ",\"bytes_up\":%llu,\"bytes_down\":%llu}\n", (unsigned long long)up, (unsigned long long)down);
+		s += buf;
+	}
+}
+
+// Descriptors are dup()ed under the shard lock: one closed by its tunnel before the shutdown() cannot have been reused by
+// an unrelated socket. shutdown() of a duplicate ends the connection itself
+size_t CTunnelTable::Kill(const TunnelFilter& filter) {
+	auto now = chrono::steady_clock::now();
+	size_t r = 0;
+	vector<int> fds;
+	for (auto& shard : m_shards) {
+		lock_guard<mutex> lk(shard.Mtx);
+		for (CTunnelEntry *e = shard.Head; e; e = e->m_next) {
+			if (!Matches(*e, filter, now))
+				continue;
+			for (int fd : { e->m_fdClient, e->m_fdTarget })
+				if (fd >= 0) {
+					int dup = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+					if (dup >= 0)
+						fds.push_back(dup);
+				}
+			++r;
+		}
+	}
+	for (int fd : fds) {
+		::shutdown(fd, SHUT_RDWR);
+		::close(fd);
+	}
+	return r;
+}
+
+CTunnelAdmin::CTunnelAdmin(thread_group *tg, CTunnelTable& table, RCString path)
+	: base(tg)
+	, m_table(table)
+	, m_path(path)
+	, m_fd(CCheck(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)))
+{
+	sockaddr_un sa = {};
+	sa.sun_family = AF_UNIX;
+	if (strlen(m_path.c_str()) >= sizeof sa.sun_path) {
+		::close(m_fd);
+		Throw(errc::filename_too_long);
+	}
+	strcpy(sa.sun_path, m_path.c_str());
+	::unlink(sa.sun_path);										// left by a previous run
+	mode_t mask = ::umask(0177);
+	int r = ::bind(m_fd, (const sockaddr*)&sa, sizeof sa);
+	::umask(mask);
+	if (r < 0 || ::listen(m_fd, 16) < 0) {
+		int err = errno;
+		::close(m_fd);
+		Throw(error_code(err, system_category()));
+	}
+}
+
+CTunnelAdmin::~CTunnelAdmin() {
+	::close(m_fd);
+	::unlink(m_path.c_str());
+}
+
+void CTunnelAdmin::Stop() {
+	base::Stop();
+	::shutdown(m_fd, SHUT_RDWR);								// wakes the blocked accept()
+}
+
+string CTunnelAdmin::Command(const string& line) {
+	istringstream is(line);
+	string cmd;
+	is >> cmd;
+	vector<string> args;
+	for (string w; is >> w;)
+		args.push_back(w);
+	TunnelFilter filter;
+	try {
+		filter.Parse(args);
+	} catch (const exception&) {
+		return "{\"error\":\"bad filter\"}\n";
+	}
+	string s;
+	if (cmd == "list")
+		m_table.List(filter, s);
+	else if (cmd == "kill" && !args.empty())
+		s = "{\"killed\":" + to_string(m_table.Kill(filter)) + "}\n";
+	else if (cmd == "count")
+		s = "{\"tunnels\":" + to_string(m_table.Count()) + "}\n";
+	else if (cmd == "stats" && Stats)
+		s = Stats() + "\n";
+	else
+		s = "{\"error\":\"commands: list [filter], kill filter, count, stats\"}\n";
+	return s;
+}
+
+void CTunnelAdmin::Execute() {
+	while (!m_bStop) {
+		int fd = ::accept4(m_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+		timeval tv = { 5, 0 };									// a silent client does not block the admin socket for long
+		::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+		string line;
+		char buf[512];
+		for (ssize_t n; line.find('\n') == string::npos && line.size() < 4096 && (n = ::recv(fd, buf, sizeof buf, 0)) > 0;)
+			line.append(buf, n);
+		string reply = Command(line.substr(0, line.find_first_of("\r\n")));
+		for (size_t off = 0; off < reply.size();) {
+			ssize_t n = ::send(fd, reply.data() + off, reply.size() - off, MSG_NOSIGNAL);
+			if (n <= 0)
+				break;
+			off += n;
+		}
+		::close(fd);
+	}
+}
+
+}} // Ext::Inet::
@@ -0,0 +1,120 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include "proxyconfig.h"
+
+namespace Ext {
+	namespace Inet {
+
+ENUM_CLASS(TunnelState) {
+	Handshake
+	, Connect
+	, Relay
+} END_ENUM_CLASS(TunnelState);
+
+class CTunnelTable;
+
+// One live tunnel, registered for the life of this object, which lives in the thread or coroutine frame serving the tunnel.
+// Its descriptors must stay open until it is destroyed: Kill() shuts them down. A no-op without a table
+class CTunnelEntry {
+public:
+	CTunnelEntry(observer_ptr<CTunnelTable> table, int fdClient);
+	~CTunnelEntry() { Unregister(); }
+
+	void Describe(const ProxyEndPoint& client, const ProxyEndPoint& target);		// not copied: both must outlive the entry unchanged
+	void SetState(TunnelState state, int fdTarget = -1);
+	void Unregister();								// early, before the descriptors are handed to someone who closes them
+	explicit operator bool() const { return m_table != nullptr; }
+private:
+	observer_ptr<CTunnelTable> m_table;
+	CTunnelEntry *m_prev, *m_next;
+	uint64_t m_id;
+	chrono::steady_clock::time_point m_start;
+	TunnelState m_state;
+	const ProxyEndPoint *m_client, *m_target;		// the access record's, an empty one until described
+	int m_fdClient, m_fdTarget;						// bytes are read from the target socket, from the client one if there is none
+
+	CTunnelEntry(const CTunnelEntry&) = delete;
+	CTunnelEntry& operator=(const CTunnelEntry&) = delete;
+
+	friend class CTunnelTable;
+};
+
+// Selects tunnels for List() and Kill(): all given conditions must hold
+struct TunnelFilter {
+	uint64_t Id;									// 0 - any
+	vector<ProxyRoute> Client, Target;				// any of, empty - any
+	int State;										// TunnelState, -1 - any
+	int MinAgeMs;
+
+	TunnelFilter()
+		: Id(0)
+		, State(-1)
+		, MinAgeMs(0)
+	{}
+
+	// "id=n client=pattern target=pattern state=handshake|connect|relay age=seconds", patterns as in allow/deny.
+	// Throws errc::invalid_argument
+	void Parse(const vector<string>& args);
+};
+
+// Live tunnels, sharded by ID: a tunnel takes only its own shard's lock, for a few stores, so registration on the accept path
+// does not contend. Readers hold one shard's lock at a time, only to copy the matching entries: the socket calls come after
+class CTunnelTable {
+public:
+	static const size_t SHARDS = 64;
+
+	CTunnelTable();
+
+	size_t Count() const;
+
+	// One JSON object per line: id, state, age_ms, client, target, bytes_up, bytes_down
+	void List(const TunnelFilter& filter, string& s);
+
+	// shutdown() of both sockets: the relay loop, splice, sockmap wait or coroutine ends as on a reset. Returns the count
+	size_t Kill(const TunnelFilter& filter);
+private:
+	struct alignas(64) Shard {
+		mutex Mtx;
+		CTunnelEntry *Head = nullptr;
+		atomic<size_t> Count { 0 };					// read without the lock
+	};
+
+	Shard m_shards[SHARDS];
+	atomic<uint64_t> m_nextId;
+
+	Shard& ShardOf(const CTunnelEntry& e) { return m_shards[e.m_id % SHARDS]; }
+	bool Matches(const CTunnelEntry& e, const TunnelFilter& filter, chrono::steady_clock::time_point now) const;
+
+	friend class CTunnelEntry;
+};
+
+// Local admin socket (Unix domain, mode 0600): one command per line, the answer ends with the connection.
+//	list [filter]		one JSON line per tunnel
+//	kill filter			{"killed":n}, at least one condition is required
+//	count				{"tunnels":n}
+//	stats				what Stats returns, one JSON line
+class CTunnelAdmin : public Thread {
+	typedef Thread base;
+public:
+	function<string()> Stats;						// counters of the daemon's other parts, set before Start()
+
+	CTunnelAdmin(thread_group *tg, CTunnelTable& table, RCString path);
+	~CTunnelAdmin();
+
+	void Stop() override;
+protected:
+	void Execute() override;
+private:
+	CTunnelTable& m_table;
+	const String m_path;
+	int m_fd;
+
+	string Command(const string& line);
+};
+
+}} // Ext::Inet::
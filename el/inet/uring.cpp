@@ -0,0 +1,511 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "uring.h"
+
+#if HAVE_LINUX_IO_URING_H
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace Ext {
+	namespace Inet {
+
+static int sys_io_uring_setup(unsigned entries, io_uring_params *p) {
+	return (int)::syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+	return (int)::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned op, void *arg, unsigned nr) {
+	return (int)::syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+static void *MapRing(size_t size, int fd, off_t off) {
+	void *p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, off);
+	if (p == MAP_FAILED)
+		CCheck(-1);
+	return p;
+}
+
+IoUring::IoUring(unsigned entries, unsigned flags)
+	: m_fd(-1)
+	, m_sqes((io_uring_sqe*)MAP_FAILED)
+	, m_sqRing(MAP_FAILED)
+	, m_cqRing(MAP_FAILED)
+	, m_toSubmit(0)
+{
+	io_uring_params p = {};
+	p.flags = flags;
+	m_fd = CCheck(sys_io_uring_setup(entries, &p));
+	m_features = p.features;
+	m_sqEntries = p.sq_entries;
+	m_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	m_cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	m_sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+	if (m_features & IORING_FEAT_SINGLE_MMAP)
+		m_sqRingSize = m_cqRingSize = (max)(m_sqRingSize, m_cqRingSize);
+	try {
+		m_sqRing = MapRing(m_sqRingSize, m_fd, IORING_OFF_SQ_RING);
+		m_cqRing = (m_features & IORING_FEAT_SINGLE_MMAP) ? m_sqRing : MapRing(m_cqRingSize, m_fd, IORING_OFF_CQ_RING);
+		m_sqes = (io_uring_sqe*)MapRing(m_sqesSize, m_fd, IORING_OFF_SQES);
+	} catch (RCExc) {
+		Close();
+		throw;
+	}
+	uint8_t *sq = (uint8_t*)m_sqRing, *cq = (uint8_t*)m_cqRing;
+	m_sqHead = (unsigned*)(sq + p.sq_off.head);
+	m_sqTail = (unsigned*)(sq + p.sq_off.tail);
+	m_sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+	m_sqArray = (unsigned*)(sq + p.sq_off.array);
+	m_cqHead = (unsigned*)(cq + p.cq_off.head);
+	m_cqTail = (unsigned*)(cq + p.cq_off.tail);
+	m_cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+	m_cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+	m_sqLocalTail = *m_sqTail;
+}
+
+IoUring::~IoUring() {
+	Close();
+}
+
+void IoUring::Close() {
+	if (m_sqes != MAP_FAILED)
+		::munmap(m_sqes, m_sqesSize);
+	if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+		::munmap(m_cqRing, m_cqRingSize);
+	if (m_sqRing != MAP_FAILED)
+		::munmap(m_sqRing, m_sqRingSize);
+	m_sqes = (io_uring_sqe*)MAP_FAILED;
+	m_cqRing = m_sqRing = MAP_FAILED;
+	if (m_fd >= 0)
+		::close(exchange(m_fd, -1));
+}
+
+bool IoUring::IsSupported() {
+	try {
+		IoUring ring(8);
+		io_uring_buf_ring *br = ring.RegisterBufRing(0, 8);		// provided buffer rings and multishot accept both appeared in 5.19
+		ring.UnregisterBufRing(0, br, 8);
+		return true;
+	} catch (const system_error& ex) {
+		TRC(1, "io_uring is not available: " << ex.what());
+		return false;
+	}
+}
+
+bool IoUring::SqFull() const {
+	return m_sqLocalTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries;
+}
+
+io_uring_sqe *IoUring::GetSqe() {
+	if (m_spill.empty() && SqFull())
+		Submit();
+	if (!m_spill.empty() || SqFull()) {			// the kernel took none, its CQ ring overflows: keep the order, wait for the next Submit
+		m_spill.emplace_back();
+		return &m_spill.back();
+	}
+	unsigned idx = m_sqLocalTail++ & *m_sqMask;
+	io_uring_sqe *sqe = &m_sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	m_sqArray[idx] = idx;
+	++m_toSubmit;
+	return sqe;
+}
+
+int IoUring::Submit(unsigned waitNr) {
+	for (; !m_spill.empty() && !SqFull(); m_spill.pop_front()) {
+		unsigned idx = m_sqLocalTail++ & *m_sqMask;
+		m_sqes[idx] = m_spill.front();
+		m_sqArray[idx] = idx;
+		++m_toSubmit;
+	}
+	// Link chains go in whole: the kernel would run the head of a chain cut at the tail unlinked
+	unsigned tail = m_sqLocalTail, toSubmit = m_toSubmit;
+	for (; toSubmit && (m_sqes[(tail - 1) & *m_sqMask].flags & IOSQE_IO_LINK); --toSubmit)
+		--tail;
+	__atomic_store_n(m_sqTail, tail, __ATOMIC_RELEASE);
+	int r;
+	while ((r = sys_io_uring_enter(m_fd, toSubmit, waitNr, waitNr ? IORING_ENTER_GETEVENTS : 0)) < 0) {
+		switch (errno) {
+		case EINTR:
+			continue;
+		case EAGAIN:
+		case EBUSY:				// CQ ring is full, caller has to reap completions first
+			return 0;
+		}
+		CCheck(-1);
+	}
+	m_toSubmit -= (min)(unsigned(r), toSubmit);
+	return r;
+}
+
+io_uring_cqe *IoUring::PeekCqe() {
+	unsigned head = *m_cqHead;
+	return head == __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE) ? nullptr : &m_cqes[head & *m_cqMask];
+}
+
+void IoUring::CqeSeen() {
+	__atomic_store_n(m_cqHead, *m_cqHead + 1, __ATOMIC_RELEASE);
+}
+
+io_uring_buf_ring *IoUring::RegisterBufRing(uint16_t bgid, unsigned entries) {
+	size_t size = entries * sizeof(io_uring_buf);
+	void *p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (p == MAP_FAILED)
+		CCheck(-1);
+	io_uring_buf_reg reg = {};
+	reg.ring_addr = (uintptr_t)p;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+	if (sys_io_uring_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		int err = errno;
+		::munmap(p, size);
+		Throw(error_code(err, system_category()));
+	}
+	return (io_uring_buf_ring*)p;
+}
+
+void IoUring::UnregisterBufRing(uint16_t bgid, io_uring_buf_ring *br, unsigned entries) {
+	io_uring_buf_reg reg = {};
+	reg.bgid = bgid;
+	sys_io_uring_register(m_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	::munmap(br, entries * sizeof(io_uring_buf));
+}
+
+// user_data of every SQE is an 8-aligned pointer with the operation kind in the low 3 bits
+enum {
+	TAG_IGNORE,
+	TAG_WAKE,
+	TAG_ACCEPT,
+	TAG_CONNECT,
+	TAG_RECV,					// TAG_RECV + direction
+	TAG_SEND = TAG_RECV + 2,	// TAG_SEND + direction
+	TAG_MASK = 7
+};
+
+static const uint16_t BGID_RELAY = 0;
+
+static inline uint64_t Tag(const void *p, int tag) {
+	return uint64_t(uintptr_t(p)) | tag;
+}
+
+struct alignas(8) CUringEngine::UringListener {
+	int Fd;
+};
+
+struct alignas(8) CUringEngine::UringConnect {
+	AutoResetEvent Ev;
+	sockaddr_storage Sa;
+	socklen_t SaLen;
+	__kernel_timespec Timeout;
+	int Fd;
+	volatile int Res;
+	atomic<int> Ref;
+};
+
+// Direction i pumps Fd[i] -> Fd[1-i]
+struct alignas(8) CUringEngine::UringTunnel {
+	int Fd[2];
+	uint16_t Bid[2];
+	bool Done[2];
+	int Pending;
+	uint64_t Bytes[2];
+	function<void(uint64_t, uint64_t)> OnClose;
+};
+
+CUringEngine::CUringEngine(thread_group *tg)
+	: base(tg)
+	, m_ring(RING_ENTRIES)
+	, m_bufRing(nullptr)
+	, m_bufs(nullptr)
+	, m_evfd(-1)
+{
+	m_evfd = CCheck(::eventfd(0, EFD_CLOEXEC));
+	m_bufs = (uint8_t*)::mmap(nullptr, size_t(BUF_COUNT) * BUF_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (m_bufs == MAP_FAILED) {
+		::close(m_evfd);
+		CCheck(-1);
+	}
+	try {
+		m_bufRing = m_ring.RegisterBufRing(BGID_RELAY, BUF_COUNT);
+	} catch (RCExc) {
+		::munmap(m_bufs, size_t(BUF_COUNT) * BUF_SIZE);
+		::close(m_evfd);
+		throw;
+	}
+	for (unsigned i = 0; i < BUF_COUNT; ++i)
+		RecycleBuf(uint16_t(i));
+}
+
+CUringEngine::~CUringEngine() {
+	m_ring.UnregisterBufRing(BGID_RELAY, m_bufRing, BUF_COUNT);
+	::munmap(m_bufs, size_t(BUF_COUNT) * BUF_SIZE);
+	::close(m_evfd);
+}
+
+void CUringEngine::Stop() {
+	base::Stop();
+	Wake();
+}
+
+void CUringEngine::Post(function<void()> fn) {
+	{
+		lock_guard<mutex> lk(m_mtx);
+		m_pending.push_back(move(fn));
+	}
+	Wake();
+}
+
+void CUringEngine::Wake() {
+	uint64_t v = 1;
+	(void)::write(m_evfd, &v, sizeof v);
+}
+
+void CUringEngine::ArmWake() {
+	io_uring_sqe *sqe = m_ring.GetSqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = m_evfd;
+	sqe->addr = (uintptr_t)&m_evVal;
+	sqe->len = sizeof m_evVal;
+	sqe->user_data = TAG_WAKE;
+}
+
+void CUringEngine::ArmAccept(UringListener *li) {
+	io_uring_sqe *sqe = m_ring.GetSqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = li->Fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = Tag(li, TAG_ACCEPT);
+}
+
+void CUringEngine::AddListener(const IPEndPoint& ep) {
+	int s = CCheck(::socket(ep.c_sockaddr()->sa_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP));
+	int on = 1;
+	::setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+	if (::bind(s, ep.c_sockaddr(), socklen_t(ep.sockaddr_len())) < 0 || ::listen(s, SOMAXCONN) < 0) {
+		int err = errno;
+		::close(s);
+		Throw(error_code(err, system_category()));
+	}
+	Post([this, s] {
+		m_listeners.push_back(unique_ptr<UringListener>(new UringListener{ s }));
+		ArmAccept(m_listeners.back().get());
+	});
+}
+
+error_code CUringEngine::Connect(Socket& sock, const IPEndPoint& ep, int timeoutMs, int fd) {
+	UringConnect *c = new UringConnect;
+	c->SaLen = socklen_t(ep.sockaddr_len());
+	memcpy(&c->Sa, ep.c_sockaddr(), c->SaLen);
+	c->Timeout.tv_sec = timeoutMs / 1000;
+	c->Timeout.tv_nsec = (timeoutMs % 1000) * 1000000LL;
+	c->Res = -ETIMEDOUT;
+	c->Ref = 2;
+	if ((c->Fd = fd >= 0 ? fd : ::socket(c->Sa.ss_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP)) < 0) {
+		delete c;
+		CCheck(-1);
+	}
+	fd = c->Fd;
+	Post([this, c] {
+		io_uring_sqe *sqe = m_ring.GetSqe();
+		sqe->opcode = IORING_OP_CONNECT;
+		sqe->fd = c->Fd;
+		sqe->addr = (uintptr_t)&c->Sa;
+		sqe->off = c->SaLen;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = Tag(c, TAG_CONNECT);
+
+		sqe = m_ring.GetSqe();
+		sqe->opcode = IORING_OP_LINK_TIMEOUT;
+		sqe->addr = (uintptr_t)&c->Timeout;
+		sqe->len = 1;
+		sqe->user_data = TAG_IGNORE;
+	});
+	c->Ev.lock(timeoutMs + 1000);			// the ring may be stopped while we are waiting
+	int res = c->Res;
+	if (--c->Ref == 0)
+		delete c;
+	if (res < 0) {
+		::close(fd);
+		return error_code(res == -ECANCELED ? ETIMEDOUT : -res, generic_category());
+	}
+	sock.Attach(fd);
+	return error_code();
+}
+
+void CUringEngine::Relay(Socket& sockS, Socket& sockD, function<void(uint64_t, uint64_t)> onClose) {
+	UringTunnel *t = new UringTunnel;
+	t->Fd[0] = (int)sockS.Detach();
+	t->Fd[1] = (int)sockD.Detach();
+	t->Done[0] = t->Done[1] = false;
+	t->Pending = 0;
+	t->Bytes[0] = t->Bytes[1] = 0;
+	t->OnClose = move(onClose);
+	Post([this, t] {
+		m_tunnels.insert(t);
+		ArmRecv(t, 0);
+		ArmRecv(t, 1);
+	});
+}
+
+void CUringEngine::ArmRecv(UringTunnel *t, int i) {
+	io_uring_sqe *sqe = m_ring.GetSqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = t->Fd[i];
+	sqe->len = BUF_SIZE;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BGID_RELAY;
+	sqe->user_data = Tag(t, TAG_RECV + i);
+	++t->Pending;
+}
+
+void CUringEngine::RecycleBuf(uint16_t bid) {
+	uint16_t tail = m_bufRing->tail;
+	// not m_bufRing->bufs: in C++ the uapi flex array gets shifted by an empty struct member.
+	// Write fields one by one: bufs[0].resv overlays the tail
+	io_uring_buf& b = ((io_uring_buf*)m_bufRing)[tail & (BUF_COUNT - 1)];
+	b.addr = (uintptr_t)(m_bufs + size_t(bid) * BUF_SIZE);
+	b.len = BUF_SIZE;
+	b.bid = bid;
+	__atomic_store_n(&m_bufRing->tail, uint16_t(tail + 1), __ATOMIC_RELEASE);
+	if (!m_starved.empty()) {
+		pair<UringTunnel*, int> sd = m_starved.back();
+		m_starved.pop_back();
+		--sd.first->Pending;
+		ArmRecv(sd.first, sd.second);
+	}
+}
+
+void CUringEngine::OnRecv(UringTunnel *t, int i, int res, unsigned flags) {
+	--t->Pending;
+	if (res == -ENOBUFS) {
+		++t->Pending;								// keeps the tunnel alive until a buffer is recycled
+		m_starved.push_back(make_pair(t, i));
+		return;
+	}
+	if (res <= 0) {
+		t->Done[i] = true;
+		if (res < 0 && res != -ECANCELED) {
+			::shutdown(t->Fd[0], SHUT_RDWR);
+			::shutdown(t->Fd[1], SHUT_RDWR);
+		} else
+			::shutdown(t->Fd[1 - i], SHUT_WR);
+		Release(t);
+		return;
+	}
+	uint16_t bid = t->Bid[i] = uint16_t(flags >> IORING_CQE_BUFFER_SHIFT);
+
+	// send is linked with the next recv, so the direction re-arms only after the chunk is fully written
+	io_uring_sqe *sqe = m_ring.GetSqe();
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = t->Fd[1 - i];
+	sqe->addr = (uintptr_t)(m_bufs + size_t(bid) * BUF_SIZE);
+	sqe->len = unsigned(res);
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = Tag(t, TAG_SEND + i);
+	++t->Pending;
+	ArmRecv(t, i);
+}
+
+void CUringEngine::OnSend(UringTunnel *t, int i, int res) {
+	--t->Pending;
+	RecycleBuf(t->Bid[i]);
+	if (res < 0) {
+		::shutdown(t->Fd[0], SHUT_RDWR);
+		::shutdown(t->Fd[1], SHUT_RDWR);
+	} else
+		t->Bytes[i] += res;
+	Release(t);
+}
+
+void CUringEngine::Release(UringTunnel *t) {
+	if (!t->Pending && t->Done[0] && t->Done[1]) {
+		::close(t->Fd[0]);
+		::close(t->Fd[1]);
+		if (t->OnClose)
+			t->OnClose(t->Bytes[0], t->Bytes[1]);
+		m_tunnels.erase(t);
+		delete t;
+	}
+}
+
+void CUringEngine::Execute() {
+	ArmWake();
+	while (!m_bStop) {
+		m_ring.Submit(1);
+		for (io_uring_cqe *cqe; (cqe = m_ring.PeekCqe());) {
+			uint64_t ud = cqe->user_data;
+			int res = cqe->res;
+			unsigned flags = cqe->flags;
+			m_ring.CqeSeen();
+
+			void *p = (void*)uintptr_t(ud & ~uint64_t(TAG_MASK));
+			switch (int tag = int(ud & TAG_MASK)) {
+			case TAG_IGNORE:
+				break;
+			case TAG_WAKE:
+				{
+					vector<function<void()>> pending;
+					{
+						lock_guard<mutex> lk(m_mtx);
+						pending.swap(m_pending);
+					}
+					for (auto& fn : pending)
+						fn();
+					ArmWake();
+				}
+				break;
+			case TAG_ACCEPT:
+				{
+					UringListener *li = (UringListener*)p;
+					if (res >= 0)
+						OnAccept(res);
+					else
+						TRC(2, "io_uring accept failed: " << error_code(-res, generic_category()).message());
+					if (!(flags & IORING_CQE_F_MORE) && res != -EBADF && res != -EINVAL)		// re-arm unless the listener is gone
+						ArmAccept(li);
+				}
+				break;
+			case TAG_CONNECT:
+				{
+					UringConnect *c = (UringConnect*)p;
+					c->Res = res;
+					c->Ev.Set();
+					if (--c->Ref == 0)
+						delete c;
+				}
+				break;
+			case TAG_RECV:
+			case TAG_RECV + 1:
+				OnRecv((UringTunnel*)p, tag - TAG_RECV, res, flags);
+				break;
+			default:
+				OnSend((UringTunnel*)p, tag - TAG_SEND, res);
+			}
+		}
+	}
+	for (auto& li : m_listeners)
+		::close(li->Fd);
+	for (UringTunnel *t : m_tunnels) {
+		::close(t->Fd[0]);
+		::close(t->Fd[1]);
+		if (t->OnClose)
+			t->OnClose(t->Bytes[0], t->Bytes[1]);
+		delete t;
+	}
+	m_tunnels.clear();
+}
+
+}} // Ext::Inet::
+
+#endif // HAVE_LINUX_IO_URING_H
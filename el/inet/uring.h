@@ -0,0 +1,111 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include <el/libext/ext-net.h>
+
+#if HAVE_LINUX_IO_URING_H
+#	include <linux/io_uring.h>
+#endif
+
+namespace Ext {
+	namespace Inet {
+
+#if HAVE_LINUX_IO_URING_H
+
+// Raw io_uring over the syscalls, no liburing dependency
+class IoUring {
+public:
+	IoUring(unsigned entries, unsigned flags = 0);
+	~IoUring();
+
+	static bool IsSupported();
+
+	io_uring_sqe *GetSqe();					// submits pending SQEs when the queue is full, queues them in user space while the kernel takes none
+	int Submit(unsigned waitNr = 0);
+	io_uring_cqe *PeekCqe();
+	void CqeSeen();
+
+	io_uring_buf_ring *RegisterBufRing(uint16_t bgid, unsigned entries);
+	void UnregisterBufRing(uint16_t bgid, io_uring_buf_ring *br, unsigned entries);
+private:
+	int m_fd;
+	unsigned m_features;
+	unsigned *m_sqHead, *m_sqTail, *m_sqMask, *m_sqArray;
+	unsigned *m_cqHead, *m_cqTail, *m_cqMask;
+	io_uring_sqe *m_sqes;
+	io_uring_cqe *m_cqes;
+	void *m_sqRing, *m_cqRing;
+	size_t m_sqRingSize, m_cqRingSize, m_sqesSize;
+	unsigned m_sqEntries, m_sqLocalTail, m_toSubmit;
+	deque<io_uring_sqe> m_spill;
+
+	bool SqFull() const;
+	void Close();
+
+	IoUring(const IoUring&) = delete;
+	IoUring& operator=(const IoUring&) = delete;
+};
+
+class CUringEngine : public Thread {
+	typedef Thread base;
+public:
+	static const unsigned RING_ENTRIES = 4096;
+	static const unsigned BUF_COUNT = 4096;				// power of 2
+	static const unsigned BUF_SIZE = 16384;
+
+	CUringEngine(thread_group *tg = nullptr);
+	~CUringEngine();
+
+	void AddListener(const IPEndPoint& ep);
+
+	// Called from handshake threads. Blocks the caller until the ring completes the connect or timeoutMs expires.
+	// fd: a socket already bound by the caller, owned by Connect from here on; -1 to create one
+	error_code Connect(Socket& sock, const IPEndPoint& ep, int timeoutMs = 60000, int fd = -1);
+
+	// Takes ownership of both sockets and pumps bytes between them until both sides are shut down.
+	// onClose runs on the engine thread with the bytes relayed S -> D and D -> S
+	void Relay(Socket& sockS, Socket& sockD, function<void(uint64_t, uint64_t)> onClose = nullptr);
+
+	void Stop() override;
+protected:
+	virtual void OnAccept(SOCKET s) {
+		::close(s);
+	}
+
+	void Execute() override;
+private:
+	struct UringOp;
+	struct UringListener;
+	struct UringConnect;
+	struct UringTunnel;
+
+	IoUring m_ring;
+	io_uring_buf_ring *m_bufRing;
+	uint8_t *m_bufs;
+	int m_evfd;
+	uint64_t m_evVal;
+	vector<unique_ptr<UringListener>> m_listeners;
+	unordered_set<UringTunnel*> m_tunnels;
+	vector<pair<UringTunnel*, int>> m_starved;
+
+	mutex m_mtx;
+	vector<function<void()>> m_pending;
+
+	void Post(function<void()> fn);
+	void Wake();
+	void ArmWake();
+	void ArmAccept(UringListener *li);
+	void ArmRecv(UringTunnel *t, int i);
+	void RecycleBuf(uint16_t bid);
+	void OnRecv(UringTunnel *t, int i, int res, unsigned flags);
+	void OnSend(UringTunnel *t, int i, int res);
+	void Release(UringTunnel *t);
+};
+
+#endif // HAVE_LINUX_IO_URING_H
+
+}} // Ext::Inet::
@@ -0,0 +1,105 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#include <el/ext.h>
+
+#include "workerpool.h"
+
+namespace Ext {
+	namespace Inet {
+
+CWorkerPool::CWorkerPool(size_t minThreads, size_t maxThreads, chrono::milliseconds idleTimeout, size_t queueSize)
+	: MinThreads(minThreads)
+	, MaxThreads((max)(maxThreads, (max)(minThreads, size_t(1))))
+	, IdleTimeout(idleTimeout)
+	, Spawned(0)
+	, Rejected(0)
+	, m_queue(queueSize)
+	, m_threads(0)
+	, m_idle(0)
+	, m_wakeups(0)
+{}
+
+CWorkerPool::~CWorkerPool() {
+	for (SOCKET s; m_queue.TryPop(s);) {
+		Socket sock;
+		sock.Attach(s);
+	}
+}
+
+void CWorkerPool::Start() {
+	for (size_t i = 0; i < MinThreads; ++i) {
+		++m_threads;
+		++Spawned;
+		SpawnWorker();
+	}
+}
+
+bool CWorkerPool::Post(SOCKET s) {
+	if (!m_queue.TryPush(s)) {
+		++Rejected;
+		return false;
+	}
+	atomic_thread_fence(memory_order_seq_cst);				// store s, then load m_idle: pairs with the fence in Take()
+	if (m_idle) {											// a worker advertises itself before its last look at the queue, so either it sees s or we see it
+		lock_guard<mutex> lk(m_mtx);
+		if (m_idle) {										// claim one sleeper, so a burst of posts does not wake the same worker twice
+			--m_idle;
+			++m_wakeups;
+			m_cv.notify_one();
+			return true;
+		}
+	}
+	for (size_t n = m_threads; n < MaxThreads;)
+		if (m_threads.compare_exchange_weak(n, n + 1)) {
+			++Spawned;
+			SpawnWorker();
+			break;
+		}
+	return true;											// at the maximum: waits for the first free worker
+}
+
+void CWorkerPool::LeaveIdle() {
+	if (m_wakeups)
+		--m_wakeups;
+	else
+		--m_idle;
+}
+
+bool CWorkerPool::Take(SOCKET& s, const volatile bool& bStop) {
+	auto deadline = chrono::steady_clock::now() + IdleTimeout;
+	while (!bStop) {
+		if (m_queue.TryPop(s))
+			return true;
+		unique_lock<mutex> lk(m_mtx);
+		++m_idle;
+		atomic_thread_fence(memory_order_seq_cst);			// store m_idle, then load the queue: pairs with the fence in Post()
+		if (m_queue.TryPop(s)) {
+			LeaveIdle();
+			return true;
+		}
+		bool timeout = m_cv.wait_until(lk, deadline) == cv_status::timeout;
+		LeaveIdle();
+		if (timeout) {
+			if (m_queue.TryPop(s))
+				return true;
+			size_t n = m_threads;
+			while (n > MinThreads && !m_threads.compare_exchange_weak(n, n - 1))
+				;
+			if (n > MinThreads)
+				return false;
+			deadline = chrono::steady_clock::now() + IdleTimeout;
+		}
+	}
+	--m_threads;
+	return false;
+}
+
+void CWorkerPool::Wake() {
+	lock_guard<mutex> lk(m_mtx);
+	m_cv.notify_all();
+}
+
+}} // Ext::Inet::
@@ -0,0 +1,108 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+#pragma once
+
+#include <el/libext/ext-net.h>
+
+namespace Ext {
+	namespace Inet {
+
+// Bounded lock-free multi-producer multi-consumer queue (D. Vyukov). Capacity is a power of 2
+template <class T> class MpmcQueue {
+public:
+	MpmcQueue(size_t capacity)
+		: m_cells(capacity)
+		, m_mask(capacity - 1)
+		, m_enqueuePos(0)
+		, m_dequeuePos(0)
+	{
+		for (size_t i = 0; i < capacity; ++i)
+			m_cells[i].Seq.store(i, memory_order_relaxed);
+	}
+
+	bool TryPush(const T& v) {
+		size_t pos = m_enqueuePos.load(memory_order_relaxed);
+		for (Cell *c;;) {
+			c = &m_cells[pos & m_mask];
+			intptr_t dif = intptr_t(c->Seq.load(memory_order_acquire)) - intptr_t(pos);
+			if (!dif) {
+				if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+					c->Value = v;
+					c->Seq.store(pos + 1, memory_order_release);
+					return true;
+				}
+			} else if (dif < 0)
+				return false;								// full
+			else
+				pos = m_enqueuePos.load(memory_order_relaxed);
+		}
+	}
+
+	bool TryPop(T& v) {
+		size_t pos = m_dequeuePos.load(memory_order_relaxed);
+		for (Cell *c;;) {
+			c = &m_cells[pos & m_mask];
+			intptr_t dif = intptr_t(c->Seq.load(memory_order_acquire)) - intptr_t(pos + 1);
+			if (!dif) {
+				if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+					v = c->Value;
+					c->Seq.store(pos + m_mask + 1, memory_order_release);
+					return true;
+				}
+			} else if (dif < 0)
+				return false;								// empty
+			else
+				pos = m_dequeuePos.load(memory_order_relaxed);
+		}
+	}
+private:
+	struct Cell {
+		atomic<size_t> Seq;
+		T Value;
+	};
+
+	vector<Cell> m_cells;
+	const size_t m_mask;
+	alignas(64) atomic<size_t> m_enqueuePos;
+	alignas(64) atomic<size_t> m_dequeuePos;
+};
+
+// Elastic pool of connection threads. The acceptor posts sockets into a lock-free queue; an idle worker takes the next one,
+// a new worker is spawned only when none is idle and the pool is below its maximum. Workers above the minimum exit after idleTimeout.
+// The mutex is taken only to sleep and to wake a sleeping worker
+class CWorkerPool {
+public:
+	const size_t MinThreads, MaxThreads;
+	const chrono::milliseconds IdleTimeout;
+	atomic<uint64_t> Spawned, Rejected;
+
+	CWorkerPool(size_t minThreads, size_t maxThreads, chrono::milliseconds idleTimeout = chrono::seconds(30), size_t queueSize = 4096);
+	virtual ~CWorkerPool();
+
+	void Start();									// spawns MinThreads
+	bool Post(SOCKET s);							// false if the queue is full, the socket stays with the caller
+
+	// Worker side: returns false when the calling worker should exit
+	bool Take(SOCKET& s, const volatile bool& bStop);
+	void Wake();									// after setting a worker's stop flag
+
+	size_t Threads() const { return m_threads; }
+protected:
+	virtual void SpawnWorker() = 0;					// new thread that loops on Take()
+private:
+	MpmcQueue<SOCKET> m_queue;
+	atomic<size_t> m_threads, m_idle;					// m_idle: sleeping workers not yet claimed by Post()
+	size_t m_wakeups;									// claimed but not yet awake, guarded by m_mtx
+	mutex m_mtx;
+	condition_variable m_cv;
+
+	void LeaveIdle();
+
+	CWorkerPool(const CWorkerPool&) = delete;
+	CWorkerPool& operator=(const CWorkerPool&) = delete;
+};
+
+}} // Ext::Inet::
@@ -0,0 +1,1219 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+// Relay benchmark: established tunnels over loopback, no handshakes. Compares the data pumps socksd can use.
+// Connection-rate modes: accept, one-byte echo, close. Compares a thread per accept with the worker pool.
+// Parse mode: handshakes of a recorded corpus replayed through the relay parsers in memory, no sockets
+// Idle mode: SOCKS5 tunnels held open through a socksd -e coro child, which is measured by its RSS
+// socksd modes: short SOCKS5 tunnels with echoed traffic through a socksd child of the given engine
+
+#include <el/ext.h>
+using namespace std;
+
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <netinet/tcp.h>
+
+#if HAVE_LINUX_PERF_EVENT_H
+#	include <linux/perf_event.h>
+#	include <sys/syscall.h>
+#endif
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#	define IP_BIND_ADDRESS_NO_PORT 24				// Linux 4.2
+#endif
+
+#include <el/inet/uring.h>
+#include <el/inet/splice.h>
+#include <el/inet/workerpool.h>
+#include <el/inet/phasetrace.h>
+#include <el/inet/handshake.h>
+using namespace Ext::Inet;
+
+CUsingSockets g_usingSockets;
+
+typedef chrono::steady_clock Clock;
+
+enum class Duplex { Up, Down, Both };
+
+static const char * const s_duplexNames[] = { "up", "down", "both" };
+
+// Same pump as CSocksThread after the handshake
+class CCopyPump : public Thread, public CSocketLooper {
+	typedef Thread base;
+public:
+	Socket m_sockS, m_sockD;
+
+	CCopyPump(thread_group& tg)
+		: base(&tg)
+	{}
+
+	void Stop() override {
+		base::Stop();
+		m_sockS.Close();
+		m_sockD.Close();
+	}
+protected:
+	void Execute() override {
+		NoSignal = true;
+		try {
+			Loop(m_sockS, m_sockD);
+		} catch (RCExc) {
+		}
+	}
+};
+
+#if UCFG_INET_SPLICE
+
+class CSplicePump : public Thread {
+	typedef Thread base;
+public:
+	CSplicePump(thread_group& tg, int fdS, int fdD)
+		: base(&tg)
+		, m_fdS(fdS)
+		, m_fdD(fdD)
+	{}
+protected:
+	int m_fdS, m_fdD;
+
+	void Execute() override {
+		SpliceLoop(m_fdS, m_fdD, m_bStop);
+	}
+};
+
+#endif // UCFG_INET_SPLICE
+
+static thread_local uint64_t t_allocs;					// operator new calls of this thread, parse mode reports them per handshake
+
+void *operator new(size_t size) {
+	++t_allocs;
+	if (void *p = malloc(size ? size : 1))
+		return p;
+	throw bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+	free(p);
+}
+
+static observer_ptr<CPhaseTracer> s_phaseTracer;		// -T: what socksd -T costs per connection
+
+static void EchoOne(int fd) {
+	PhaseTimes phases;
+	bool bTrace = s_phaseTracer;
+	if (bTrace)
+		phases.Mark(PhaseTimes::Accept);
+	uint8_t b;
+	if (::recv(fd, &b, 1, 0) == 1) {
+		if (bTrace)
+			phases.Mark(PhaseTimes::Version);
+		::send(fd, &b, 1, MSG_NOSIGNAL);
+		if (bTrace)
+			phases.Mark(PhaseTimes::Reply);
+	}
+	::close(fd);
+	if (bTrace)
+		s_phaseTracer->Record(phases, AccessRecord());
+}
+
+// What ListenerThread<CSocksThread> does: a new thread per accepted socket
+class CEchoThread : public Thread {
+	typedef Thread base;
+public:
+	CEchoThread(thread_group& tg, int fd)
+		: base(&tg)
+		, m_fd(fd)
+	{}
+protected:
+	int m_fd;
+
+	void Execute() override {
+		EchoOne(m_fd);
+	}
+};
+
+// Target of the socksd modes: echoes until the tunnel ends, then resets, so that no TIME_WAIT piles up in socksd
+class CEchoTarget : public Thread {
+	typedef Thread base;
+public:
+	CEchoTarget(thread_group& tg, int fd)
+		: base(&tg)
+		, m_fd(fd)
+	{}
+protected:
+	int m_fd;
+
+	void Execute() override {
+		uint8_t buf[65536];
+		for (ssize_t r; (r = ::recv(m_fd, buf, sizeof buf, 0)) > 0;)
+			if (::send(m_fd, buf, r, MSG_NOSIGNAL) != r)
+				break;
+		linger li = { 1, 0 };
+		::setsockopt(m_fd, SOL_SOCKET, SO_LINGER, &li, sizeof li);
+		::close(m_fd);
+	}
+};
+
+class CEchoWorker : public Thread {
+	typedef Thread base;
+public:
+	CEchoWorker(thread_group& tg, CWorkerPool& pool)
+		: base(&tg)
+		, m_pool(pool)
+	{}
+
+	void Stop() override {
+		base::Stop();
+		m_pool.Wake();
+	}
+protected:
+	CWorkerPool& m_pool;
+
+	void Execute() override {
+		for (SOCKET s; m_pool.Take(s, m_bStop);)
+			EchoOne((int)s);
+	}
+};
+
+class CEchoPool : public CWorkerPool {
+	typedef CWorkerPool base;
+public:
+	CEchoPool(thread_group& tg, size_t minThreads, size_t maxThreads)
+		: base(minThreads, maxThreads)
+		, m_tg(tg)
+	{}
+protected:
+	thread_group& m_tg;
+
+	void SpawnWorker() override {
+		ptr<CEchoWorker> t = new CEchoWorker(m_tg, *this);
+		t->Start();
+	}
+};
+
+// Syscalls entered by this process and the threads it starts from now on: the raw_syscalls:sys_enter tracepoint.
+// Needs tracefs mounted and perf_event_paranoid -1 or CAP_PERFMON, Read() is -1 without them
+class CSyscallCounter {
+public:
+	CSyscallCounter()
+		: m_fd(-1)
+	{
+#if HAVE_LINUX_PERF_EVENT_H
+		for (const char *dir : { "/sys/kernel/tracing", "/sys/kernel/debug/tracing" }) {
+			ifstream ifs((string(dir) + "/events/raw_syscalls/sys_enter/id").c_str());
+			perf_event_attr attr = {};
+			if (ifs >> attr.config) {
+				attr.type = PERF_TYPE_TRACEPOINT;
+				attr.size = sizeof attr;
+				attr.inherit = 1;
+				m_fd = (int)::syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+				break;
+			}
+		}
+#endif
+	}
+
+	~CSyscallCounter() {
+		if (m_fd >= 0)
+			::close(m_fd);
+	}
+
+	int64_t Read() const {
+		uint64_t v;
+		return m_fd >= 0 && ::read(m_fd, &v, sizeof v) == sizeof v ? int64_t(v) : -1;
+	}
+private:
+	int m_fd;
+};
+
+struct BenchTunnel {
+	int Cli, S, D, Srv;			// Cli <-> S =pump= D <-> Srv
+};
+
+struct BenchResult {
+	String Mode;
+	double Seconds;
+	uint64_t Bytes, Connections, Handshakes;
+	size_t Rejected;					// corpus files the parsers reject
+	uint64_t RssBefore = 0, RssAfter = 0;	// idle mode: of the socksd child, bytes
+	uint64_t Lost = 0;						// idle mode: tunnels not opened or not answering the probe
+	bool Failed = false;					// makes the exit status 1
+	int64_t Syscalls = -1;					// entered during the window, -1 if not counted
+	double AllocsPerHandshake = -1;			// parse mode: operator new calls
+	vector<pair<string, uint64_t>> FileAllocs;		// parse mode: per corpus file, one warm replay
+	double UserCpu, SysCpu;
+	long CtxSwitches;
+	vector<int64_t> RttNs;
+
+	// Signed: the RSS may shrink while the tunnels open, e.g. when the allocator returns free pages
+	int64_t RssPerTunnel() const { return Connections ? (int64_t(RssAfter) - int64_t(RssBefore)) / int64_t(Connections) : 0; }
+};
+
+static double TimevalSec(const timeval& tv) {
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void SendAll(int fd, const uint8_t *p, size_t size) {
+	while (size) {
+		ssize_t r = ::send(fd, p, size, MSG_NOSIGNAL);
+		if (r <= 0)
+			Throw(ExtErr::EndOfStream);
+		p += r;
+		size -= r;
+	}
+}
+
+static void RecvAll(int fd, uint8_t *p, size_t size) {
+	while (size) {
+		ssize_t r = ::recv(fd, p, size, 0);
+		if (r <= 0)
+			Throw(ExtErr::EndOfStream);
+		p += r;
+		size -= r;
+	}
+}
+
+class CBenchApp : public CConApp {
+	typedef CConApp base;
+public:
+	vector<String> Modes;
+	size_t MsgSize, ProbeSize;
+	int Tunnels, Seconds, TraceEvery;
+	Duplex Dir;
+	String CorpusDir, SocksdPath, BaselineFile;
+
+	static const size_t IDLE_BUDGET = 2048;				// userspace bytes per idle tunnel in socksd -e coro
+	static const size_t IDLE_PER_ADDRESS = 20000;		// tunnels per loopback address pair, within the ephemeral port range
+	static const int SOCKSD_EXCHANGES = 16;				// echoed messages per tunnel in the socksd modes
+
+	CBenchApp()
+		: MsgSize(16384)
+		, ProbeSize(64)
+		, Tunnels(16)
+		, Seconds(5)
+		, TraceEvery(-1)
+		, Dir(Duplex::Both)
+		, CorpusDir("fuzz/corpus")
+	{}
+
+	void PrintUsage() {
+		cout << "Usage: " << System.get_ExeFilePath().stem() << " {-m modes -s size -n tunnels -d duplex -t seconds -p size -T n -c dir -x file -B file -o file}" << "\n";
+		cout << "  -m modes      copy,splice,uring (default all); connection rate: spawn,pool; handshake parsers: parse;\n"
+			 << "                idle tunnels held by socksd -e coro: idle; handshakes and relay through socksd -e engine: socksd-engine,\n"
+			 << "                e.g. socksd-threads,socksd-splice\n"
+			 << "  -s size       Bulk message size, by default 16384, also of the echoed messages in socksd modes\n"
+			 << "  -n tunnels    Bulk tunnels, by default 16. Concurrent clients in connection-rate and socksd modes, threads in parse mode,\n"
+			 << "                tunnels to hold open in idle mode, e.g. 1000000: needs fs.nr_open and RLIMIT_NOFILE over 2 per tunnel\n"
+			 << "  -d duplex     up | down | both (default)\n"
+			 << "  -t seconds    Measurement window, by default 5\n"
+			 << "  -p size       Ping-pong probe message size, by default 64. The probe runs on an extra tunnel during the window\n"
+			 << "  -T n          Connection-rate modes: time phases as socksd -T does, tracing every n-th connection to /dev/null\n"
+			 << "  -c dir        Parse mode corpus, one handshake per file in the socksd-fuzz input layout, by default fuzz/corpus\n"
+			 << "  -x file       socksd binary of the idle and socksd modes, by default the one next to this program\n"
+			 << "  -B file       Earlier output to compare with: each mode found there gets vs_baseline, this run's rates,\n"
+			 << "                costs and latencies divided by the baseline's\n"
+			 << "  -o file       JSON output, by default stdout\n"
+			 << "CPU and syscalls are for the whole process, including the load generators\n"
+			 << "Syscalls are counted by the raw_syscalls:sys_enter tracepoint: needs tracefs, and perf_event_paranoid -1 or root\n"
+			<< endl;
+	}
+
+	void Execute() override {
+		String outFile;
+		for (int arg; (arg = getopt(Argc, Argv, "hm:s:n:d:t:p:T:c:x:B:o:")) != EOF;) {
+			switch (arg) {
+			case 'h':
+				PrintUsage();
+				return;
+			case 'm':
+				for (auto s : String(optarg).Split(","))
+					Modes.push_back(s);
+				break;
+			case 's':
+				MsgSize = (max)(atoi(optarg), 1);
+				break;
+			case 'n':
+				Tunnels = (max)(atoi(optarg), 1);
+				break;
+			case 'd':
+				for (int i = 0; i < (int)size(s_duplexNames); ++i)
+					if (String(optarg) == s_duplexNames[i])
+						Dir = Duplex(i);
+				break;
+			case 't':
+				Seconds = (max)(atoi(optarg), 1);
+				break;
+			case 'p':
+				ProbeSize = (max)(atoi(optarg), 1);
+				break;
+			case 'T':
+				TraceEvery = atoi(optarg);
+				break;
+			case 'c':
+				CorpusDir = optarg;
+				break;
+			case 'x':
+				SocksdPath = optarg;
+				break;
+			case 'B':
+				BaselineFile = optarg;
+				break;
+			case 'o':
+				outFile = optarg;
+				break;
+			}
+		}
+		if (TraceEvery >= 0)
+			PhaseClock::Calibrate();
+		if (Modes.empty())
+			Modes = { "copy", "splice", "uring" };
+		LoadBaseline();											// before -o truncates it, when it is the same file
+
+		vector<BenchResult> results;
+		bool bFailed = false;
+		for (auto& mode : Modes) {
+			cerr << "Running " << mode << "..." << endl;
+			try {
+				results.push_back(Run(mode));
+				bFailed |= results.back().Failed;
+			} catch (const exception& ex) {
+				cerr << mode << ": " << ex.what() << endl;		// skipped, as uring where the kernel lacks it
+			}
+		}
+		if (outFile.empty())
+			PrintJson(cout, results);
+		else {
+			ofstream ofs(outFile.c_str());
+			PrintJson(ofs, results);
+		}
+		if (bFailed)
+			exit(1);											// the output is written: make baseline/bench stop, scripts see it
+	}
+private:
+	static int ListenLoopback(sockaddr_in& sa) {
+		int s = CCheck(::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP));
+		sa = sockaddr_in();
+		sa.sin_family = AF_INET;
+		sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		socklen_t len = sizeof sa;
+		if (::bind(s, (const sockaddr*)&sa, len) < 0 || ::listen(s, SOMAXCONN) < 0 || ::getsockname(s, (sockaddr*)&sa, &len) < 0) {
+			::close(s);
+			CCheck(-1);
+		}
+		return s;
+	}
+
+	static pair<int, int> TcpPair(int fdListen, const sockaddr_in& sa) {
+		int c = CCheck(::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP));
+		CCheck(::connect(c, (const sockaddr*)&sa, sizeof sa));
+		return make_pair(c, CCheck(::accept4(fdListen, nullptr, nullptr, SOCK_CLOEXEC)));
+	}
+
+	// Takes ownership of S and D of every tunnel
+	void StartPumps(RCString mode, thread_group& tg, vector<BenchTunnel>& tunnels, ptr<Thread>& engine) {
+		if (mode == "copy") {
+			for (auto& t : tunnels) {
+				ptr<CCopyPump> p = new CCopyPump(tg);
+				p->m_sockS.Attach(exchange(t.S, -1));
+				p->m_sockD.Attach(exchange(t.D, -1));
+				p->Start();
+			}
+			return;
+		}
+#if UCFG_INET_SPLICE
+		if (mode == "splice") {
+			for (auto& t : tunnels) {
+				ptr<CSplicePump> p = new CSplicePump(tg, exchange(t.S, -1), exchange(t.D, -1));
+				p->Start();
+			}
+			return;
+		}
+#endif
+#if HAVE_LINUX_IO_URING_H
+		if (mode == "uring" && IoUring::IsSupported()) {
+			ptr<CUringEngine> e = new CUringEngine(&tg);
+			e->Start();
+			for (auto& t : tunnels) {
+				Socket sockS, sockD;
+				sockS.Attach(exchange(t.S, -1));
+				sockD.Attach(exchange(t.D, -1));
+				e->Relay(sockS, sockD);
+			}
+			engine = e;
+			return;
+		}
+#endif
+		Throw(E_NOTIMPL);
+	}
+
+	// Every client connects, sends a byte, waits for the echo and resets the connection, so no TIME_WAIT piles up.
+	// RttNs is connect to echo
+	BenchResult RunAccept(RCString mode) {
+		sockaddr_in sa;
+		int fdListen = ListenLoopback(sa);
+		thread_group tg;
+		unique_ptr<CPhaseTracer> tracer;
+		if (TraceEvery >= 0) {
+			tracer.reset(new CPhaseTracer(TraceEvery, "/dev/null"));
+			s_phaseTracer = tracer.get();
+		}
+		CSyscallCounter syscalls;								// before any thread starts
+		unique_ptr<CEchoPool> pool;
+		if (mode == "pool") {
+			pool.reset(new CEchoPool(tg, Tunnels, 1024));
+			pool->Start();
+		}
+		atomic<bool> bStop(false);
+		thread acceptor([&] {
+			for (int s; (s = ::accept4(fdListen, nullptr, nullptr, SOCK_CLOEXEC)) >= 0 || errno == EINTR || errno == ECONNABORTED;) {
+				if (s < 0)
+					continue;
+				if (pool) {
+					if (!pool->Post(SOCKET(s)))
+						::close(s);
+				} else {
+					ptr<CEchoThread> t = new CEchoThread(tg, s);
+					t->Start();
+				}
+			}
+		});
+
+		atomic<uint64_t> connections(0);
+		vector<vector<int64_t>> rtts(Tunnels);
+		vector<thread> clients;
+		for (int i = 0; i < Tunnels; ++i)
+			clients.emplace_back([&, i] {
+				uint8_t b = 'c';
+				linger li = { 1, 0 };
+				while (!bStop) {
+					Clock::time_point t0 = Clock::now();
+					int c = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+					if (c < 0)
+						break;
+					bool ok = ::connect(c, (const sockaddr*)&sa, sizeof sa) == 0 && ::send(c, &b, 1, MSG_NOSIGNAL) == 1 && ::recv(c, &b, 1, 0) == 1;
+					::setsockopt(c, SOL_SOCKET, SO_LINGER, &li, sizeof li);
+					::close(c);
+					if (!ok)
+						continue;
+					rtts[i].push_back(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - t0).count());
+					++connections;
+				}
+			});
+
+		BenchResult res;
+		res.Mode = mode;
+		res.Bytes = 0;
+		res.Handshakes = 0;
+		rusage ru0, ru1;
+		::getrusage(RUSAGE_SELF, &ru0);
+		uint64_t conns0 = connections;
+		int64_t syscalls0 = syscalls.Read();
+		Clock::time_point t0 = Clock::now();
+		this_thread::sleep_for(chrono::seconds(Seconds));
+		res.Connections = connections - conns0;
+		res.Seconds = chrono::duration<double>(Clock::now() - t0).count();
+		if (syscalls0 >= 0)
+			res.Syscalls = syscalls.Read() - syscalls0;
+		::getrusage(RUSAGE_SELF, &ru1);
+		bStop = true;
+
+		res.UserCpu = TimevalSec(ru1.ru_utime) - TimevalSec(ru0.ru_utime);
+		res.SysCpu = TimevalSec(ru1.ru_stime) - TimevalSec(ru0.ru_stime);
+		res.CtxSwitches = (ru1.ru_nvcsw + ru1.ru_nivcsw) - (ru0.ru_nvcsw + ru0.ru_nivcsw);
+
+		for (auto& t : clients)
+			t.join();
+		::shutdown(fdListen, SHUT_RDWR);
+		acceptor.join();
+		::close(fdListen);
+		tg.interrupt_all();
+		tg.join_all();
+		tg.m_bSync = false;
+		if (pool)
+			cerr << mode << ": " << pool->Spawned << " threads spawned" << endl;
+		if (tracer) {
+			s_phaseTracer = nullptr;
+			cerr << mode << ": ";
+			tracer->Print(cerr);
+		}
+		for (auto& v : rtts)
+			res.RttNs.insert(res.RttNs.end(), v.begin(), v.end());
+		return res;
+	}
+
+	// File name -> bytes
+	vector<pair<string, string>> LoadCorpus() {
+		vector<pair<string, string>> corpus;
+		DIR *dir = ::opendir(CorpusDir.c_str());
+		if (!dir)
+			CCheck(-1);
+		while (dirent *e = ::readdir(dir)) {
+			ifstream ifs((CorpusDir + "/" + e->d_name).c_str(), ios::binary);
+			if (e->d_name[0] != '.' && ifs)
+				corpus.emplace_back(e->d_name, string(istreambuf_iterator<char>(ifs), istreambuf_iterator<char>()));
+		}
+		::closedir(dir);
+		sort(corpus.begin(), corpus.end());
+		if (corpus.empty())
+			Throw(errc::no_such_file_or_directory);
+		return corpus;
+	}
+
+	// Every thread replays the whole corpus over and over. Bytes are client bytes parsed.
+	// Allocations are counted over whole passes, after a first pass that initializes the parsers' statics
+	BenchResult RunParse(RCString mode) {
+		vector<pair<string, string>> corpus = LoadCorpus();
+		BenchResult res;
+		res.Mode = mode;
+		res.Connections = 0;
+		res.Rejected = 0;
+		for (auto& c : corpus)
+			res.Rejected += !ReplayHandshake(Span((const uint8_t*)c.second.data(), c.second.size()));
+		size_t corpusBytes = 0;
+		for (auto& c : corpus) {
+			corpusBytes += c.second.size();
+			uint64_t allocs0 = t_allocs;
+			ReplayHandshake(Span((const uint8_t*)c.second.data(), c.second.size()));
+			res.FileAllocs.emplace_back(c.first, t_allocs - allocs0);
+		}
+
+		atomic<uint64_t> passes(0), allocs(0), countedPasses(0);
+		atomic<bool> bStop(false), bCount(false);
+		vector<thread> threads;
+		for (int i = 0; i < Tunnels; ++i)
+			threads.emplace_back([&] {
+				while (!bStop) {
+					bool bCounted = bCount;
+					uint64_t allocs0 = t_allocs;
+					for (auto& c : corpus)
+						ReplayHandshake(Span((const uint8_t*)c.second.data(), c.second.size()));
+					if (bCounted) {
+						allocs.fetch_add(t_allocs - allocs0, memory_order_relaxed);
+						countedPasses.fetch_add(1, memory_order_relaxed);
+					}
+					passes.fetch_add(1, memory_order_relaxed);
+				}
+			});
+
+		rusage ru0, ru1;
+		::getrusage(RUSAGE_SELF, &ru0);
+		uint64_t passes0 = passes;
+		bCount = true;
+		Clock::time_point t0 = Clock::now();
+		this_thread::sleep_for(chrono::seconds(Seconds));
+		uint64_t n = passes - passes0;
+		res.Seconds = chrono::duration<double>(Clock::now() - t0).count();
+		::getrusage(RUSAGE_SELF, &ru1);
+		bStop = true;
+		for (auto& t : threads)
+			t.join();
+		if (countedPasses)
+			res.AllocsPerHandshake = double(allocs) / (countedPasses * corpus.size());
+		res.Handshakes = n * corpus.size();
+		res.Bytes = n * corpusBytes;
+		res.UserCpu = TimevalSec(ru1.ru_utime) - TimevalSec(ru0.ru_utime);
+		res.SysCpu = TimevalSec(ru1.ru_stime) - TimevalSec(ru0.ru_stime);
+		res.CtxSwitches = (ru1.ru_nvcsw + ru1.ru_nivcsw) - (ru0.ru_nvcsw + ru0.ru_nivcsw);
+		return res;
+	}
+
+	// Soft limit up to need, the hard one too when permitted (root, up to fs.nr_open). Returns the soft limit
+	static size_t RaiseFdLimit(size_t need) {
+		rlimit rl;
+		CCheck(::getrlimit(RLIMIT_NOFILE, &rl));
+		if (rl.rlim_max < need) {
+			rlimit r = { need, need };
+			if (::setrlimit(RLIMIT_NOFILE, &r) == 0)
+				return need;
+		}
+		rl.rlim_cur = (min)(rlim_t(need), rl.rlim_max);
+		CCheck(::setrlimit(RLIMIT_NOFILE, &rl));
+		return rl.rlim_cur;
+	}
+
+	// User and system CPU seconds of another process so far
+	static void ProcessCpu(pid_t pid, double& user, double& sys) {
+		ifstream ifs(("/proc/" + to_string(pid) + "/stat").c_str());
+		string line;
+		getline(ifs, line);
+		istringstream is(line.substr(line.rfind(')') + 1));		// the command name may hold blanks
+		string field;
+		for (int i = 3; i < 14; ++i)								// state .. cmajflt
+			is >> field;
+		unsigned long long utime = 0, stime = 0;
+		is >> utime >> stime;
+		double tick = double(::sysconf(_SC_CLK_TCK));
+		user = utime / tick;
+		sys = stime / tick;
+	}
+
+	static uint64_t ProcessRss(pid_t pid) {
+		ifstream ifs(("/proc/" + to_string(pid) + "/status").c_str());
+		for (string line; getline(ifs, line);)
+			if (!line.compare(0, 6, "VmRSS:"))
+				return stoull(line.substr(6)) * 1024;
+		return 0;
+	}
+
+	// socksd -e engine from the same directory (or -x), listening on the port of sa. Returns once it accepts connections
+	pid_t StartSocksd(const char *engine, const sockaddr_in& sa) {
+		path exe = SocksdPath.empty() ? System.get_ExeFilePath().parent_path() / "socksd" : path(SocksdPath.c_str());
+		string port = to_string(ntohs(sa.sin_port));
+		pid_t pid = CCheck(::fork());
+		if (!pid) {
+			::execl(exe.c_str(), "socksd", "-e", engine, "-p", port.c_str(), (char*)nullptr);
+			_exit(127);
+		}
+		for (int i = 0;; ++i) {										// until the child listens
+			int c = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+			bool ok = c >= 0 && ::connect(c, (const sockaddr*)&sa, sizeof sa) == 0;
+			if (c >= 0)
+				::close(c);
+			if (ok)
+				return pid;
+			if (::waitpid(pid, nullptr, WNOHANG) == pid)
+				Throw(errc::connection_refused);						// exited: the engine is not built in, the port is taken
+			if (i == 50) {
+				StopSocksd(pid);
+				Throw(errc::timed_out);
+			}
+			this_thread::sleep_for(chrono::milliseconds(100));
+		}
+	}
+
+	static void StopSocksd(pid_t pid) {
+		::kill(pid, SIGTERM);										// a clean exit writes the profile of a -fprofile-generate build
+		for (int i = 0; ::waitpid(pid, nullptr, WNOHANG) == 0; ++i) {
+			if (i == 100)
+				::kill(pid, SIGKILL);
+			this_thread::sleep_for(chrono::milliseconds(100));
+		}
+	}
+
+	// Tunnel i leaves from its own loopback source to its own loopback target, so that neither the client nor socksd
+	// runs out of ephemeral ports. -1 if the connect or the SOCKS5 CONNECT fails
+	static int OpenIdleTunnel(size_t i, uint16_t proxyPort, uint16_t targetPort) {
+		uint32_t pair = uint32_t(i / IDLE_PER_ADDRESS + 1);
+		int c = CCheck(::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP));
+		int on = 1;
+		::setsockopt(c, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof on);
+		sockaddr_in src = {}, proxy = {};
+		src.sin_family = proxy.sin_family = AF_INET;
+		src.sin_addr.s_addr = htonl(0x7F010000 | pair);										// 127.1.x.y
+		proxy.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		proxy.sin_port = htons(proxyPort);
+		const uint8_t req[] = { 5, 1, 0,													// no authentication, and without waiting:
+			5, 1, 0, 1, 127, 2, uint8_t(pair >> 8), uint8_t(pair), uint8_t(targetPort >> 8), uint8_t(targetPort) };	// CONNECT 127.2.x.y
+		uint8_t rep[12];
+		try {
+			if (::bind(c, (const sockaddr*)&src, sizeof src) == 0 && ::connect(c, (const sockaddr*)&proxy, sizeof proxy) == 0) {
+				SendAll(c, req, sizeof req);
+				RecvAll(c, rep, sizeof rep);
+				if (rep[1] == 0 && rep[3] == 0)
+					return c;
+			}
+		} catch (RCExc) {
+		}
+		::close(c);
+		return -1;
+	}
+
+	// Tunnels are opened by 64 client threads and held idle for -t seconds while the child's RSS settles, then every 1000th
+	// carries a ping-pong probe to show it still relays. The target side echoes from one epoll thread
+	BenchResult RunIdle(RCString mode) {
+		size_t n = (min)(size_t(Tunnels), (RaiseFdLimit(size_t(Tunnels) * 2 + 256) - 256) / 2);		// the child inherits the limit
+		if (n < size_t(Tunnels))
+			cerr << mode << ": RLIMIT_NOFILE allows " << n << " tunnels" << endl;
+
+		sockaddr_in sa;
+		uint16_t targetPort = 0, proxyPort;
+		{
+			int s = ListenLoopback(sa);								// a free port for the child
+			proxyPort = ntohs(sa.sin_port);
+			::close(s);
+		}
+		vector<int> listeners;										// one per target address 127.2.x.y, on the same port
+		for (size_t i = 0; i < n; i += IDLE_PER_ADDRESS) {
+			sockaddr_in st = sa;
+			st.sin_addr.s_addr = htonl(0x7F020000 | uint32_t(i / IDLE_PER_ADDRESS + 1));
+			st.sin_port = htons(targetPort);
+			socklen_t len = sizeof st;
+			int s = CCheck(::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, IPPROTO_TCP));
+			listeners.push_back(s);
+			if (::bind(s, (const sockaddr*)&st, len) < 0 || ::listen(s, SOMAXCONN) < 0 || ::getsockname(s, (sockaddr*)&st, &len) < 0) {
+				for (int fd : listeners)
+					::close(fd);
+				CCheck(-1);
+			}
+			targetPort = ntohs(st.sin_port);
+		}
+
+		atomic<bool> bStop(false);
+		vector<int> accepted;
+		thread target([&] {
+			int ep = CCheck(::epoll_create1(EPOLL_CLOEXEC));
+			epoll_event ev = {};
+			ev.events = EPOLLIN;
+			for (int fd : listeners) {
+				ev.data.u64 = uint64_t(1) << 32 | fd;				// listener
+				::epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+			}
+			epoll_event evs[256];
+			uint8_t buf[65536];
+			while (!bStop) {
+				int k = ::epoll_wait(ep, evs, size(evs), 100);
+				for (int i = 0; i < k; ++i) {
+					int fd = int(evs[i].data.u64);
+					if (evs[i].data.u64 >> 32) {
+						for (int s; (s = ::accept4(fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0;) {
+							accepted.push_back(s);
+							ev.data.u64 = uint32_t(s);
+							::epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev);
+						}
+					} else if (ssize_t r = ::recv(fd, buf, sizeof buf, 0); r > 0)
+						(void)::send(fd, buf, r, MSG_NOSIGNAL);					// probes fit the socket buffer
+					else if (r == 0)
+						::epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+				}
+			}
+			::close(ep);
+		});
+
+		BenchResult res;
+		res.Mode = mode;
+		res.Bytes = 0;
+		res.Handshakes = 0;
+		res.Connections = 0;
+		vector<int> clients(n, -1);
+		pid_t pid = -1;
+		exception_ptr exc;
+		try {
+			pid = StartSocksd("coro", sa);
+			this_thread::sleep_for(chrono::milliseconds(500));
+			res.RssBefore = ProcessRss(pid);
+
+			atomic<size_t> next(0), established(0);
+			atomic<bool> bFailed(false);
+			vector<thread> threads;
+			rusage ru0, ru1;
+			::getrusage(RUSAGE_SELF, &ru0);
+			Clock::time_point t0 = Clock::now();
+			for (size_t k = 0, nThreads = (min)(n, size_t(64)); k < nThreads; ++k)
+				threads.emplace_back([&] {
+					for (size_t i; !bFailed && (i = next++) < n;) {
+						if ((clients[i] = OpenIdleTunnel(i, proxyPort, targetPort)) < 0)
+							bFailed = true;
+						else
+							++established;
+					}
+				});
+			for (auto& t : threads)
+				t.join();
+			res.Seconds = chrono::duration<double>(Clock::now() - t0).count();
+			::getrusage(RUSAGE_SELF, &ru1);
+			res.Connections = established;
+			res.UserCpu = TimevalSec(ru1.ru_utime) - TimevalSec(ru0.ru_utime);
+			res.SysCpu = TimevalSec(ru1.ru_stime) - TimevalSec(ru0.ru_stime);
+			res.CtxSwitches = (ru1.ru_nvcsw + ru1.ru_nivcsw) - (ru0.ru_nvcsw + ru0.ru_nivcsw);
+			if (bFailed)
+				cerr << mode << ": stopped at " << res.Connections << " tunnels, see the ephemeral port range and tcp_mem" << endl;
+
+			this_thread::sleep_for(chrono::seconds(Seconds));		// the child's loop settles, the tunnels stay idle
+			res.RssAfter = ProcessRss(pid);
+
+			res.Lost = n - res.Connections;
+			vector<uint8_t> buf(ProbeSize, 'p');
+			for (size_t i = 0; i < n; i += (max)(n / 1000, size_t(1))) {
+				if (clients[i] < 0)
+					continue;
+				Clock::time_point t1 = Clock::now();
+				try {
+					SendAll(clients[i], buf.data(), buf.size());
+					RecvAll(clients[i], buf.data(), buf.size());
+				} catch (RCExc) {									// closed by socksd while idle
+					++res.Lost;
+					continue;
+				}
+				res.RttNs.push_back(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - t1).count());
+			}
+			if (res.Lost) {
+				cerr << mode << ": " << res.Lost << " tunnels lost" << endl;
+				res.Failed = true;
+			}
+			if (res.RssPerTunnel() > int64_t(IDLE_BUDGET)) {
+				cerr << mode << ": over the budget of " << IDLE_BUDGET << " bytes per tunnel" << endl;
+				res.Failed = true;
+			}
+		} catch (RCExc) {
+			exc = current_exception();
+		}
+		linger li = { 1, 0 };										// reset, so that a million sockets do not linger in TIME_WAIT
+		for (int c : clients)
+			if (c >= 0) {
+				::setsockopt(c, SOL_SOCKET, SO_LINGER, &li, sizeof li);
+				::close(c);
+			}
+		if (pid > 0)
+			StopSocksd(pid);
+		bStop = true;
+		target.join();
+		for (int fd : accepted)
+			::close(fd);
+		for (int fd : listeners)
+			::close(fd);
+		if (exc)
+			rethrow_exception(exc);
+		return res;
+	}
+
+	// -n clients at a time open a SOCKS5 tunnel through a socksd -e engine child to an echo target, echo SOCKSD_EXCHANGES
+	// messages of -s bytes over it and reset it: socksd's own handshake, connect and relay code, which make pgo trains.
+	// Bytes are echoed bytes, RttNs is connect to the CONNECT reply, CPU includes the child's
+	BenchResult RunSocksd(RCString mode, const char *engine) {
+		sockaddr_in sa, st;
+		{
+			int s = ListenLoopback(sa);								// a free port for the child
+			::close(s);
+		}
+		int fdTarget = ListenLoopback(st);
+		uint16_t targetPort = ntohs(st.sin_port);
+		thread_group tg;
+		thread acceptor([&] {
+			for (int s; (s = ::accept4(fdTarget, nullptr, nullptr, SOCK_CLOEXEC)) >= 0 || errno == EINTR || errno == ECONNABORTED;)
+				if (s >= 0) {
+					ptr<CEchoTarget> t = new CEchoTarget(tg, s);
+					t->Start();
+				}
+		});
+		CSyscallCounter syscalls;								// before the fork: the child inherits it
+		pid_t pid = -1;
+		exception_ptr exc;
+		BenchResult res;
+		res.Mode = mode;
+		res.Handshakes = 0;
+		try {
+			pid = StartSocksd(engine, sa);
+
+			atomic<uint64_t> connections(0), received(0);
+			atomic<bool> bStop(false);
+			vector<vector<int64_t>> rtts(Tunnels);
+			vector<thread> clients;
+			for (int i = 0; i < Tunnels; ++i)
+				clients.emplace_back([&, i] {
+					const uint8_t req[] = { 5, 1, 0,										// no authentication, and without waiting:
+						5, 1, 0, 1, 127, 0, 0, 1, uint8_t(targetPort >> 8), uint8_t(targetPort) };	// CONNECT 127.0.0.1
+					vector<uint8_t> buf((max)(MsgSize, size_t(12)), 'x');
+					linger li = { 1, 0 };
+					while (!bStop) {
+						Clock::time_point t0 = Clock::now();
+						int c = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+						if (c < 0)
+							break;
+						try {
+							CCheck(::connect(c, (const sockaddr*)&sa, sizeof sa));
+							SendAll(c, req, sizeof req);
+							RecvAll(c, buf.data(), 12);
+							if (buf[1] || buf[3])
+								Throw(errc::connection_refused);
+							rtts[i].push_back(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - t0).count());
+							for (int k = 0; k < SOCKSD_EXCHANGES; ++k) {
+								SendAll(c, buf.data(), MsgSize);
+								RecvAll(c, buf.data(), MsgSize);
+								received += MsgSize;
+							}
+							++connections;
+						} catch (RCExc) {
+						}
+						::setsockopt(c, SOL_SOCKET, SO_LINGER, &li, sizeof li);
+						::close(c);
+					}
+				});
+
+			double user0, sys0, user1, sys1;
+			rusage ru0, ru1;
+			ProcessCpu(pid, user0, sys0);
+			::getrusage(RUSAGE_SELF, &ru0);
+			uint64_t conns0 = connections, bytes0 = received;
+			int64_t syscalls0 = syscalls.Read();
+			Clock::time_point t0 = Clock::now();
+			this_thread::sleep_for(chrono::seconds(Seconds));
+			res.Connections = connections - conns0;
+			res.Bytes = received - bytes0;
+			res.Seconds = chrono::duration<double>(Clock::now() - t0).count();
+			if (syscalls0 >= 0)
+				res.Syscalls = syscalls.Read() - syscalls0;
+			::getrusage(RUSAGE_SELF, &ru1);
+			ProcessCpu(pid, user1, sys1);
+			bStop = true;
+			for (auto& t : clients)
+				t.join();
+
+			res.UserCpu = TimevalSec(ru1.ru_utime) - TimevalSec(ru0.ru_utime) + user1 - user0;
+			res.SysCpu = TimevalSec(ru1.ru_stime) - TimevalSec(ru0.ru_stime) + sys1 - sys0;
+			res.CtxSwitches = (ru1.ru_nvcsw + ru1.ru_nivcsw) - (ru0.ru_nvcsw + ru0.ru_nivcsw);
+			for (auto& v : rtts)
+				res.RttNs.insert(res.RttNs.end(), v.begin(), v.end());
+			if (!res.Connections)
+				Throw(errc::connection_refused);
+		} catch (RCExc) {
+			exc = current_exception();
+		}
+		if (pid > 0)
+			StopSocksd(pid);
+		::shutdown(fdTarget, SHUT_RDWR);
+		acceptor.join();
+		::close(fdTarget);
+		tg.interrupt_all();
+		tg.join_all();
+		tg.m_bSync = false;
+		if (exc)
+			rethrow_exception(exc);
+		return res;
+	}
+
+	BenchResult Run(RCString mode) {
+		if (mode == "spawn" || mode == "pool")
+			return RunAccept(mode);
+		if (!strncmp(mode.c_str(), "socksd-", 7))
+			return RunSocksd(mode, mode.c_str() + 7);
+		if (mode == "parse")
+			return RunParse(mode);
+		if (mode == "idle")
+			return RunIdle(mode);
+		sockaddr_in sa;
+		int fdListen = ListenLoopback(sa);
+		vector<BenchTunnel> tunnels(Tunnels + 1);		// the last one carries the latency probe
+		for (auto& t : tunnels) {
+			tie(t.Cli, t.S) = TcpPair(fdListen, sa);
+			tie(t.D, t.Srv) = TcpPair(fdListen, sa);
+		}
+		::close(fdListen);
+		BenchTunnel& probe = tunnels.back();
+		for (int fd : { probe.Cli, probe.S, probe.D, probe.Srv }) {
+			int on = 1;
+			::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+		}
+
+		CSyscallCounter syscalls;								// before the pumps start
+		thread_group tg;
+		ptr<Thread> engine;
+		try {
+			StartPumps(mode, tg, tunnels, engine);
+		} catch (RCExc) {
+			for (auto& t : tunnels)
+				for (int fd : { t.Cli, t.S, t.D, t.Srv })
+					if (fd >= 0)
+						::close(fd);
+			throw;
+		}
+
+		atomic<uint64_t> received(0);
+		atomic<bool> bStop(false);
+		vector<thread> threads;
+		auto sender = [this, &bStop](int fd) {
+			vector<uint8_t> buf(MsgSize, 'x');
+			try {
+				while (!bStop)
+					SendAll(fd, buf.data(), buf.size());
+			} catch (RCExc) {
+			}
+			::shutdown(fd, SHUT_WR);
+		};
+		auto receiver = [&received](int fd) {
+			uint8_t buf[65536];
+			for (ssize_t r; (r = ::recv(fd, buf, sizeof buf, 0)) > 0;)
+				received += r;
+		};
+		for (int i = 0; i < Tunnels; ++i) {
+			BenchTunnel& t = tunnels[i];
+			if (Dir != Duplex::Down) {
+				threads.emplace_back(sender, t.Cli);
+				threads.emplace_back(receiver, t.Srv);
+			}
+			if (Dir != Duplex::Up) {
+				threads.emplace_back(sender, t.Srv);
+				threads.emplace_back(receiver, t.Cli);
+			}
+		}
+
+		BenchResult res;
+		res.Mode = mode;
+		res.Connections = 0;
+		res.Handshakes = 0;
+		threads.emplace_back([this, &probe] {
+			vector<uint8_t> buf(ProbeSize);
+			try {
+				while (true) {
+					RecvAll(probe.Srv, buf.data(), buf.size());
+					SendAll(probe.Srv, buf.data(), buf.size());
+				}
+			} catch (RCExc) {
+			}
+			::shutdown(probe.Srv, SHUT_WR);
+		});
+		threads.emplace_back([this, &probe, &bStop, &res] {
+			vector<uint8_t> buf(ProbeSize, 'p');
+			try {
+				while (!bStop) {
+					Clock::time_point t0 = Clock::now();
+					SendAll(probe.Cli, buf.data(), buf.size());
+					RecvAll(probe.Cli, buf.data(), buf.size());
+					res.RttNs.push_back(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - t0).count());
+				}
+			} catch (RCExc) {
+			}
+			::shutdown(probe.Cli, SHUT_WR);
+		});
+
+		rusage ru0, ru1;
+		::getrusage(RUSAGE_SELF, &ru0);
+		uint64_t bytes0 = received;
+		int64_t syscalls0 = syscalls.Read();
+		Clock::time_point t0 = Clock::now();
+		this_thread::sleep_for(chrono::seconds(Seconds));
+		res.Bytes = received - bytes0;
+		res.Seconds = chrono::duration<double>(Clock::now() - t0).count();
+		if (syscalls0 >= 0)
+			res.Syscalls = syscalls.Read() - syscalls0;
+		::getrusage(RUSAGE_SELF, &ru1);
+		bStop = true;
+
+		res.UserCpu = TimevalSec(ru1.ru_utime) - TimevalSec(ru0.ru_utime);
+		res.SysCpu = TimevalSec(ru1.ru_stime) - TimevalSec(ru0.ru_stime);
+		res.CtxSwitches = (ru1.ru_nvcsw + ru1.ru_nivcsw) - (ru0.ru_nvcsw + ru0.ru_nivcsw);
+
+		for (auto& t : threads)
+			t.join();
+		for (auto& t : tunnels) {
+			::close(t.Cli);
+			::close(t.Srv);
+		}
+		if (engine)
+			engine->Stop();
+		tg.interrupt_all();
+		tg.join_all();
+		tg.m_bSync = false;
+		return res;
+	}
+
+	unordered_map<string, string> m_baseline;				// mode -> its line of the -B output
+
+	void LoadBaseline() {
+		if (BaselineFile.empty())
+			return;
+		ifstream ifs(BaselineFile.c_str());
+		if (!ifs)
+			cerr << BaselineFile << ": no baseline to compare with" << endl;
+		static const char s_modeKey[] = "\"mode\": \"";
+		for (string line; getline(ifs, line);) {
+			size_t pos = line.find(s_modeKey);
+			if (pos != string::npos) {
+				pos += sizeof s_modeKey - 1;
+				m_baseline[line.substr(pos, line.find('"', pos) - pos)] = line;
+			}
+		}
+	}
+
+	// Numeric value of "key" in a line of PrintJson() output, 0 if absent
+	static double JsonNumber(const string& line, const char *key) {
+		size_t pos = line.find("\"" + string(key) + "\": ");
+		return pos == string::npos ? 0 : atof(line.c_str() + pos + strlen(key) + 4);
+	}
+
+	// Ratios this run / baseline of the rates, costs and latencies both lines have: above 1 is better for the rates
+	void AppendVsBaseline(string& line, RCString mode) {
+		static const char * const s_keys[] = { "gbit_per_s", "cpu_s_per_gbit", "handshakes_per_s", "cpu_ns_per_handshake", "allocs_per_handshake", "conns_per_s",
+			"cpu_us_per_conn", "syscalls_per_gbit", "syscalls_per_conn", "rss_bytes_per_tunnel", "p50", "p99", "p999" };
+		auto it = m_baseline.find(mode.c_str());
+		if (it == m_baseline.end())
+			return;
+		ostringstream os;
+		const char *sep = "";
+		for (const char *key : s_keys) {
+			double base = JsonNumber(it->second, key), cur = JsonNumber(line, key);
+			if (base && cur) {
+				os << sep << "\"" << key << "\": " << cur / base;
+				sep = ", ";
+			}
+		}
+		line += ", \"vs_baseline\": {" + os.str() + "}";
+	}
+
+	void PrintJson(ostream& os, vector<BenchResult>& results) {
+		os << "[";
+		for (size_t i = 0; i < results.size(); ++i) {
+			BenchResult& r = results[i];
+			double gbit = r.Bytes * 8 / 1e9, cpu = r.UserCpu + r.SysCpu;
+			vector<int64_t>& rtt = r.RttNs;
+			sort(rtt.begin(), rtt.end());
+			auto pct = [&rtt](double q) {
+				return rtt.empty() ? 0.0 : rtt[(min)(rtt.size() - 1, size_t(q * rtt.size()))] / 1e3;
+			};
+			ostringstream line;
+			line << "{\"mode\": \"" << r.Mode << "\""
+				<< ", \"msg_size\": " << MsgSize
+				<< ", \"tunnels\": " << Tunnels
+				<< ", \"duplex\": \"" << s_duplexNames[int(Dir)] << "\""
+				<< ", \"seconds\": " << r.Seconds
+				<< ", \"bytes\": " << r.Bytes
+				<< ", \"gbit_per_s\": " << gbit / r.Seconds
+				<< ", \"cpu_user_s\": " << r.UserCpu
+				<< ", \"cpu_sys_s\": " << r.SysCpu
+				<< ", \"cpu_s_per_gbit\": " << (gbit ? cpu / gbit : 0.0)
+				<< ", \"ctx_switches\": " << r.CtxSwitches;
+			if (r.Syscalls >= 0) {
+				line << ", \"syscalls_per_s\": " << r.Syscalls / r.Seconds;
+				if (gbit)
+					line << ", \"syscalls_per_gbit\": " << r.Syscalls / gbit;
+				if (r.Connections)
+					line << ", \"syscalls_per_conn\": " << double(r.Syscalls) / r.Connections;
+			}
+			if (r.Handshakes)
+				line << ", \"corpus_rejected\": " << r.Rejected
+					<< ", \"handshakes\": " << r.Handshakes
+					<< ", \"handshakes_per_s\": " << r.Handshakes / r.Seconds
+					<< ", \"handshakes_per_s_per_thread\": " << r.Handshakes / r.Seconds / Tunnels
+					<< ", \"cpu_ns_per_handshake\": " << cpu * 1e9 / r.Handshakes;
+			if (r.AllocsPerHandshake >= 0) {
+				line << ", \"allocs_per_handshake\": " << r.AllocsPerHandshake << ", \"allocs\": {";
+				for (size_t j = 0; j < r.FileAllocs.size(); ++j)
+					line << (j ? ", " : "") << "\"" << r.FileAllocs[j].first << "\": " << r.FileAllocs[j].second;
+				line << "}";
+			}
+			if (r.RssAfter && r.Connections)
+				line << ", \"idle_tunnels\": " << r.Connections
+					<< ", \"socksd_rss_kib\": " << r.RssAfter / 1024
+					<< ", \"rss_bytes_per_tunnel\": " << r.RssPerTunnel()
+					<< ", \"budget_bytes_per_tunnel\": " << IDLE_BUDGET
+					<< ", \"lost_tunnels\": " << r.Lost;
+			if (r.Failed)
+				line << ", \"failed\": true";
+			if (r.Connections)
+				line << ", \"connections\": " << r.Connections
+					<< ", \"conns_per_s\": " << r.Connections / r.Seconds
+					<< ", \"cpu_us_per_conn\": " << cpu * 1e6 / r.Connections;
+			line << ", \"latency_us\": {"
+					<< "\"probe_size\": " << ProbeSize
+					<< ", \"samples\": " << rtt.size()
+					<< ", \"p50\": " << pct(0.5)
+					<< ", \"p99\": " << pct(0.99)
+					<< ", \"p999\": " << pct(0.999)
+					<< ", \"max\": " << (rtt.empty() ? 0.0 : rtt.back() / 1e3)
+				<< "}";
+			string str = line.str();
+			AppendVsBaseline(str, r.Mode);
+			os << (i ? "," : "") << "\n  " << str << "}";
+		}
+		os << "\n]" << endl;
+	}
+} theApp;
+
+EXT_DEFINE_MAIN(theApp)
@@ -0,0 +1,19 @@
+/*######   Copyright (c) 2013-2020 Ufasoft  http://ufasoft.com  mailto:support@ufasoft.com,  Sergey Pavlov  mailto:dev@ufasoft.com ####
+#                                                                                                                                     #
+# 		See LICENSE for licensing information                                                                                         #
+#####################################################################################################################################*/
+
+// libFuzzer target over the handshake parsers, built by ./configure --enable-fuzz with clang:
+//	socksd-fuzz -max_len=1024 fuzz/corpus
+// Input layout as in the corpus: a byte of REPLAY_* flags, then the client bytes
+
+#include <el/ext.h>
+using namespace std;
+
+#include <el/inet/handshake.h>
+using namespace Ext::Inet;
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	ReplayHandshake(Span(data, size));
+	return 0;
+}
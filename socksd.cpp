@@ -7,15 +7,130 @@
 using namespace std;
 
 #include <el/inet/proxyrelay.h>
+#include <el/inet/uring.h>
+#include <el/inet/splice.h>
+#include <el/inet/sockmap.h>
+#include <el/inet/affinity.h>
+#include <el/inet/workerpool.h>
+#include <el/inet/circuitbreaker.h>
+#include <el/inet/sourcepool.h>
+#include <el/inet/tls.h>
+#include <el/inet/proxyconfig.h>
+#include <el/inet/accesslog.h>
+#include <el/inet/phasetrace.h>
+#include <el/inet/httpcache.h>
+#include <el/inet/tunnelmux.h>
+#include <el/inet/transparent.h>
+#include <el/inet/sni.h>
+#include <el/inet/tunneltable.h>
+#include <el/inet/resolver.h>
+#include <el/inet/proxyprotocol.h>
 using namespace Ext::Inet;
 
 CUsingSockets g_usingSockets;
+observer_ptr<CAccessLog> g_accessLog;
+observer_ptr<CPhaseTracer> g_phaseTracer;
+observer_ptr<CHttpCache> g_httpCache;
+observer_ptr<CMuxClient> g_muxClient;
+observer_ptr<CTunnelTable> g_tunnelTable;
+CResolverCache g_resolverCache;
+observer_ptr<CCircuitBreaker> g_circuitBreaker;
+observer_ptr<CSourceAddressPool> g_sourcePool;
+RcuPtr<ProxyConfig> g_config;
+atomic<size_t> g_connections;
+
+// Counts the connection against max_connections for its lifetime
+class CConnectionSlot {
+public:
+	const bool Admitted;
+
+	CConnectionSlot(const ProxyConfig& cfg)
+		: Admitted(++g_connections <= cfg.MaxConnections || !cfg.MaxConnections)
+	{}
+
+	~CConnectionSlot() {
+		--g_connections;
+	}
+};
+
+static void SetTimeout(int fd, int optname, int ms) {
+	timeval tv = { ms / 1000, ms % 1000 * 1000 };
+	::setsockopt(fd, SOL_SOCKET, optname, &tv, sizeof tv);
+}
+
+uint32_t g_upstreamMark;										// -M: SO_MARK of every upstream socket, 0 - none
+
+static int OpenUpstreamSocket(int family, int flags = SOCK_CLOEXEC) {
+	int fd = CCheck(::socket(family, SOCK_STREAM | flags, IPPROTO_TCP));
+	if (g_upstreamMark)
+		::setsockopt(fd, SOL_SOCKET, SO_MARK, &g_upstreamMark, sizeof g_upstreamMark);
+	return fd;
+}
+
+// An upstream connect of this process that a netfilter rule without the -M mark sent back to the transparent listener. Seen
+// with net.ipv4.tcp_fwmark_accept = 1: the accepted socket takes the mark of the SYN
+static bool IsOwnUpstream(int fd) {
+	uint32_t mark = 0;
+	socklen_t len = sizeof mark;
+	return g_upstreamMark && !::getsockopt(fd, SOL_SOCKET, SO_MARK, &mark, &len) && mark == g_upstreamMark;
+}
+
+// The addresses of a name in the order to try them: of the families the source pool has first, else as resolved. Those the
+// IP routes deny are dropped: errc::permission_denied if none is left
+static error_code OrderAddresses(vector<ResolvedAddress>& addrs, const ProxyConfig& cfg, uint16_t port) {
+	addrs.erase(remove_if(addrs.begin(), addrs.end(), [&cfg, port](const ResolvedAddress& a) {
+		return !cfg.IsAddressAllowed(a.ToEndPoint(port));
+	}), addrs.end());
+	if (addrs.empty())
+		return make_error_code(errc::permission_denied);
+	if (g_sourcePool)
+		stable_partition(addrs.begin(), addrs.end(), [](const ResolvedAddress& a) {
+			return g_sourcePool->HasFamily(a.Kind == ProxyEndPoint::IPv6 ? AF_INET6 : AF_INET);
+		});
+	return error_code();
+}
+bool g_bProxyProtocolIn, g_bProxyProtocolOut;
+#if UCFG_INET_AFFINITY
+Steering g_steering = Steering::None;
+PlacementStats g_placement;
+#endif
+
+static void LogTunnel(AccessRecord rec, uint64_t bytesUp, uint64_t bytesDown, const PhaseTimes *phases = nullptr) {
+	if (g_phaseTracer && phases)
+		g_phaseTracer->Record(*phases, rec);
+	if (g_accessLog) {
+		rec.End(bytesUp, bytesDown);
+		g_accessLog->Push(rec);
+	}
+}
 
 
 class CSocksThread : public SocketThread, public CSocketLooper {
 	typedef SocketThread base;
 public:
 	Socket m_sock, m_sockD;
+#if HAVE_LINUX_IO_URING_H
+	observer_ptr<CUringEngine> m_engine;
+#endif
+#if UCFG_INET_TLS
+	observer_ptr<CTlsContext> m_tls;						// TLS listener: the handshake starts with a TLS ClientHello
+#endif
+	uint16_t m_transparentPort;								// redirected by netfilter to this listening port: no handshake
+	static bool s_bSplice;
+#if HAVE_LINUX_BPF_H
+	static observer_ptr<CSockMap> s_sockMap;
+#endif
+
+	CSocksThread(thread_group *tg = nullptr)
+		: base(tg)
+#if HAVE_LINUX_IO_URING_H
+		, m_engine(nullptr)
+#endif
+#if UCFG_INET_TLS
+		, m_tls(nullptr)
+#endif
+		, m_transparentPort(0)
+	{}
 
 	void Stop() override {
 		base::Stop();
@@ -23,52 +138,970 @@ public:
 		m_sockD.Close();
 	}
 protected:
-	ptr<CProxyRelay> m_relay;
+	CProxyRelayHolder m_relay;
+	shared_ptr<const ProxyConfig> m_cfg;
+	PhaseTimes m_phases;
 
-	void Execute() override {
+	void ConnectTo(const IPEndPoint& ep, int fd = -1) {
+		if (fd < 0 && g_upstreamMark)
+			fd = OpenUpstreamSocket(ep.c_sockaddr()->sa_family);
+#if HAVE_LINUX_IO_URING_H
+		if (m_engine) {
+			if (error_code ec = m_engine->Connect(m_sockD, ep, m_cfg->ConnectTimeoutMs ? m_cfg->ConnectTimeoutMs : 60000, fd))
+				throw system_error(ec);
+			return;
+		}
+#endif
+		if (fd < 0 && !m_cfg->ConnectTimeoutMs) {
+			m_sockD.Connect(ep);
+			return;
+		}
+		if (fd < 0)
+			fd = OpenUpstreamSocket(ep.c_sockaddr()->sa_family);
+		if (m_cfg->ConnectTimeoutMs)
+			SetTimeout(fd, SO_SNDTIMEO, m_cfg->ConnectTimeoutMs);			// bounds a blocking connect()
+		if (::connect(fd, ep.c_sockaddr(), socklen_t(ep.sockaddr_len())) < 0) {
+			int err = errno == EINPROGRESS ? ETIMEDOUT : errno;
+			::close(fd);
+			throw system_error(error_code(err, system_category()));
+		}
+		if (m_cfg->ConnectTimeoutMs)
+			SetTimeout(fd, SO_SNDTIMEO, 0);									// else a relay write to a slow peer fails with EAGAIN
+		m_sockD.Attach(fd);
+	}
+
+	// The source address must match the destination's family: dst is an address, resolved by ResolveTarget()
+	void ConnectFromPool(const ProxyEndPoint& dst, const ProxyEndPoint& client) {
+		IPEndPoint ep = dst.ToIPEndPoint();
+		if (!g_sourcePool->HasFamily(ep.c_sockaddr()->sa_family)) {
+			ConnectTo(ep);
+			return;
+		}
+		uint64_t hint = CSourceAddressPool::Hint(client, ep);
+#if HAVE_LINUX_IO_URING_H
+		if (m_engine) {												// the same retries as CSourceAddressPool::Connect()
+			uint64_t first = g_sourcePool->First(hint);
+			for (unsigned attempt = 0;; ++attempt)
+				try {
+					ConnectTo(ep, g_sourcePool->OpenSocket(ep, first, attempt));
+					return;
+				} catch (const system_error& ex) {
+					if (ex.code() != errc::address_not_available || attempt + 1 >= g_sourcePool->Count(ep.c_sockaddr()->sa_family))
+						throw;
+					++g_sourcePool->AddrNotAvail;
+				}
+		}
+#endif
+		g_sourcePool->Connect(m_sockD, ep, hint, m_cfg->ConnectTimeoutMs);
+	}
+
+	// Alone, for upstreams whose first payload is not at hand. Pushed at once unless flags has MSG_MORE: a server that speaks
+	// first (SMTP, FTP) waits for the header
+	void SendProxyHeader(const ProxyEndPoint& client, int flags = 0) {
+		uint8_t hdr[PROXY_V2_MAX_SIZE];
+		SendVector v;
+		v.Add(hdr, FormatProxyHeaderV2(hdr, client, ProxyEndPoint(m_sockD.RemoteEndPoint)));
+		v.Send((int)Socket::HandleAccess(m_sockD), flags);
+	}
+
+	static const int SNI_PEEK_TIMEOUT_MS = 3000;				// without a handshake timeout
+
+	// Route by the server name of the ClientHello, which is read ahead into stm and stays there for the upstream. None if the
+	// client sends something else, or nothing in time: the relay then sees the same
+	SniAction RouteBySni(CReadAheadStream& stm, int fdClient) {
+		if (!m_cfg->HandshakeTimeoutMs)
+			SetTimeout(fdClient, SO_RCVTIMEO, SNI_PEEK_TIMEOUT_MS);
+		try {
+			Span name;
+			for (size_t need = 1;;) {
+				Span s = stm.Peek(need);									// throws message_size for a hello past the buffer
+				switch (FindSni(s, name)) {
+				case SniResult::Found:
+					return m_cfg->RouteSni(ProxyEndPoint::FromHost((const char*)name.data(), name.size(), 443));
+				case SniResult::None:
+					return SniAction::None;
+				default:
+					need = s.size() + 1;
+				}
+			}
+		} catch (RCExc) {
+		}
+		return SniAction::None;
+	}
+
+	// A host name is resolved here, through the resolver cache, when its address is needed: for the source pool, for a socket
+	// marked before it connects, or for the IP routes, which see the address the name stands for. Returns false if it is not.
+	// Throws errc::permission_denied if they deny every address
+	bool ResolveTarget(const ProxyEndPoint& target, vector<ResolvedAddress>& addrs) {
+		if (target.IsIP() || (!g_sourcePool && !g_upstreamMark && !m_cfg->HasAddressRoutes()))
+			return false;
+		ProxyEndPoint first;
+		error_code ec;
+		g_resolverCache.Lookup(QueryType::Resolve, target, first, ec, &addrs);
+		if (ec)
+			throw system_error(ec);
+		m_phases.Mark(PhaseTimes::Resolve);
+		if ((ec = OrderAddresses(addrs, *m_cfg, target.Port)))
+			throw system_error(ec);
+		return true;
+	}
+
+	void ConnectAddress(const ProxyEndPoint& dst, const ProxyEndPoint& client) {
+		if (g_sourcePool)
+			ConnectFromPool(dst, client);
+		else
+			ConnectTo(dst.ToIPEndPoint());
+	}
+
+	// Connects m_sockD, the circuit breaker sees the outcome. The addresses of a resolved name are tried in turn, as a
+	// DnsEndPoint connect does
+	void ConnectTarget(const ProxyEndPoint& target, const ProxyEndPoint& client) {
+		vector<ResolvedAddress> addrs;
+		bool bResolved = ResolveTarget(target, addrs);
+		bool bConnecting = false;
 		try {
-			NetworkStream stm(m_sock);
-			uint8_t ver;
-			stm.ReadBuffer(&ver, 1);
-			switch (ver) {
-			case 4: m_relay = CProxyRelay::CreateSocks4Relay(); break;
-			case 5: m_relay = CProxyRelay::CreateTorSocks5Relay(); break;
-			default: m_relay = CProxyRelay::CreateHttpRelay();
+			if (g_circuitBreaker) {
+				error_code ec;
+				if (!g_circuitBreaker->Admit(target, ec))
+					throw system_error(ec);
+				bConnecting = true;
 			}
-			m_relay->m_pStm = &stm;
+			if (bResolved) {
+				for (size_t i = 0;; ++i)
+					try {
+						ConnectAddress(addrs[i].ToEndPoint(target.Port), client);
+						break;
+					} catch (const system_error&) {
+						if (i + 1 == addrs.size())
+							throw;
+						m_sockD.Close();
+					}
+			} else if (!target.IsIP())
+				m_sockD.Connect(target.ToDnsEndPoint());
+			else
+				ConnectAddress(target, client);
+			m_phases.Mark(PhaseTimes::Connect);
+		} catch (const system_error& ex) {
+			if (bConnecting)
+				g_circuitBreaker->OnResult(target, ex.code());
+			throw;
+		}
+		if (bConnecting)
+			g_circuitBreaker->OnResult(target, error_code());
+	}
 
+	void Execute() override {
+		m_phases = PhaseTimes();
+		m_phases.Mark(PhaseTimes::Accept);
+		AccessRecord rec;
+		rec.Begin();
+		uint64_t bytesUp = 0, bytesDown = 0;
+#if UCFG_INET_AFFINITY
+		int rxCpu = SteerToSocket((int)Socket::HandleAccess(m_sock), g_steering);		// before anything is allocated, so buffers are first touched on the node
+#endif
+		m_cfg = g_config.Get();
+		CConnectionSlot slot(*m_cfg);
+		if (!slot.Admitted) {
+			rec.Error = int(errc::too_many_files_open);
+			LogTunnel(rec, 0, 0);
+			return;
+		}
+		int fdClient = (int)Socket::HandleAccess(m_sock);
+		CTunnelEntry tunnel(g_tunnelTable, fdClient);				// gone before the sockets are closed
+		if (m_cfg->HandshakeTimeoutMs)
+			SetTimeout(fdClient, SO_RCVTIMEO, m_cfg->HandshakeTimeoutMs);
+		try {
+			NetworkStream sockStream(m_sock);
+			Stream *pClientStm = &sockStream;
+			bool bProxyHeader = g_bProxyProtocolIn && !m_transparentPort, bTls = false;
+#if UCFG_INET_TLS
+			unique_ptr<CTlsStream> tls;
+			if (m_tls) {
+				if (exchange(bProxyHeader, false)) {						// in clear text, before the ClientHello
+					ProxyProtocolHeader hdr;
+					ReadProxyHeader(fdClient, hdr);
+					rec.Client = hdr.Src;
+				}
+				tls.reset(new CTlsStream(*m_tls, fdClient));
+				bTls = true;
+				if (!tls->IsKernel())
+					pClientStm = tls.get();
+			}
+#endif
+			CReadAheadStream stm(*pClientStm);
+			if (bProxyHeader) {
+				ProxyProtocolHeader hdr;
+				stm.ReadProxyHeader(hdr);
+				rec.Client = hdr.Src;
+			}
+			if (!rec.Client.IsIP() && (g_accessLog || g_bProxyProtocolOut || g_sourcePool))
+				rec.Client = ProxyEndPoint(m_sock.RemoteEndPoint);
 			DBG_LOCAL_IGNORE_CONDITION(errc::connection_aborted);
 
-			CProxyQuery target = m_relay->GetQuery(ver);
+			CProxyRelay *relay = nullptr;							// none for transparent connections
+			CProxyQuery target;
+			if (m_transparentPort) {
+				target.Typ = QueryType::Connect;
+				target.Ep = GetOriginalDestination(fdClient);
+				if (target.Ep.Port == m_transparentPort || IsOwnUpstream(fdClient)) {		// not redirected, or a loop
+					rec.Error = int(errc::protocol_error);
+					LogTunnel(rec, 0, 0, &m_phases);
+					return;
+				}
+			} else {
+				HandshakeKind kind;
+				for (size_t need = 1; (kind = SniffHandshake(stm.Peek(need))) == HandshakeKind::Unknown;)
+					need = stm.Unread().size() + 1;
+				m_phases.Mark(PhaseTimes::Version);
+				rec.Ver = *stm.Unread().data();
+				switch (kind) {
+				case HandshakeKind::Invalid:
+				case HandshakeKind::Tls:								// TLS to a plain listener
+				case HandshakeKind::ProxyHeader:						// not expected, or a second one
+					rec.Error = int(errc::protocol_error);
+					LogTunnel(rec, 0, 0, &m_phases);
+					return;
+				default:
+					break;
+				}
+				uint8_t ver;
+				stm.ReadBuffer(&ver, 1);
+				relay = &m_relay.Emplace(kind);
+				relay->m_pStm = &stm;
+				relay->m_pUsers = &m_cfg->Users;
+				target = relay->GetQuery(ver);
+			}
+			m_phases.Mark(PhaseTimes::Query);
+			rec.Typ = target.Typ;
+			rec.Target = target.Ep;
+			tunnel.Describe(rec.Client, rec.Target);
+			tunnel.SetState(TunnelState::Connect);
+
+			bool bMux = g_muxClient && pClientStm == &sockStream;		// the stream is relayed from the raw socket
+			string httpHead, cacheKey;								// plain HTTP request: its header lines are read here, not relayed
+			if (g_httpCache && relay && relay->m_qs && !bTls && !bMux && target.Typ == QueryType::Connect) {
+				Span reqLine = relay->m_qs->AsSpan();
+				httpHead = string((const char*)reqLine.data(), reqLine.size()) + (relay->m_bHead ? string() : ReadHttpHead(stm));
+				cacheKey = CHttpCache::Key(target.Ep, httpHead);
+			}
+
+			// With SNI rules a tunnel to 443 is answered before it is connected: the ClientHello that follows picks the route
+			SniAction sniRoute = SniAction::None;
+			bool bOptimistic = !m_cfg->SniRoutes.empty() && target.Typ == QueryType::Connect && target.Ep.Port == 443
+				&& !(relay && relay->m_qs) && m_cfg->IsAllowed(target.Ep);
+			if (bOptimistic) {
+				if (relay)
+					relay->SendReply(ProxyEndPoint());
+				m_phases.Mark(PhaseTimes::Reply);
+				sniRoute = RouteBySni(stm, fdClient);
+			}
 
-			IPEndPoint epResult;
+			ProxyEndPoint epResult;
+			shared_ptr<CMuxStream> mux;
 			try {
 				DBG_LOCAL_IGNORE_CONDITION(errc::timed_out);
 
+				if (!m_cfg->IsAllowed(target.Ep) || sniRoute == SniAction::Deny)
+					throw system_error(make_error_code(errc::permission_denied));
 				switch (target.Typ) {
 				case QueryType::Connect:
-					m_sockD.Connect(*target.Ep);
-					epResult = m_sockD.RemoteEndPoint;
+					if (!cacheKey.empty()) {
+						bool bHit;
+						tie(bytesUp, bytesDown) = g_httpCache->Serve(cacheKey, httpHead, fdClient, [this, &target, &rec] {
+							ConnectTarget(target.Ep, rec.Client);
+							if (g_bProxyProtocolOut)
+								SendProxyHeader(rec.Client, MSG_MORE);		// the request follows at once
+							return (int)Socket::HandleAccess(m_sockD);
+						}, bHit);
+						rec.CacheHit = bHit;
+						m_phases.Mark(PhaseTimes::Reply);
+						LogTunnel(rec, bytesUp, bytesDown, &m_phases);
+						return;
+					}
+					if (bMux && sniRoute != SniAction::Direct) {	// the peer instance connects, its circuit breaker and source pool apply
+						mux = g_muxClient->Open(target.Ep, rec.Client, m_cfg->ConnectTimeoutMs);
+						m_phases.Mark(PhaseTimes::Connect);
+						epResult = mux->Bound;
+						break;
+					}
+					ConnectTarget(target.Ep, rec.Client);
+					epResult = ProxyEndPoint(m_sockD.RemoteEndPoint);
+					break;
+				case QueryType::Resolve:
+				case QueryType::RevResolve:
+					{
+						error_code ec;
+						g_resolverCache.Lookup(target.Typ, target.Ep, epResult, ec);
+						if (ec)
+							throw system_error(ec);
+						m_phases.Mark(PhaseTimes::Resolve);
+					}
 					break;
 				default:
 					Throw(E_NOTIMPL);
 				}
 			} catch (const system_error& ex) {
-				m_relay->SendReply(IPEndPoint(), ex.code());
+				rec.Error = ex.code().value();
+				if (!bOptimistic) {									// else the client just sees the connection closed
+					if (relay)
+						relay->SendReply(ProxyEndPoint(), ex.code());
+					m_phases.Mark(PhaseTimes::Reply);
+				}
+				LogTunnel(rec, 0, 0, &m_phases);
+				return;
+			}
+			if (!bOptimistic) {
+				if (relay)
+					relay->SendReply(epResult);
+				m_phases.Mark(PhaseTimes::Reply);
+			}
+			if (m_cfg->HandshakeTimeoutMs || bOptimistic)
+				SetTimeout(fdClient, SO_RCVTIMEO, 0);						// idle tunnels are legal
+			if (target.Typ != QueryType::Connect) {					// Tor RESOLVE: the reply is the whole exchange
+				LogTunnel(rec, 0, 0, &m_phases);
+				return;
+			}
+			tunnel.SetState(TunnelState::Relay, mux ? -1 : (int)Socket::HandleAccess(m_sockD));
+			if (mux) {
+				if (relay && relay->m_qs)
+					mux->Write(relay->m_qs->AsSpan());
+				mux->Write(stm.Unread());
+				relay = nullptr;
+				m_relay.Reset();
+				tie(bytesUp, bytesDown) = mux->Relay(fdClient, m_bStop);
+				LogTunnel(rec, bytesUp, bytesDown, &m_phases);
 				return;
 			}
-			m_relay->SendReply(epResult);
 			NoSignal = true;
 			{
-				NetworkStream targetStream(m_sockD);
-				m_relay->AfterConnect(targetStream);
+				uint8_t hdr[PROXY_V2_MAX_SIZE];
+				SendVector upstream;								// PROXY header, rewritten HTTP request line, bytes read ahead: one sendmsg()
+				size_t hdrSize = g_bProxyProtocolOut ? FormatProxyHeaderV2(hdr, rec.Client, epResult) : 0;
+				upstream.Add(hdr, hdrSize);
+				if (!httpHead.empty())
+					upstream.Add(httpHead.data(), httpHead.size());
+				else if (relay)
+					relay->AfterConnect(upstream);
+				upstream.Add(stm.Unread());
+				upstream.Send((int)Socket::HandleAccess(m_sockD));		// pushed even as a lone header: the client may wait for a server that speaks first
+			}
+			relay = nullptr;
+			m_relay.Reset();										// handshake state and m_qs are not needed to relay
+#if UCFG_INET_TLS
+			if (tls && !tls->IsKernel()) {							// no kTLS: OpenSSL encrypts, so no splice or sockmap
+				tie(bytesUp, bytesDown) = tls->Relay((int)Socket::HandleAccess(m_sockD), m_bStop);
+				LogTunnel(rec, bytesUp, bytesDown, &m_phases);
+				return;
+			}
+#endif
+#if HAVE_LINUX_IO_URING_H
+			if (m_engine) {
+				tunnel.Unregister();								// the ring owns and closes the sockets from now on
+				if (g_accessLog || g_phaseTracer)
+					m_engine->Relay(m_sock, m_sockD, [rec, phases = m_phases](uint64_t up, uint64_t down) {
+						LogTunnel(rec, up, down, &phases);
+					});
+				else
+					m_engine->Relay(m_sock, m_sockD);
+				return;
+			}
+#endif
+#if UCFG_INET_SPLICE
+			if (s_bSplice) {
+				if (g_phaseTracer)
+					WaitFirstByte(fdClient, (int)Socket::HandleAccess(m_sockD), m_phases, m_bStop);
+				if (tunnel)											// the table may shut the sockets down until the entry is gone, SpliceLoop closes its own
+					tie(bytesUp, bytesDown) = SpliceLoop(CCheck(::dup(fdClient)), CCheck(::dup((int)Socket::HandleAccess(m_sockD))), m_bStop);
+				else
+					tie(bytesUp, bytesDown) = SpliceLoop((int)m_sock.Detach(), (int)m_sockD.Detach(), m_bStop);
+#if UCFG_INET_AFFINITY
+				g_placement.Add(rxCpu, bytesUp + bytesDown);
+#endif
+				LogTunnel(rec, bytesUp, bytesDown, &m_phases);
+				return;
+			}
+#endif
+#if HAVE_LINUX_BPF_H
+			unsigned slot;
+			if (s_sockMap && !bTls && s_sockMap->Add((int)Socket::HandleAccess(m_sock), (int)Socket::HandleAccess(m_sockD), slot)) {
+				TRC(2, "sockmap slot " << slot);
+				rec.Offloaded = true;
+				SockMapWait((int)Socket::HandleAccess(m_sock), (int)Socket::HandleAccess(m_sockD), m_bStop);
+				s_sockMap->Remove(slot);
+			} else
+#endif
+			{
+				if (g_phaseTracer)
+					WaitFirstByte(fdClient, (int)Socket::HandleAccess(m_sockD), m_phases, m_bStop);
+				Loop(m_sock, m_sockD);
+			}
+			GetTcpBytes((int)Socket::HandleAccess(m_sockD), bytesUp, bytesDown);
+#if UCFG_INET_AFFINITY
+			g_placement.Add(rxCpu, bytesUp + bytesDown);
+#endif
+		} catch (const system_error& ex) {
+			rec.Error = ex.code().value();
+		} catch (RCExc) {
+		}
+		LogTunnel(rec, bytesUp, bytesDown, &m_phases);
+	}
+
+};
+bool CSocksThread::s_bSplice;
+#if HAVE_LINUX_BPF_H
+observer_ptr<CSockMap> CSocksThread::s_sockMap;
+#endif
+
+#if UCFG_INET_TLS
+observer_ptr<CTlsContext> g_tlsContext;
+
+// TLS listeners run a thread per connection whatever the engine: the handshake blocks, and the relay is splice() at best
+class CTlsSocksThread : public CSocksThread {
+	typedef CSocksThread base;
+public:
+	CTlsSocksThread(thread_group *tg = nullptr)
+		: base(tg)
+	{
+		m_tls = g_tlsContext;
+	}
+};
+#endif // UCFG_INET_TLS
+
+// Peer end of a multiplexed tunnel: connects the target the edge instance asked for and relays it
+class CMuxStreamThread : public CSocksThread {
+	typedef CSocksThread base;
+public:
+	CMuxStreamThread(thread_group *tg, const shared_ptr<CMuxStream>& stream)
+		: base(tg)
+		, m_stream(stream)
+	{}
+protected:
+	shared_ptr<CMuxStream> m_stream;
+
+	void Execute() override {
+		m_phases = PhaseTimes();
+		m_phases.Mark(PhaseTimes::Accept);
+		AccessRecord rec;
+		rec.Begin();
+		rec.Client = m_stream->Client;
+		rec.Target = m_stream->Target;
+		m_cfg = g_config.Get();
+		CConnectionSlot slot(*m_cfg);
+		CTunnelEntry tunnel(g_tunnelTable, -1);
+		tunnel.Describe(rec.Client, rec.Target);
+		tunnel.SetState(TunnelState::Connect);
+		ProxyEndPoint epResult;
+		try {
+			DBG_LOCAL_IGNORE_CONDITION(errc::timed_out);
+
+			if (!slot.Admitted)
+				throw system_error(make_error_code(errc::too_many_files_open));
+			if (!m_cfg->IsAllowed(rec.Target))
+				throw system_error(make_error_code(errc::permission_denied));
+			ConnectTarget(rec.Target, rec.Client);
+			epResult = ProxyEndPoint(m_sockD.RemoteEndPoint);
+			if (g_bProxyProtocolOut)
+				SendProxyHeader(rec.Client);
+		} catch (const system_error& ex) {
+			rec.Error = ex.code().value();
+		}
+		uint64_t bytesUp = 0, bytesDown = 0;
+		try {
+			m_stream->SendReply(epResult, error_code(rec.Error, system_category()));
+			m_phases.Mark(PhaseTimes::Reply);
+			if (!rec.Error) {
+				tunnel.SetState(TunnelState::Relay, (int)Socket::HandleAccess(m_sockD));
+				tie(bytesDown, bytesUp) = m_stream->Relay((int)Socket::HandleAccess(m_sockD), m_bStop);		// the stream is the client side
 			}
-			Loop(m_sock, m_sockD);
 		} catch (RCExc) {
 		}
+		LogTunnel(rec, bytesUp, bytesDown, &m_phases);
+	}
+};
+
+// Connection from an edge instance (-U): its frames are read on this thread, every stream opened gets a CMuxStreamThread
+class CMuxPeerThread : public SocketThread {
+	typedef SocketThread base;
+public:
+	Socket m_sock;
+
+	CMuxPeerThread(thread_group *tg = nullptr)
+		: base(tg)
+		, m_tg(tg)
+	{}
+
+	void Stop() override {
+		base::Stop();
+		if (m_session)
+			m_session->Close();
+	}
+protected:
+	thread_group *m_tg;
+	shared_ptr<CMuxSession> m_session;
+
+	void Execute() override {
+		thread_group *tg = m_tg;
+		m_session = make_shared<CMuxSession>((int)m_sock.Detach(), [tg](const shared_ptr<CMuxStream>& stream) {
+			ptr<CMuxStreamThread> t = new CMuxStreamThread(tg, stream);
+			t->Start();
+		}, g_config.Get()->MuxSecret);
+		m_session->Run();
+	}
+};
+
+// Pool thread: serves accepted sockets one after another, reusing its stack, access log ring and m_sock/m_sockD
+class CSocksWorker : public CSocksThread {
+	typedef CSocksThread base;
+public:
+	CSocksWorker(thread_group *tg, CWorkerPool& pool)
+		: base(tg)
+		, m_pool(pool)
+	{}
+
+	void Stop() override {
+		base::Stop();
+		m_pool.Wake();
+	}
+protected:
+	CWorkerPool& m_pool;
+
+	void Execute() override {
+		for (SOCKET s; m_pool.Take(s, m_bStop);) {
+			m_sock.Attach(s);
+			base::Execute();
+			m_sock.Close();
+			m_sockD.Close();
+			m_relay.Reset();
+			m_cfg.reset();
+		}
+	}
+};
+
+class CSocksWorkerPool : public CWorkerPool {
+	typedef CWorkerPool base;
+public:
+	CSocksWorkerPool(thread_group& tg, size_t minThreads, size_t maxThreads)
+		: base(minThreads, maxThreads)
+		, m_tg(tg)
+	{}
+protected:
+	thread_group& m_tg;
+
+	void SpawnWorker() override {
+		ptr<CSocksWorker> t = new CSocksWorker(&m_tg, *this);
+		t->Start();
+	}
+};
+
+// Accepts and posts sockets to the pool instead of starting a thread per connection
+class CPoolListenerThread : public SocketThread {
+	typedef SocketThread base;
+public:
+	CPoolListenerThread(thread_group& tg, CWorkerPool& pool, const IPEndPoint& ep)
+		: base(&tg)
+		, m_pool(pool)
+		, m_fd(CCheck(::socket(ep.c_sockaddr()->sa_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP)))
+	{
+		int on = 1;
+		::setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+		if (::bind(m_fd, ep.c_sockaddr(), socklen_t(ep.sockaddr_len())) < 0 || ::listen(m_fd, SOMAXCONN) < 0) {
+			int err = errno;
+			::close(m_fd);
+			Throw(error_code(err, system_category()));
+		}
+	}
+
+	~CPoolListenerThread() {
+		::close(m_fd);
+	}
+
+	void Stop() override {
+		base::Stop();
+		::shutdown(m_fd, SHUT_RDWR);						// wakes the blocked accept()
+	}
+protected:
+	CWorkerPool& m_pool;
+	int m_fd;
+
+	void Execute() override {
+		while (!m_bStop) {
+			int s = ::accept4(m_fd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (s < 0) {
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
+				if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+					this_thread::sleep_for(chrono::milliseconds(10));
+					continue;
+				}
+				break;
+			}
+			if (!m_pool.Post(SOCKET(s)))
+				::close(s);
+		}
 	}
 };
 
+#if UCFG_INET_TRANSPARENT
+
+// Netfilter-redirected connections (-r): a thread per connection goes straight to connect and relay, through the same engine
+// and logs as SOCKS tunnels
+class CTransparentListenerThread : public SocketThread {
+	typedef SocketThread base;
+public:
+#if HAVE_LINUX_IO_URING_H
+	observer_ptr<CUringEngine> m_engine;
+#endif
+
+	CTransparentListenerThread(thread_group& tg, const IPEndPoint& ep)
+		: base(&tg)
+#if HAVE_LINUX_IO_URING_H
+		, m_engine(nullptr)
+#endif
+		, m_tg(tg)
+		, m_port(ep.Port)
+	{
+		bool bTransparent;
+		m_fd = ListenTransparent(ep, bTransparent);
+		if (!bTransparent)
+			cerr << "IP_TRANSPARENT is not permitted (needs CAP_NET_ADMIN), port " << ep.Port << " accepts REDIRECT only" << endl;
+	}
+
+	~CTransparentListenerThread() {
+		::close(m_fd);
+	}
+
+	void Stop() override {
+		base::Stop();
+		::shutdown(m_fd, SHUT_RDWR);						// wakes the blocked accept()
+	}
+protected:
+	thread_group& m_tg;
+	uint16_t m_port;
+	int m_fd;
+
+	void Execute() override {
+		while (!m_bStop) {
+			int s = ::accept4(m_fd, nullptr, nullptr, SOCK_CLOEXEC);
+			if (s < 0) {
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
+				if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+					this_thread::sleep_for(chrono::milliseconds(10));
+					continue;
+				}
+				break;
+			}
+			ptr<CSocksThread> t = new CSocksThread(&m_tg);
+			t->m_sock.Attach(SOCKET(s));
+			t->m_transparentPort = m_port;
+#if HAVE_LINUX_IO_URING_H
+			t->m_engine = m_engine;
+#endif
+			t->Start();
+		}
+	}
+};
+
+#endif // UCFG_INET_TRANSPARENT
+
+#if HAVE_LINUX_IO_URING_H
+
+// Accepts on the ring, runs only the handshake in a thread, then gives the tunnel back to the ring
+class CSocksUringEngine : public CUringEngine {
+	typedef CUringEngine base;
+public:
+	CSocksUringEngine(thread_group& tg)
+		: base(&tg)
+		, m_tg(tg)
+	{}
+protected:
+	thread_group& m_tg;
+
+	void OnAccept(SOCKET s) override {
+		ptr<CSocksThread> t = new CSocksThread(&m_tg);
+		t->m_sock.Attach(s);
+		t->m_engine = this;
+		t->Start();
+	}
+};
+
+#endif // HAVE_LINUX_IO_URING_H
+
+#if UCFG_INET_COROUTINES
+
+// Accept, handshake, connect and relay as coroutines on a single epoll thread
+class CSocksCoroLoop : public CEpollLoop {
+	typedef CEpollLoop base;
+public:
+	CSocksCoroLoop(thread_group& tg)
+		: base(&tg)
+	{}
+
+	void AddListener(const IPEndPoint& ep) {
+		Spawn(AcceptLoop(AsyncSocket::Listen(ep)));
+	}
+private:
+	struct Tunnel {
+		AsyncSocket Sock, SockD;
+		AccessRecord Rec;
+		uint64_t Bytes[2];
+		shared_ptr<const ProxyConfig> Cfg;
+		CConnectionSlot Slot;
+		PhaseTimes Phases;
+		CTunnelEntry Entry;									// last: unregistered before the sockets are closed
+
+		Tunnel(CEpollLoop& loop, int fd)
+			: Sock(loop, fd)
+			, SockD(loop, -1)
+			, Cfg(g_config.Get())
+			, Slot(*Cfg)
+			, Entry(g_tunnelTable, fd)
+		{
+			Phases.Mark(PhaseTimes::Accept);
+			Rec.Begin();
+			Bytes[0] = Bytes[1] = 0;
+			if (g_accessLog || g_bProxyProtocolOut || g_sourcePool) {
+				sockaddr_storage ss;
+				socklen_t len = sizeof ss;
+				if (::getpeername(fd, (sockaddr*)&ss, &len) == 0)
+					Rec.Client = ProxyEndPoint(*(const sockaddr*)&ss);
+			}
+		}
+
+		~Tunnel() {
+			LogTunnel(Rec, Bytes[0], Bytes[1], &Phases);
+		}
+	};
+
+	Task<void> AcceptLoop(int fd) {
+		AsyncSocket sockListen(*this, fd);
+		while (!m_bStop)
+			Spawn(Handshake(co_await sockListen.Accept()));
+	}
+
+	// i is the direction: 0 client -> target, 1 target -> client. Idle, it holds only this frame and Forward()'s
+	static Task<void> Pump(shared_ptr<Tunnel> t, int i) {
+		AsyncSocket& from = i ? t->SockD : t->Sock, & to = i ? t->Sock : t->SockD;
+		try {
+			while (size_t n = co_await from.Forward(to)) {
+				if (!t->Phases.T[PhaseTimes::FirstByte])
+					t->Phases.Mark(PhaseTimes::FirstByte);
+				t->Bytes[i] += n;
+			}
+			::shutdown(to.Fd, SHUT_WR);
+		} catch (RCExc) {
+			::shutdown(from.Fd, SHUT_RDWR);
+			::shutdown(to.Fd, SHUT_RDWR);
+		}
+	}
+
+	// Bounded by connect_timeout. From the source pool, the next source address on EADDRNOTAVAIL as in
+	// CSourceAddressPool::Connect(); else marked with -M
+	static Task<error_code> ConnectAddress(Tunnel& t, const IPEndPoint& ep) {
+		int family = ep.c_sockaddr()->sa_family;
+		size_t n = g_sourcePool ? g_sourcePool->Count(family) : 0;
+		uint64_t first = n ? g_sourcePool->First(CSourceAddressPool::Hint(t.Rec.Client, ep)) : 0;
+		for (unsigned attempt = 0;; ++attempt) {
+			int fd = n ? g_sourcePool->OpenSocket(ep, first, attempt, SOCK_CLOEXEC | SOCK_NONBLOCK)
+				: g_upstreamMark ? OpenUpstreamSocket(family, SOCK_CLOEXEC | SOCK_NONBLOCK) : -1;
+			t.SockD.SetDeadline(chrono::milliseconds(t.Cfg->ConnectTimeoutMs));
+			error_code ec = co_await t.SockD.Connect(ep, fd);
+			t.SockD.ClearDeadline();
+			if (!ec)
+				co_return ec;
+			::close(t.SockD.Detach());
+			if (ec != errc::address_not_available || attempt + 1 >= n)
+				co_return ec;
+			++g_sourcePool->AddrNotAvail;
+		}
+	}
+
+	Task<void> Handshake(int fd) {
+		shared_ptr<Tunnel> t = make_shared<Tunnel>(*this, fd);
+		AsyncStream stm(t->Sock);
+		CProxyRelayHolder relay;
+		CProxyQuery target;
+		if (!t->Slot.Admitted) {
+			t->Rec.Error = int(errc::too_many_files_open);
+			co_return;
+		}
+		try {
+			t->Sock.SetDeadline(chrono::milliseconds(t->Cfg->HandshakeTimeoutMs));		// up to the whole request
+			if (g_bProxyProtocolIn) {
+				ProxyProtocolHeader hdr;
+				for (size_t need = 1;;) {
+					Span s = co_await stm.Peek(need);
+					if (size_t n = ParseProxyHeader(s.data(), s.size(), hdr)) {
+						stm.Skip(n);
+						break;
+					}
+					need = s.size() + 1;
+				}
+				if (hdr.Src.IsIP())
+					t->Rec.Client = hdr.Src;
+			}
+			HandshakeKind kind = HandshakeKind::Unknown;
+			for (size_t need = 1; kind == HandshakeKind::Unknown;) {
+				Span s = co_await stm.Peek(need);
+				kind = SniffHandshake(s);
+				need = s.size() + 1;
+			}
+			t->Phases.Mark(PhaseTimes::Version);
+			switch (kind) {
+			case HandshakeKind::Invalid:
+			case HandshakeKind::Tls:
+			case HandshakeKind::ProxyHeader:
+				t->Rec.Error = int(errc::protocol_error);
+				co_return;
+			default:
+				break;
+			}
+			uint8_t ver = t->Rec.Ver = co_await stm.ReadByte();
+			relay.Emplace(kind).m_pUsers = &t->Cfg->Users;
+			target = co_await relay->GetQueryAsync(stm, ver);
+			t->Phases.Mark(PhaseTimes::Query);
+			t->Sock.ClearDeadline();
+		} catch (const system_error& ex) {
+			t->Rec.Error = ex.code().value();
+			throw;
+		}
+		t->Rec.Typ = target.Typ;
+		t->Rec.Target = target.Ep;
+		t->Entry.Describe(t->Rec.Client, t->Rec.Target);
+		t->Entry.SetState(TunnelState::Connect);
+
+		ProxyEndPoint epResult;
+		error_code ec;
+		if (!t->Cfg->IsAllowed(target.Ep))
+			ec = make_error_code(errc::permission_denied);
+		else switch (target.Typ) {
+		case QueryType::Connect:
+			if (g_circuitBreaker && !g_circuitBreaker->Admit(target.Ep, ec))
+				break;
+			if (target.Ep.IsIP()) {
+				epResult = target.Ep;
+				ec = co_await ConnectAddress(*t, epResult.ToIPEndPoint());
+			} else {												// only the lookup blocks, on the offload threads
+				vector<ResolvedAddress> addrs;
+				if (!g_resolverCache.TryLookup(QueryType::Resolve, target.Ep, epResult, ec, &addrs))
+					co_await Offload([&target, &epResult, &ec, &addrs] {
+						g_resolverCache.Lookup(QueryType::Resolve, target.Ep, epResult, ec, &addrs);
+					});
+				t->Phases.Mark(PhaseTimes::Resolve);
+				if (!ec)
+					ec = OrderAddresses(addrs, *t->Cfg, target.Ep.Port);
+				if (!ec)
+					for (auto& a : addrs) {								// in turn, as a DnsEndPoint connect does
+						epResult = a.ToEndPoint(target.Ep.Port);
+						if (!(ec = co_await ConnectAddress(*t, epResult.ToIPEndPoint())))
+							break;
+					}
+			}
+			if (!ec)
+				t->Phases.Mark(PhaseTimes::Connect);
+			if (g_circuitBreaker)
+				g_circuitBreaker->OnResult(target.Ep, ec);
+			break;
+		case QueryType::Resolve:
+		case QueryType::RevResolve:
+			if (!g_resolverCache.TryLookup(target.Typ, target.Ep, epResult, ec))
+				co_await Offload([&target, &epResult, &ec] {
+					g_resolverCache.Lookup(target.Typ, target.Ep, epResult, ec);
+				});
+			t->Phases.Mark(PhaseTimes::Resolve);
+			break;
+		default:
+			ec = make_error_code(errc::operation_not_supported);
+		}
+		if (ec) {
+			t->Rec.Error = ec.value();
+			co_await relay->SendReplyAsync(stm, ProxyEndPoint(), ec);
+			t->Phases.Mark(PhaseTimes::Reply);
+			co_return;
+		}
+		co_await relay->SendReplyAsync(stm, epResult);
+		t->Phases.Mark(PhaseTimes::Reply);
+		if (target.Typ != QueryType::Connect)
+			co_return;
+		t->Entry.SetState(TunnelState::Relay, t->SockD.Fd);
+		{
+			uint8_t hdr[PROXY_V2_MAX_SIZE];
+			SendVector upstream;
+			if (g_bProxyProtocolOut)
+				upstream.Add(hdr, FormatProxyHeaderV2(hdr, t->Rec.Client, epResult));
+			relay->AfterConnect(upstream);
+			Span early = stm.Unread();
+			upstream.Add(early);
+			t->Bytes[0] += early.size();
+			co_await t->SockD.Send(upstream);
+		}
+
+		Spawn(Pump(t, 1));										// this frame, with the read-ahead buffer and the relay, is freed now
+		Spawn(Pump(move(t), 0));
+	}
+};
+
+#endif // UCFG_INET_COROUTINES
+
+// Why cfg can't be used with these listeners, nullptr if it can
+static const char *CheckConfig(const ProxyConfig& cfg, bool bTransparent, bool bMux) {
+	if (bTransparent && !cfg.Users.empty())
+		return "-r takes no password: user lines need it off";
+	if (bMux && cfg.MuxSecret.empty())
+		return "-u and -U need a mux_secret line in the -f config";
+	return nullptr;
+}
+
+#if UCFG_USE_POSIX
+
+// Waits for SIGHUP, blocked in every other thread, and publishes the re-read config. A bad file keeps the current one
+class CConfigReloadThread : public Thread {
+	typedef Thread base;
+public:
+	CConfigReloadThread(thread_group& tg, const path& p, AutoResetEvent& evReloaded, volatile bool& bReloaded, bool bTransparent, bool bMux)
+		: base(&tg)
+		, m_path(p)
+		, m_evReloaded(evReloaded)
+		, m_bReloaded(bReloaded)
+		, m_bTransparent(bTransparent)
+		, m_bMux(bMux)
+	{}
+protected:
+	path m_path;
+	AutoResetEvent& m_evReloaded;
+	volatile bool& m_bReloaded;
+	bool m_bTransparent, m_bMux;								// -r, -u or -U are running
+
+	void Execute() override {
+		sigset_t ss;
+		sigemptyset(&ss);
+		sigaddset(&ss, SIGHUP);
+		const timespec ts = { 1, 0 };								// polls m_bStop
+		while (!m_bStop) {
+			if (::sigtimedwait(&ss, nullptr, &ts) != SIGHUP)
+				continue;
+			try {
+				auto cfg = make_shared<ProxyConfig>();
+				cfg->Load(m_path);
+				if (const char *err = CheckConfig(*cfg, m_bTransparent, m_bMux)) {
+					cerr << "Config is not reloaded: " << err << endl;
+					continue;
+				}
+				g_config.Publish(cfg);
+				if (g_muxClient)
+					g_muxClient->SetSecret(cfg->MuxSecret);
+				cerr << "Config reloaded from " << m_path << endl;
+				m_bReloaded = true;
+				m_evReloaded.Set();
+			} catch (const exception& ex) {
+				cerr << "Config is not reloaded: " << ex.what() << endl;
+			}
+		}
+	}
+};
+
+#endif // UCFG_USE_POSIX
+
 class CSocksApp : public CConApp {
 	typedef CConApp base;
 public:
@@ -76,14 +1109,98 @@ public:
 	thread_group m_tg;
 	unordered_set<IPAddress> m_ips;
 	AutoResetEvent m_evStop;
-	volatile bool m_bStopListen;
+	volatile bool m_bStopListen, m_bReloaded;
+	uint16_t m_tlsPort, m_muxPort, m_transparentPort;
+	vector<IPEndPoint> m_cfgListeners;
+#if HAVE_LINUX_IO_URING_H
+	ptr<CSocksUringEngine> m_engine;
+#endif
+#if UCFG_INET_COROUTINES
+	ptr<CSocksCoroLoop> m_coroLoop;
+#endif
+	ptr<CAccessLog> m_accessLog;
+	unique_ptr<CPhaseTracer> m_phaseTracer;
+	unique_ptr<CSocksWorkerPool> m_pool;
+	unique_ptr<CCircuitBreaker> m_circuitBreaker;
+	unique_ptr<CSourceAddressPool> m_sourcePool;
+#if UCFG_INET_TLS
+	unique_ptr<CTlsContext> m_tlsContext;
+#endif
+	unique_ptr<CHttpCache> m_httpCache;
+	unique_ptr<CMuxClient> m_muxClient;
+	unique_ptr<CTunnelTable> m_tunnelTable;
+#if HAVE_LINUX_BPF_H
+	unique_ptr<CSockMap> m_sockMap;
+#endif
 
 	CSocksApp()
 		:	m_bStopListen(false)
+		,	m_bReloaded(false)
+		,	m_tlsPort(0)
+		,	m_muxPort(0)
+		,	m_transparentPort(0)
  	{
 	}
 
-	void StartListen(const IPAddress& ip, uint16_t port) {
+	// Listeners are only added: one removed from the config keeps running until restart
+	void StartConfigListeners() {
+		for (auto& ep : g_config.Get()->Listeners)
+			if (find(m_cfgListeners.begin(), m_cfgListeners.end(), ep) == m_cfgListeners.end()) {
+				m_cfgListeners.push_back(ep);
+				StartListen(ep.Address, ep.Port);
+			}
+	}
+
+	// Plain and, with -s, TLS listener on ip. With -U also one for edge instances, with -r one for redirected connections
+	void StartListeners(const IPAddress& ip, uint16_t port) {
+		StartListen(ip, port);
+		if (m_tlsPort)
+			StartListen(ip, m_tlsPort, true);
+#if UCFG_INET_TRANSPARENT
+		if (m_transparentPort) {
+			ptr<CTransparentListenerThread> p = new CTransparentListenerThread(m_tg, IPEndPoint(ip, m_transparentPort));
+#	if HAVE_LINUX_IO_URING_H
+			p->m_engine = m_engine.get();
+#	endif
+			p->Start();
+		}
+#endif
+		if (m_muxPort) {
+			ptr<ListenerThread<CMuxPeerThread>> p = new ListenerThread<CMuxPeerThread>(m_tg, IPEndPoint(ip, m_muxPort));
+			p->m_sockListen.ReuseAddress = true;
+			p->Start();
+		}
+	}
+
+	void StartListen(const IPAddress& ip, uint16_t port, bool bTls = false) {
+#if UCFG_INET_TLS
+		if (bTls) {
+			ptr<ListenerThread<CTlsSocksThread>> p = new ListenerThread<CTlsSocksThread>(m_tg, IPEndPoint(ip, port));
+			p->m_sockListen.ReuseAddress = true;
+			p->Start();
+			return;
+		}
+#endif
+#if UCFG_INET_COROUTINES
+		if (m_coroLoop) {
+			m_coroLoop->AddListener(IPEndPoint(ip, port));
+			m_ips.insert(ip);
+			return;
+		}
+#endif
+#if HAVE_LINUX_IO_URING_H
+		if (m_engine) {
+			m_engine->AddListener(IPEndPoint(ip, port));
+			m_ips.insert(ip);
+			return;
+		}
+#endif
+		if (m_pool) {
+			ptr<CPoolListenerThread> p = new CPoolListenerThread(m_tg, *m_pool, IPEndPoint(ip, port));
+			m_ips.insert(ip);
+			p->Start();
+			return;
+		}
 		ptr<ListenerThread<CSocksThread>> p = new ListenerThread<CSocksThread>(m_tg, IPEndPoint(ip, port));
 		p->m_sockListen.ReuseAddress = true;
 		m_ips.insert(ip);
@@ -91,25 +1208,148 @@ public:
 	}
 
  	void PrintUsage() {
-		cout << "Usage: " << System.get_ExeFilePath().stem() << " {-l ip -p port}" << "\n";
+		cout << "Usage: " << System.get_ExeFilePath().stem() << " {-l ip -p port -e engine -a file -F format -P in|out|both -c cpus -S core|node -w min,max -b seconds -o ip,... -O rr|hash -f file -T n -t file -s port -C cert -K key -m MiB -d dir[,MiB] -u host:port[,n] -U port -r port -M mark -A path}" << "\n";
 		cout << "  -p port       Listening port, by default 1080\n"
 			 << "  -l ip[,ip...] Bind IPs, by default non-global\n"
+			 << "  -e engine     threads (default) | splice | sockmap | uring | coro\n"
+			 << "                splice relays through kernel pipes without copying to user space,\n"
+			 << "                sockmap redirects tunnels inside the kernel by an eBPF program (needs CAP_BPF),\n"
+			 << "                uring falls back to threads if io_uring is unavailable,\n"
+			 << "                coro runs handshakes and relay as coroutines on one epoll thread\n"
+			 << "  -a file       Access log, one record per tunnel, rotated at 64 MiB\n"
+			 << "  -A path       Admin Unix socket: list [filter] | kill filter | count | stats, one command per connection.\n"
+			 << "                Filter: id=n client=pattern target=pattern state=handshake|connect|relay age=seconds\n"
+			 << "  -F format     Access log format: json (default, one object per line) | binary\n"
+			 << "  -P mode       PROXY protocol: in - require a v1/v2 header on accepted connections,\n"
+			 << "                out - send a v2 header to upstreams, both\n"
+			 << "  -c cpus       Run all threads on these CPUs, e.g. 0-7,16-23\n"
+			 << "  -S steering   Move each connection thread next to its RX queue (SO_INCOMING_CPU):\n"
+			 << "                core - onto that CPU, node - onto its NUMA node\n"
+			 << "  -w min,max    Worker pool instead of a thread per connection: min threads are kept,\n"
+			 << "                up to max run at once, extra ones exit after 30 s idle\n"
+			 << "  -b seconds    Fail connects to a destination that just refused or timed out for this long,\n"
+			 << "                doubling up to 60 s while probes fail. By default off\n"
+			 << "  -o ip[,ip...] Outbound source addresses, each adds its own ephemeral port range per destination\n"
+			 << "  -O selection  rr (default) - round robin, hash - by client address and destination\n"
+			 << "  -T n          Time handshake phases into histograms printed on exit, trace every n-th connection (default 1000)\n"
+			 << "  -t file       Phase trace output, one JSON line per sampled connection. Implies -T\n"
+			 << "  -s port       TLS listening port on the same IPs: SOCKS or HTTP proxy inside TLS, kTLS after the handshake\n"
+			 << "  -C file       TLS certificate chain, PEM\n"
+			 << "  -K file       TLS private key, PEM, by default in the -C file\n"
+			 << "  -m MiB        Cache plain HTTP GET responses, objects up to 64 KiB in this much memory\n"
+			 << "  -d dir[,MiB]  Larger cached objects in files under dir, up to 1024 MiB by default. Implies -m 64\n"
+			 << "  -u host:port[,n] Forward tunnels to the socksd at host:port -U port, multiplexed over n connections (default 4)\n"
+			 << "  -U port       Accept multiplexed tunnels from -u instances on the same IPs. Both need mux_secret in the config\n"
+			 << "  -r port       Transparent listening port on the same IPs for connections redirected by iptables REDIRECT\n"
+			 << "                or TPROXY (needs CAP_NET_ADMIN): no handshake, the original destination is connected\n"
+			 << "  -M mark       SO_MARK of upstream sockets (needs CAP_NET_ADMIN): exclude it from an OUTPUT REDIRECT rule\n"
+			 << "  -f file       Config: listeners, limits, timeouts, allow/deny rules, users, mux_secret. Re-read on SIGHUP\n"
 			<< endl;
 	}
 
 	void Execute() override	{
-#if UCFG_USE_POSIX
-		signal(SIGHUP, SIG_IGN);
-#endif
 
 		vector<IPAddress> ips;
 		uint16_t port = 1080;
+		String engine = "threads", accessLogPath, accessLogFormat = "json";
+		size_t poolMin = 0, poolMax = 0;
+		int backoff = 0;
+		vector<IPAddress> sourceIps;
+		SourceSelection sourceSelection = SourceSelection::RoundRobin;
+		path configPath;
+		String tracePath, certFile, keyFile, cacheDir, adminPath;
+		int traceEvery = -1;
+		size_t cacheMem = 0, cacheDisk = 1024;
+		string muxPeer;
 
-		for (int arg; (arg = getopt(Argc, Argv, "hl:p:")) != EOF;) {
+		for (int arg; (arg = getopt(Argc, Argv, "a:A:b:c:C:d:f:F:K:m:M:o:O:P:r:s:S:t:T:u:U:w:he:l:p:")) != EOF;) {
 			switch (arg) {
+			case 's':
+				m_tlsPort = uint16_t(atoi(optarg));
+				break;
+			case 'C':
+				certFile = optarg;
+				break;
+			case 'K':
+				keyFile = optarg;
+				break;
+			case 'T':
+				traceEvery = atoi(optarg);
+				break;
+			case 't':
+				tracePath = optarg;
+				break;
+			case 'f':
+				configPath = optarg;
+				break;
+			case 'm':
+				cacheMem = atoi(optarg);
+				break;
+			case 'u':
+				muxPeer = optarg;
+				break;
+			case 'U':
+				m_muxPort = uint16_t(atoi(optarg));
+				break;
+			case 'r':
+				m_transparentPort = uint16_t(atoi(optarg));
+				break;
+			case 'M':
+				g_upstreamMark = uint32_t(strtoul(optarg, nullptr, 0));
+				break;
+			case 'd':
+				{
+					auto v = String(optarg).Split(",");
+					cacheDir = v[0];
+					if (v.size() > 1)
+						cacheDisk = atoi(v[1]);
+				}
+				break;
+			case 'o':
+				for (auto s : String(optarg).Split(","))
+					sourceIps.push_back(IPAddress::Parse(s));
+				break;
+			case 'O':
+				sourceSelection = !strcmp(optarg, "hash") ? SourceSelection::Hash : SourceSelection::RoundRobin;
+				break;
+			case 'b':
+				backoff = atoi(optarg);
+				break;
+			case 'w':
+				if (sscanf(optarg, "%zu,%zu", &poolMin, &poolMax) < 2)
+					poolMax = poolMin;
+				break;
+#if UCFG_INET_AFFINITY
+			case 'c':
+				SetProcessAffinity(ParseCpuList(optarg));				// before any thread starts, listeners and engines inherit it
+				break;
+			case 'S':
+				g_steering = !strcmp(optarg, "core") ? Steering::Core : !strcmp(optarg, "node") ? Steering::Node : Steering::None;
+				break;
+#endif
+			case 'a':
+				accessLogPath = optarg;
+				break;
+			case 'A':
+				adminPath = optarg;
+				break;
+			case 'F':
+				accessLogFormat = optarg;
+				break;
+			case 'P':
+				if (strcmp(optarg, "in") && strcmp(optarg, "out") && strcmp(optarg, "both")) {
+					cerr << "-P needs in, out or both" << endl;
+					return;
+				}
+				g_bProxyProtocolIn = !strcmp(optarg, "in") || !strcmp(optarg, "both");
+				g_bProxyProtocolOut = !strcmp(optarg, "out") || !strcmp(optarg, "both");
+				break;
 			case 'h':
 				PrintUsage();
 				return;
+			case 'e':
+				engine = optarg;
+				break;
 			case 'l':
 				for (auto s : String(optarg).Split(","))
 					ips.push_back(IPAddress::Parse(s));
@@ -120,17 +1360,181 @@ public:
 			}
 		}
 
+		if (!configPath.empty()) {
+			auto cfg = make_shared<ProxyConfig>();
+			cfg->Load(configPath);
+			g_config.Publish(cfg);
+		}
+		if (const char *err = CheckConfig(*g_config.Get(), m_transparentPort, m_muxPort || !muxPeer.empty())) {
+			cerr << err << endl;
+			return;
+		}
+
+#if UCFG_USE_POSIX
+		if (configPath.empty())
+			signal(SIGHUP, SIG_IGN);
+		else {
+			sigset_t ss;										// before any thread starts, they all inherit the mask
+			sigemptyset(&ss);
+			sigaddset(&ss, SIGHUP);
+			pthread_sigmask(SIG_BLOCK, &ss, nullptr);
+		}
+#endif
+
+		if (g_upstreamMark) {
+			int fd = CCheck(::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP));
+			int r = ::setsockopt(fd, SOL_SOCKET, SO_MARK, &g_upstreamMark, sizeof g_upstreamMark);
+			::close(fd);
+			if (r < 0) {
+				cerr << "-M needs CAP_NET_ADMIN" << endl;
+				return;
+			}
+		}
+
+		if (!sourceIps.empty()) {
+			m_sourcePool.reset(new CSourceAddressPool(sourceSelection));
+			m_sourcePool->Mark = g_upstreamMark;
+			for (auto& ip : sourceIps)
+				m_sourcePool->Add(ip);
+			g_sourcePool = m_sourcePool.get();
+		}
+
+		if (backoff > 0) {
+			m_circuitBreaker.reset(new CCircuitBreaker(65536, chrono::seconds(backoff)));
+			g_circuitBreaker = m_circuitBreaker.get();
+		}
+
+		if (m_tlsPort) {
+#if UCFG_INET_TLS
+			if (certFile.empty()) {
+				cerr << "-s needs a certificate: -C file" << endl;
+				return;
+			}
+			m_tlsContext.reset(new CTlsContext(certFile, keyFile.empty() ? certFile : keyFile));
+			g_tlsContext = m_tlsContext.get();
+#else
+			cerr << "Built without OpenSSL, TLS listeners are disabled" << endl;
+			m_tlsPort = 0;
+#endif
+		}
+
+		if (traceEvery >= 0 || !tracePath.empty()) {
+			PhaseClock::Calibrate();
+			m_phaseTracer.reset(new CPhaseTracer(traceEvery >= 0 ? traceEvery : 1000, tracePath));
+			g_phaseTracer = m_phaseTracer.get();
+		}
+
+		if (cacheMem || !cacheDir.empty()) {
+			m_httpCache.reset(new CHttpCache(size_t(cacheMem ? cacheMem : 64) << 20, cacheDir, uint64_t(cacheDisk) << 20));
+			g_httpCache = m_httpCache.get();
+		}
+
+		if (!muxPeer.empty()) {
+			size_t comma = muxPeer.find(','), colon = muxPeer.rfind(':', comma);
+			string host = muxPeer.substr(0, colon);
+			if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+				host = host.substr(1, host.size() - 2);
+			if (colon == string::npos || host.empty()) {
+				cerr << "-u needs host:port" << endl;
+				return;
+			}
+			ProxyEndPoint peer = ProxyEndPoint::Parse(host.c_str(), host.size(), uint16_t(atoi(muxPeer.c_str() + colon + 1)));
+			m_muxClient.reset(new CMuxClient(&m_tg, peer, comma == string::npos ? 4 : atoi(muxPeer.c_str() + comma + 1)));
+			m_muxClient->SetSecret(g_config.Get()->MuxSecret);
+			m_muxClient->Mark = g_upstreamMark;
+			g_muxClient = m_muxClient.get();
+		}
+
+		if (!adminPath.empty()) {
+			m_tunnelTable.reset(new CTunnelTable);
+			g_tunnelTable = m_tunnelTable.get();
+			ptr<CTunnelAdmin> t = new CTunnelAdmin(&m_tg, *m_tunnelTable, adminPath);
+			t->Stats = [this] {
+				return "{\"tunnels\":" + to_string(m_tunnelTable->Count()) + (m_httpCache ? ",\"http_cache\":" + m_httpCache->Stats() : string()) + "}";
+			};
+			t->Start();
+		}
+
+		if (!accessLogPath.empty()) {
+			m_accessLog = new CAccessLog(&m_tg, accessLogPath, accessLogFormat == "binary" ? AccessLogFormat::Binary : AccessLogFormat::JsonLines);
+			m_accessLog->Start();
+			g_accessLog = m_accessLog.get();
+		}
+
+		if (engine == "uring") {
+#if HAVE_LINUX_IO_URING_H
+			try {
+				if (!IoUring::IsSupported())
+					Throw(errc::function_not_supported);
+				m_engine = new CSocksUringEngine(m_tg);		// ring setup and buffer registration can still fail here
+				m_engine->Start();
+			} catch (const exception& ex) {
+				m_engine = nullptr;
+				cerr << "io_uring is not available (" << ex.what() << "), using thread per connection" << endl;
+			}
+#else
+			cerr << "Built without io_uring support, using thread per connection" << endl;
+#endif
+		} else if (engine == "splice") {
+#if UCFG_INET_SPLICE
+			CSocksThread::s_bSplice = true;
+#else
+			cerr << "splice() is not available, using copy loop" << endl;
+#endif
+		} else if (engine == "sockmap") {
+#if HAVE_LINUX_BPF_H
+			try {
+				m_sockMap.reset(new CSockMap);
+				CSocksThread::s_sockMap = m_sockMap.get();
+			} catch (const exception& ex) {
+				cerr << "BPF sockmap is not available (" << ex.what() << "), using copy loop" << endl;
+			}
+#else
+			cerr << "Built without BPF sockmap support, using copy loop" << endl;
+#endif
+		} else if (engine == "coro") {
+#if UCFG_INET_COROUTINES
+			m_coroLoop = new CSocksCoroLoop(m_tg);
+			m_coroLoop->Start();
+#else
+			cerr << "Built without C++20 coroutines, using thread per connection" << endl;
+#endif
+		}
+
+		bool bPool = poolMax;										// only thread per connection engines use it
+#if HAVE_LINUX_IO_URING_H
+		bPool = bPool && !m_engine;
+#endif
+#if UCFG_INET_COROUTINES
+		bPool = bPool && !m_coroLoop;
+#endif
+		if (bPool) {
+			m_pool.reset(new CSocksWorkerPool(m_tg, poolMin, poolMax));
+			m_pool->Start();
+		}
+
 		for (auto& ip : ips)
-			StartListen(ip, port);
-		StartListen(IPAddress::Loopback, port);
+			StartListeners(ip, port);
+		StartListeners(IPAddress::Loopback, port);
+		StartConfigListeners();
+#if UCFG_USE_POSIX
+		if (!configPath.empty()) {
+			ptr<CConfigReloadThread> t = new CConfigReloadThread(m_tg, configPath, m_evStop, m_bReloaded, m_transparentPort, m_muxPort || !muxPeer.empty());
+			t->Start();
+		}
+#endif
 
 		while (!m_bStopListen) {
+			if (m_bReloaded) {
+				m_bReloaded = false;
+				StartConfigListeners();
+			}
 			vector<IPAddress> dynIps;
  			if (ips.empty()) {
  				dynIps = IPAddrInfo().GetIPAddresses();
    				for (auto& ip : dynIps) {
    					if (!m_ips.count(ip) && (ListenGlobalIP || !ip.IsGlobal()))
-						StartListen(ip, port);
+						StartListeners(ip, port);
    				}
    			}
 
@@ -139,6 +1543,38 @@ public:
 		m_tg.interrupt_all();
 		m_tg.join_all();
 		m_tg.m_bSync = false;
+		if (m_phaseTracer)
+			m_phaseTracer->Print(cerr);
+#if UCFG_INET_TLS
+		if (m_tlsContext && m_tlsContext->Handshakes)
+			cerr << "TLS: " << m_tlsContext->Handshakes << " handshakes, " << m_tlsContext->Resumed << " resumed, kTLS took "
+				<< m_tlsContext->KernelTx << " send and " << m_tlsContext->KernelRx << " receive directions" << endl;
+#endif
+		if (m_httpCache) {
+			uint64_t hits = m_httpCache->Hits + m_httpCache->Revalidated, requests = hits + m_httpCache->Misses;
+			if (requests)
+				cerr << "HTTP cache: " << hits << " of " << requests << " requests served from the cache (" << hits * 100 / requests << "%), "
+					<< m_httpCache->Revalidated << " revalidated, " << (m_httpCache->BytesSaved >> 20) << " MiB saved" << endl;
+		}
+		if (m_muxClient && m_muxClient->Opened)
+			cerr << "Tunnel mux: " << m_muxClient->Opened << " tunnels opened through the peer, " << m_muxClient->Reconnects << " reconnects" << endl;
+		if (m_circuitBreaker && m_circuitBreaker->FastFailed)
+			cerr << "Circuit breaker: " << m_circuitBreaker->FastFailed << " connects failed fast, destinations opened " << m_circuitBreaker->Opened << " times" << endl;
+		if (m_sourcePool && m_sourcePool->AddrNotAvail)
+			cerr << "Source addresses: " << m_sourcePool->AddrNotAvail << " connects retried on EADDRNOTAVAIL" << endl;
+		if (m_pool)
+			cerr << "Worker pool: " << m_pool->Spawned << " threads spawned, " << m_pool->Rejected << " connections rejected on a full queue" << endl;
+		if (m_accessLog && m_accessLog->Dropped())
+			cerr << "Access log: " << m_accessLog->Dropped() << " records dropped" << endl;
+#if UCFG_INET_AFFINITY
+		if (uint64_t remote = g_placement.RemoteTunnels)
+			cerr << "Placement: " << g_placement.LocalTunnels << " tunnels relayed on their RX node, " << remote << " on another node carrying "
+				<< (g_placement.RemoteBytes >> 20) << " MiB across the interconnect" << endl;
+#endif
+#if HAVE_LINUX_BPF_H
+		if (m_sockMap)
+			cerr << "Sockmap: " << m_sockMap->Offloaded << " tunnels offloaded, " << m_sockMap->Refused << " relayed in user space" << endl;
+#endif
 	}
 
 	bool OnSignal(int sig) override {